@@ -0,0 +1,27 @@
+# Measures converting large JavaScript arrays to Ruby.
+#
+#   rake bench
+$LOAD_PATH << File.expand_path('../lib', __dir__) << File.expand_path('../ext/duktape', __dir__)
+require 'duktape'
+require 'benchmark'
+
+SIZE = 1_000_000
+ROUNDS = 5
+
+ctx = Duktape::Context.new
+ctx.exec_string <<-JS
+  var ints = [], floats = [], nested = [];
+  for (var i = 0; i < #{SIZE}; i++) {
+    ints.push(i);
+    floats.push(i / 3);
+  }
+  for (var i = 0; i < #{SIZE / 10}; i++) {
+    nested.push([i, i + 1, i + 2, i + 3, i + 4, i + 5, i + 6, i + 7, i + 8, i + 9]);
+  }
+JS
+
+Benchmark.bm(30) do |x|
+  x.report("#{SIZE} integers x#{ROUNDS}") { ROUNDS.times { ctx.get_prop('ints') } }
+  x.report("#{SIZE} floats x#{ROUNDS}") { ROUNDS.times { ctx.get_prop('floats') } }
+  x.report("#{SIZE / 10} x 10 nested x#{ROUNDS}") { ROUNDS.times { ctx.get_prop('nested') } }
+end
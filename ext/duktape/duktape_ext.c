@@ -1,10 +1,33 @@
 #include "ruby.h"
 #include "ruby/encoding.h"
+#include "ruby/thread.h"
 #include "duktape.h"
+#include <errno.h>
+#include <setjmp.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#endif
 
 static VALUE mDuktape;
 static VALUE cContext;
 static VALUE cComplexObject;
+static VALUE cScript;
+static VALUE cFunction;
+static VALUE cRawJSON;
+static VALUE cObjectRef;
+static VALUE cHandle;
+static VALUE cExecutor;
+static VALUE cFuture;
 static VALUE oComplexObject;
 
 static VALUE eUnimplementedError;
@@ -14,6 +37,7 @@ static VALUE eAllocError;
 static VALUE eAssertionError;
 static VALUE eAPIError;
 static VALUE eUncaughtError;
+static VALUE eFutureTimeoutError;
 
 static VALUE eError;
 static VALUE eEvalError;
@@ -22,681 +46,5256 @@ static VALUE eReferenceError;
 static VALUE eSyntaxError;
 static VALUE eTypeError;
 static VALUE eURIError;
-static rb_encoding *utf16enc;
 
 static VALUE sDefaultFilename;
 static ID id_complex_object;
+static ID id_iv_bytecode;
+static ID id_iv_filename;
+static ID id_iv_json;
+static ID id_bytecode_cache;
+static ID id_marshal;
+static ID id_symbolize_keys;
+static ID id_cbor;
+static ID id_fetch;
+static ID id_lazy;
+static ID id_max_depth;
+static ID id_eval_cache;
+static ID id_eval_cache_max_source;
+static ID id_binread;
+static ID id_methods;
+static ID id_exception;
+static ID id_binary;
 
 static int ctx_push_hash_element(VALUE key, VALUE val, VALUE extra);
 
-static unsigned long
-utf8_to_uv(const char *p, long *lenp);
+// Maximum number of object keys remembered by a context
+#define KEY_CACHE_SIZE 4096
+
+// Longer JavaScript arrays are read by enumerating their elements, since
+// their length can be much larger than the number of elements
+#define ARRAY_READ_MAX 65536
+
+// Default maximum nesting of converted Arrays and Hashes
+#define DEFAULT_MAX_DEPTH 1000
+
+// Maximum nesting with marshal: :cbor, which Duktape's encoder and decoder
+// can't go beyond
+#define CBOR_MAX_DEPTH DUK_USE_CBOR_DEC_RECLIMIT
+
+// Default number of functions compiled by eval_string kept by a context
+#define DEFAULT_EVAL_CACHE_SIZE 64
+
+// Default length of the longest source kept by the eval cache. Longer ones
+// are compiled every time.
+#define DEFAULT_EVAL_CACHE_MAX_SOURCE 4096
 
 #define clean_raise(ctx, ...) (duk_set_top(ctx, 0), rb_raise(__VA_ARGS__))
 #define clean_raise_exc(ctx, ...) (duk_set_top(ctx, 0), rb_exc_raise(__VA_ARGS__))
 
-struct state {
+struct int_list {
+  int *ptr;
+  long len;
+  long capa;
+};
+
+/*
+ * A Duktape heap which may be shared between several contexts (see
+ * Context#new_realm). It's reference counted and destroyed together with the
+ * last context or object using it.
+ */
+struct heap {
   duk_context *ctx;
   int is_fatal;
+  int refcount;
+  int next_ref;
+  struct int_list free_refs;
+  struct int_list pending_unrefs;
+  struct callback *callbacks;
+  long callbacks_len;
+  long callbacks_capa;
+  long callbacks_used;
+  long free_callback;
+  VALUE lock;
+  VALUE lock_owner;
+  int lock_depth;
+  int without_gvl;
+  jmp_buf *fatal_jmp;
+  char fatal_msg[256];
+  VALUE callback_error;
+  void *callback_error_ptr;
+  int executor;
+};
+
+/*
+ * A block passed to Context#define_function, or a method of an object passed
+ * to Context#define_object. JavaScript functions calling it store its index
+ * in the heap's callback table as their magic value. The entry is cleared
+ * and freed when the context is garbage collected. Functions created after
+ * it has been reused also store its generation, so older functions can tell
+ * it isn't theirs anymore.
+ *
+ * The entries of a context are linked through next, starting at its
+ * callbacks_head, and so are free entries.
+ */
+struct callback {
+  VALUE block;
+  VALUE recv;
+  ID mid;
+  struct state *state;
+  long next;
+  unsigned long generation;
+};
+
+/*
+ * An Array or Hash being converted by ctx_stack_to_value or
+ * ctx_push_ruby_object. When pushing, top is the start of a Hash's pairs in
+ * the pending list, or -1 for an Array.
+ */
+struct frame {
+  VALUE obj;
+  duk_idx_t index;
+  duk_idx_t enum_index;
+  duk_idx_t top;
+  duk_size_t pos;
+  duk_size_t length;
+};
+
+/*
+ * A function compiled by eval_string, kept in the heap stash.
+ */
+struct eval_cache_entry {
+  VALUE key;
+  int ref;
+  unsigned long used;
+};
+
+struct state {
+  duk_context *ctx;
+  struct heap *heap;
+  int realm_ref;
   VALUE complex_object;
   int was_complex;
-  VALUE blocks;
+  long callbacks_head;
+  VALUE bytecode_cache;
+  int marshal_cbor;
+  int symbolize_keys;
+  int binary;
+  st_table *key_cache;
+  int key_cache_ref;
+  st_table *seen_js;
+  duk_idx_t seen_idx;
+  st_table *seen_ruby;
+  int max_depth;
+  struct frame *frames;
+  long frames_len;
+  long frames_capa;
+  struct frame *push_frames;
+  long push_frames_len;
+  long push_frames_capa;
+  VALUE *pending;
+  long pending_len;
+  long pending_capa;
+  VALUE eval_cache;
+  struct eval_cache_entry *eval_entries;
+  int eval_cache_capa;
+  long eval_cache_max_source;
+  int eval_cache_len;
+  unsigned long eval_cache_clock;
+  unsigned long eval_cache_hits;
+  unsigned long eval_cache_misses;
 };
 
 static void error_handler(void *, const char *);
 static void check_fatal(struct state *);
-
-static void ctx_dealloc(void *ptr)
+static void ctx_push_script(struct state *, VALUE);
+static void raise_ctx_error(struct state *);
+static void ctx_push_raw_json(struct state *, VALUE);
+static void ctx_push_ref(struct state *, VALUE);
+static int is_ref(VALUE);
+static VALUE ctx_stack_to_value(struct state *, int);
+static VALUE ctx_stack_to_value_iter(struct state *, int);
+static VALUE ctx_stack_to_ref(VALUE, struct state *, duk_idx_t, duk_idx_t);
+
+static void int_list_push(struct int_list *list, int value)
 {
-  struct state *state = (struct state *)ptr;
-  duk_destroy_heap(state->ctx);
-  free(state);
+  if (list->len == list->capa) {
+    list->capa = list->capa ? list->capa * 2 : 16;
+    list->ptr = realloc(list->ptr, sizeof(int) * list->capa);
+    if (list->ptr == NULL) {
+      rb_memerror();
+    }
+  }
+  list->ptr[list->len++] = value;
 }
 
-static void ctx_mark(struct state *state)
+static struct heap *heap_create(void)
 {
-  rb_gc_mark(state->complex_object);
-  rb_gc_mark(state->blocks);
+  struct heap *heap = calloc(1, sizeof(struct heap));
+  if (heap == NULL) {
+    rb_memerror();
+  }
+
+  heap->ctx = duk_create_heap(NULL, NULL, NULL, heap, error_handler);
+  heap->refcount = 1;
+  heap->lock = Qnil;
+  heap->lock_owner = Qnil;
+  heap->callback_error = Qnil;
+  heap->free_callback = -1;
+
+  duk_context *ctx = heap->ctx;
+  duk_push_heap_stash(ctx);
+  duk_push_array(ctx);
+  duk_put_prop_string(ctx, -2, "refs");
+  duk_pop(ctx);
+
+  return heap;
 }
 
-static VALUE ctx_alloc(VALUE klass)
+#ifdef HAVE_PTHREAD_H
+// Heaps used by an Executor are released by its workers, without the GVL
+static pthread_mutex_t heap_refcount_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void heap_destroy(struct heap *heap)
 {
-  struct state *state = malloc(sizeof(struct state));
+  duk_destroy_heap(heap->ctx);
+  free(heap->free_refs.ptr);
+  free(heap->pending_unrefs.ptr);
+  free(heap->callbacks);
+  free(heap);
+}
 
-  duk_context *ctx = duk_create_heap(NULL, NULL, NULL, state, error_handler);
+static void heap_release(struct heap *heap)
+{
+  int refcount;
 
-  state->ctx = ctx;
-  state->is_fatal = 0;
-  state->complex_object = oComplexObject;
-  state->blocks = rb_ary_new();
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&heap_refcount_lock);
+  refcount = --heap->refcount;
+  pthread_mutex_unlock(&heap_refcount_lock);
+#else
+  refcount = --heap->refcount;
+#endif
 
-  // Undefine require property
-  duk_push_global_object(ctx);
-  duk_push_string(ctx, "require");
-  duk_del_prop(ctx, -2);
-  duk_set_top(ctx, 0);
+  if (refcount == 0) {
+    heap_destroy(heap);
+  }
+}
 
-  return Data_Wrap_Struct(klass, ctx_mark, ctx_dealloc, state);
+static void heap_unref(struct heap *heap, duk_context *ctx, int ref)
+{
+  duk_push_heap_stash(ctx);
+  duk_get_prop_string(ctx, -1, "refs");
+  duk_push_undefined(ctx);
+  duk_put_prop_index(ctx, -2, ref);
+  duk_pop_2(ctx);
+  int_list_push(&heap->free_refs, ref);
 }
 
-static VALUE error_name_class(const char* name)
+/*
+ * Releases a reference once the heap is used the next time. This is used from
+ * GC callbacks where it's not safe to touch the heap.
+ */
+static void heap_unref_later(struct heap *heap, int ref)
 {
-  if (strcmp(name, "EvalError") == 0) {
-    return eEvalError;
-  } else if (strcmp(name, "RangeError") == 0) {
-    return eRangeError;
-  } else if (strcmp(name, "ReferenceError") == 0) {
-    return eReferenceError;
-  } else if (strcmp(name, "SyntaxError") == 0) {
-    return eSyntaxError;
-  } else if (strcmp(name, "TypeError") == 0) {
-    return eTypeError;
-  } else if (strcmp(name, "URIError") == 0) {
-    return eURIError;
-  } else {
-    return eError;
-  }
+  int_list_push(&heap->pending_unrefs, ref);
 }
 
-static VALUE encode_cesu8(struct state *state, VALUE str)
+/*
+ * Keeps the value at the given index alive until it's released with
+ * heap_unref. Returns the reference.
+ */
+static int heap_ref(struct heap *heap, duk_context *ctx, duk_idx_t idx)
 {
-  duk_context *ctx = state->ctx;
-  VALUE res = rb_str_new(0, 0);
+  idx = duk_normalize_index(ctx, idx);
 
-  VALUE utf16 = rb_str_conv_enc(str, rb_enc_get(str), utf16enc);
-  if (utf16 == str && rb_enc_get(str) != utf16enc) {
-    clean_raise(ctx, rb_eEncodingError, "cannot convert Ruby string to UTF-16");
+  while (heap->pending_unrefs.len > 0) {
+    heap_unref(heap, ctx, heap->pending_unrefs.ptr[--heap->pending_unrefs.len]);
   }
 
-  long len = RSTRING_LEN(utf16) / 2;
-  unsigned short *bytes = (unsigned short *)RSTRING_PTR(utf16);
-
-  char buf[8];
-
-  for (int i = 0; i < len; i++) {
-    int length = rb_uv_to_utf8(buf, bytes[i]);
-    rb_str_buf_cat(res, (char*)buf, length);
+  int ref;
+  if (heap->free_refs.len > 0) {
+    ref = heap->free_refs.ptr[--heap->free_refs.len];
+  } else {
+    ref = heap->next_ref++;
   }
 
-  return res;
+  duk_push_heap_stash(ctx);
+  duk_get_prop_string(ctx, -1, "refs");
+  duk_dup(ctx, idx);
+  duk_put_prop_index(ctx, -2, ref);
+  duk_pop_2(ctx);
+  return ref;
 }
 
-static VALUE decode_cesu8(struct state *state, VALUE str)
+/*
+ * Takes the lock of the heap, which is held by the fiber using the heap until
+ * the method returns. Other threads wait for it while JavaScript runs without
+ * the GVL. The lock is reentrant, so Ruby functions called from JavaScript can
+ * use the context again.
+ */
+static void heap_lock(struct heap *heap)
 {
-  duk_context *ctx = state->ctx;
-  VALUE res = rb_str_new(0, 0);
-
-  const char *ptr = RSTRING_PTR(str);
-  const char *end = RSTRING_END(str);
-  long len;
+  VALUE fiber = rb_fiber_current();
 
-  while (ptr < end) {
-    len = (end - ptr);
-    unsigned short code = utf8_to_uv(ptr, &len);
-    rb_str_buf_cat(res, (char*)&code, 2);
-    ptr += len;
+  if (heap->lock_owner == fiber) {
+    heap->lock_depth++;
+    return;
   }
 
-  rb_enc_associate(res, utf16enc);
-  VALUE utf8res = rb_str_conv_enc(res, utf16enc, rb_utf8_encoding());
-  if (utf8res == res) {
-    clean_raise(ctx, rb_eEncodingError, "cannot convert JavaScript string to UTF-16");
+  if (NIL_P(heap->lock)) {
+    heap->lock = rb_mutex_new();
   }
 
-  return utf8res;
+  rb_mutex_lock(heap->lock);
+  heap->lock_owner = fiber;
+  heap->lock_depth = 1;
 }
 
-static VALUE ctx_stack_to_value(struct state *state, int index)
+static VALUE heap_unlock(VALUE ptr)
 {
-  duk_context *ctx = state->ctx;
-  size_t len;
-  const char *buf;
-  int type;
-
-  state->was_complex = 0;
+  struct heap *heap = (struct heap *)ptr;
 
-  type = duk_get_type(ctx, index);
-  switch (type) {
-    case DUK_TYPE_NULL:
-    case DUK_TYPE_UNDEFINED:
-      return Qnil;
+  if (--heap->lock_depth == 0) {
+    heap->lock_owner = Qnil;
+    rb_mutex_unlock(heap->lock);
+  }
 
-    case DUK_TYPE_NUMBER:
-      return rb_float_new(duk_get_number(ctx, index));
+  return Qnil;
+}
 
-    case DUK_TYPE_BOOLEAN:
-      return duk_get_boolean(ctx, index) ? Qtrue : Qfalse;
+enum blocking_op {
+  OP_CALL,
+  OP_CALL_METHOD,
+  OP_COMPILE,
+  OP_COMPILE_LSTRING
+};
 
-    case DUK_TYPE_STRING:
-      buf = duk_get_lstring(ctx, index, &len);
-      VALUE str = rb_str_new(buf, len);
-      return decode_cesu8(state, str);
+/*
+ * A call into Duktape which runs without the GVL.
+ */
+struct blocking_call {
+  struct heap *heap;
+  duk_context *ctx;
+  enum blocking_op op;
+  duk_idx_t nargs;
+  duk_uint_t flags;
+  const char *ptr;
+  size_t len;
+  duk_int_t rc;
+  int is_fatal;
+};
 
-    case DUK_TYPE_OBJECT:
-      if (duk_is_function(ctx, index)) {
-        state->was_complex = 1;
-        return state->complex_object;
-      } else if (duk_is_array(ctx, index)) {
-        VALUE ary = rb_ary_new();
-        duk_enum(ctx, index, DUK_ENUM_ARRAY_INDICES_ONLY);
-        while (duk_next(ctx, -1, 1)) {
-          rb_ary_store(ary, duk_to_int(ctx, -2), ctx_stack_to_value(state, -1));
-          duk_pop_2(ctx);
-        }
-        duk_pop(ctx);
-        return ary;
-      } else if (duk_is_object(ctx, index)) {
-        VALUE hash = rb_hash_new();
-        duk_enum(ctx, index, DUK_ENUM_OWN_PROPERTIES_ONLY);
-        while (duk_next(ctx, -1, 1)) {
-          VALUE key = ctx_stack_to_value(state, -2);
-          VALUE val = ctx_stack_to_value(state, -1);
-          duk_pop_2(ctx);
-          if (state->was_complex)
-            continue;
-          rb_hash_aset(hash, key, val);
-        }
-        duk_pop(ctx);
-        return hash;
-      } else {
-        state->was_complex = 1;
-        return state->complex_object;
-      }
+static void blocking_call_run(struct blocking_call *call)
+{
+  duk_context *ctx = call->ctx;
+
+  switch (call->op) {
+  case OP_CALL:
+    call->rc = duk_pcall(ctx, call->nargs);
+    break;
+  case OP_CALL_METHOD:
+    call->rc = duk_pcall_method(ctx, call->nargs);
+    break;
+  case OP_COMPILE:
+    call->rc = duk_pcompile(ctx, call->flags);
+    break;
+  case OP_COMPILE_LSTRING:
+    call->rc = duk_pcompile_lstring_filename(ctx, call->flags, call->ptr, call->len);
+    break;
+  }
+}
 
-    case DUK_TYPE_BUFFER:
-    case DUK_TYPE_POINTER:
-    default:
-      return state->complex_object;
+static void *blocking_call_without_gvl(void *ptr)
+{
+  struct blocking_call *call = (struct blocking_call *)ptr;
+  struct heap *heap = call->heap;
+  jmp_buf *prev_jmp = heap->fatal_jmp;
+  int prev_without_gvl = heap->without_gvl;
+  jmp_buf jmp;
+
+  // Fatal errors jump back here, since they can't raise without the GVL
+  heap->fatal_jmp = &jmp;
+  heap->without_gvl = 1;
+
+  if (setjmp(jmp) == 0) {
+    blocking_call_run(call);
+  } else {
+    call->is_fatal = 1;
   }
 
-  return Qnil;
+  heap->fatal_jmp = prev_jmp;
+  heap->without_gvl = prev_without_gvl;
+  return NULL;
 }
 
-static void ctx_push_ruby_object(struct state *state, VALUE obj)
+/*
+ * Runs a call into Duktape without holding the GVL, so that other threads
+ * can run Ruby code or other contexts meanwhile. When there are no other
+ * threads, the GVL is kept since releasing it would only add overhead.
+ * Returns the result of the Duktape function, or DUK_EXEC_ERROR after a fatal
+ * error, which raise_ctx_error raises as InternalError.
+ */
+static duk_int_t blocking_call(struct blocking_call *call)
 {
-  duk_context *ctx = state->ctx;
-  duk_idx_t arr_idx;
-  VALUE str;
+  call->rc = DUK_EXEC_ERROR;
+  call->is_fatal = 0;
 
-  switch (TYPE(obj)) {
-    case T_FIXNUM:
-      duk_push_number(ctx, NUM2LONG(obj));
-      return;
+  if (rb_thread_alone()) {
+    blocking_call_run(call);
+    return call->rc;
+  }
 
-    case T_FLOAT:
-      duk_push_number(ctx, NUM2DBL(obj));
-      return;
+  rb_thread_call_without_gvl(blocking_call_without_gvl, call, NULL, NULL);
 
-    case T_BIGNUM:
-      duk_push_number(ctx, NUM2DBL(obj));
-      return;
+  return call->is_fatal ? DUK_EXEC_ERROR : call->rc;
+}
 
-    case T_SYMBOL:
-#ifdef HAVE_RB_SYM2STR
-      obj = rb_sym2str(obj);
-#else
-      obj = rb_id2str(SYM2ID(obj));
-#endif
-      // Intentional fall-through:
+static duk_int_t ctx_pcall(struct state *state, duk_idx_t nargs)
+{
+  struct blocking_call call = { state->heap, state->ctx, OP_CALL };
+  call.nargs = nargs;
+  return blocking_call(&call);
+}
 
-    case T_STRING:
-      str = encode_cesu8(state, obj);
-      duk_push_lstring(ctx, RSTRING_PTR(str), RSTRING_LEN(str));
-      return;
+static duk_int_t ctx_pcall_method(struct state *state, duk_idx_t nargs)
+{
+  struct blocking_call call = { state->heap, state->ctx, OP_CALL_METHOD };
+  call.nargs = nargs;
+  return blocking_call(&call);
+}
 
-    case T_TRUE:
-      duk_push_true(ctx);
-      return;
+static duk_int_t ctx_pcompile(struct state *state, duk_uint_t flags)
+{
+  struct blocking_call call = { state->heap, state->ctx, OP_COMPILE };
+  call.flags = flags;
+  return blocking_call(&call);
+}
 
-    case T_FALSE:
-      duk_push_false(ctx);
-      return;
+static duk_int_t ctx_pcompile_lstring(struct state *state, duk_uint_t flags, const char *ptr, size_t len)
+{
+  struct blocking_call call = { state->heap, state->ctx, OP_COMPILE_LSTRING };
+  call.flags = flags;
+  call.ptr = ptr;
+  call.len = len;
+  return blocking_call(&call);
+}
 
-    case T_NIL:
-      duk_push_null(ctx);
-      return;
+/*
+ * Adds a block to the callback table. Returns its index.
+ */
+static long heap_add_callback(struct heap *heap, VALUE block, VALUE recv, ID mid, struct state *state)
+{
+  // Workers of an executor can't call into Ruby
+  if (heap->executor) {
+    rb_raise(rb_eRuntimeError, "context is used by an executor");
+  }
 
-    case T_ARRAY:
-      arr_idx = duk_push_array(ctx);
-      for (int idx = 0; idx < RARRAY_LEN(obj); idx++) {
-        ctx_push_ruby_object(state, rb_ary_entry(obj, idx));
-        duk_put_prop_index(ctx, arr_idx, idx);
+  long idx = heap->free_callback;
+  if (idx >= 0) {
+    heap->free_callback = heap->callbacks[idx].next;
+    heap->callbacks[idx].generation++;
+  } else {
+    if (heap->callbacks_len == heap->callbacks_capa) {
+      long capa = heap->callbacks_capa ? heap->callbacks_capa * 2 : 16;
+      struct callback *callbacks = realloc(heap->callbacks, sizeof(struct callback) * capa);
+      if (callbacks == NULL) {
+        rb_memerror();
       }
-      return;
-
-    case T_HASH:
-      duk_push_object(ctx);
-      rb_hash_foreach(obj, ctx_push_hash_element, (VALUE)state);
-      return;
-
-    default:
-      // Cannot convert
-      break;
+      heap->callbacks = callbacks;
+      heap->callbacks_capa = capa;
+    }
+    idx = heap->callbacks_len++;
+    heap->callbacks[idx].generation = 0;
   }
 
-  clean_raise(ctx, rb_eTypeError, "cannot convert %s", rb_obj_classname(obj));
+  struct callback *callback = &heap->callbacks[idx];
+  callback->block = block;
+  callback->recv = recv;
+  callback->mid = mid;
+  callback->state = state;
+  callback->next = state->callbacks_head;
+  state->callbacks_head = idx;
+  heap->callbacks_used++;
+  return idx;
 }
 
-static int ctx_push_hash_element(VALUE key, VALUE val, VALUE extra)
+/*
+ * Pushes the value kept alive by heap_ref.
+ */
+static void heap_push_ref(struct heap *heap, duk_context *ctx, int ref)
 {
-  struct state *state = (struct state*) extra;
-  duk_context *ctx = state->ctx;
+  duk_push_heap_stash(ctx);
+  duk_get_prop_string(ctx, -1, "refs");
+  duk_get_prop_index(ctx, -1, ref);
+  duk_replace(ctx, -3);
+  duk_pop(ctx);
+}
 
-  switch (TYPE(key)) {
-    case T_SYMBOL:
-    case T_STRING:
-      ctx_push_ruby_object(state, key);
-      break;
-    default:
-      clean_raise(ctx, rb_eTypeError, "invalid key type %s", rb_obj_classname(key));
+static void ctx_undefine_require(duk_context *ctx)
+{
+  duk_push_global_object(ctx);
+  duk_push_string(ctx, "require");
+  duk_del_prop(ctx, -2);
+  duk_pop(ctx);
+}
+
+static void ctx_dealloc(void *ptr)
+{
+  struct state *state = (struct state *)ptr;
+  if (state->realm_ref >= 0) {
+    heap_unref_later(state->heap, state->realm_ref);
+  }
+  if (state->key_cache_ref >= 0) {
+    heap_unref_later(state->heap, state->key_cache_ref);
+  }
+  st_free_table(state->key_cache);
+  st_free_table(state->seen_js);
+  st_free_table(state->seen_ruby);
+  free(state->frames);
+  free(state->push_frames);
+  free(state->pending);
+  for (int i = 0; i < state->eval_cache_len; i++) {
+    heap_unref_later(state->heap, state->eval_entries[i].ref);
+  }
+  free(state->eval_entries);
+
+  struct heap *heap = state->heap;
+  long idx = state->callbacks_head;
+  while (idx >= 0) {
+    struct callback *callback = &heap->callbacks[idx];
+    long next = callback->next;
+    callback->block = Qnil;
+    callback->recv = Qnil;
+    callback->state = NULL;
+    callback->next = heap->free_callback;
+    heap->free_callback = idx;
+    heap->callbacks_used--;
+    idx = next;
   }
+  heap_release(state->heap);
+  free(state);
+}
 
-  ctx_push_ruby_object(state, val);
-  duk_put_prop(ctx, -3);
+static int mark_value_i(st_data_t ptr, st_data_t value, st_data_t arg)
+{
+  rb_gc_mark((VALUE)value);
   return ST_CONTINUE;
 }
 
-static void raise_ctx_error(struct state *state)
+static int mark_object_i(st_data_t obj, st_data_t ptr, st_data_t arg)
 {
-  duk_context *ctx = state->ctx;
-  duk_get_prop_string(ctx, -1, "name");
-  const char *name = duk_safe_to_string(ctx, -1);
+  rb_gc_mark((VALUE)obj);
+  return ST_CONTINUE;
+}
 
-  duk_get_prop_string(ctx, -2, "message");
-  const char *message = duk_to_string(ctx, -1);
+static void ctx_mark(struct state *state)
+{
+  rb_gc_mark(state->complex_object);
+  rb_gc_mark(state->bytecode_cache);
+  st_foreach(state->key_cache, mark_value_i, 0);
+  st_foreach(state->seen_js, mark_value_i, 0);
+  st_foreach(state->seen_ruby, mark_object_i, 0);
 
-  VALUE exc_class = error_name_class(name);
-  VALUE exc = rb_exc_new2(exc_class, message);
-  clean_raise_exc(ctx, exc);
+  for (long i = 0; i < state->frames_len; i++) {
+    rb_gc_mark(state->frames[i].obj);
+  }
+  for (long i = 0; i < state->push_frames_len; i++) {
+    rb_gc_mark(state->push_frames[i].obj);
+  }
+  for (long i = 0; i < state->pending_len; i++) {
+    rb_gc_mark(state->pending[i]);
+  }
+  rb_gc_mark(state->eval_cache);
+  for (int i = 0; i < state->eval_cache_len; i++) {
+    rb_gc_mark(state->eval_entries[i].key);
+  }
+
+  rb_gc_mark(state->heap->lock);
+  rb_gc_mark(state->heap->lock_owner);
+  rb_gc_mark(state->heap->callback_error);
+
+  // The table refers to blocks and objects directly, so they must not move
+  for (long i = state->callbacks_head; i >= 0; i = state->heap->callbacks[i].next) {
+    rb_gc_mark(state->heap->callbacks[i].block);
+    rb_gc_mark(state->heap->callbacks[i].recv);
+  }
 }
 
-/*
- * call-seq:
- *   eval_string(string[, filename]) -> obj
- *
- * Evaluate JavaScript expression within context returning the value as a Ruby
- * object.
+static VALUE ctx_alloc(VALUE klass)
+{
+  struct state *state = malloc(sizeof(struct state));
+
+  state->heap = heap_create();
+  state->ctx = state->heap->ctx;
+  state->realm_ref = -1;
+  state->complex_object = oComplexObject;
+  state->callbacks_head = -1;
+  state->bytecode_cache = Qnil;
+  state->marshal_cbor = 0;
+  state->symbolize_keys = 0;
+  state->binary = 0;
+  state->max_depth = DEFAULT_MAX_DEPTH;
+  state->eval_cache_capa = DEFAULT_EVAL_CACHE_SIZE;
+  state->eval_cache_max_source = DEFAULT_EVAL_CACHE_MAX_SOURCE;
+  state->key_cache = st_init_numtable();
+  state->key_cache_ref = -1;
+  state->seen_js = st_init_numtable();
+  state->seen_idx = -1;
+  state->seen_ruby = st_init_numtable();
+  state->frames = NULL;
+  state->frames_len = 0;
+  state->frames_capa = 0;
+  state->push_frames = NULL;
+  state->push_frames_len = 0;
+  state->push_frames_capa = 0;
+  state->pending = NULL;
+  state->pending_len = 0;
+  state->pending_capa = 0;
+  state->eval_cache = Qnil;
+  state->eval_entries = NULL;
+  state->eval_cache_len = 0;
+  state->eval_cache_clock = 0;
+  state->eval_cache_hits = 0;
+  state->eval_cache_misses = 0;
+
+  ctx_undefine_require(state->ctx);
+
+  return Data_Wrap_Struct(klass, ctx_mark, ctx_dealloc, state);
+}
+
+static VALUE error_name_class(const char* name)
+{
+  if (strcmp(name, "EvalError") == 0) {
+    return eEvalError;
+  } else if (strcmp(name, "RangeError") == 0) {
+    return eRangeError;
+  } else if (strcmp(name, "ReferenceError") == 0) {
+    return eReferenceError;
+  } else if (strcmp(name, "SyntaxError") == 0) {
+    return eSyntaxError;
+  } else if (strcmp(name, "TypeError") == 0) {
+    return eTypeError;
+  } else if (strcmp(name, "URIError") == 0) {
+    return eURIError;
+  } else {
+    return eError;
+  }
+}
+
+#define WORD_HIGH_BITS (~(uintptr_t)0 / 0xff * 0x80)
+
+/*
+ * Returns a pointer to the first byte of the form 11110xxx (the lead byte of a
+ * 4-byte UTF-8 sequence), or end if there's none. Scans a word at a time.
+ */
+static const char *find_utf8_4byte(const char *ptr, const char *end)
+{
+  uintptr_t word;
+
+  while ((size_t)(end - ptr) >= sizeof(word)) {
+    memcpy(&word, ptr, sizeof(word));
+    // The high bit of a byte is kept only if its four top bits are all set
+    if (word & (word << 1) & (word << 2) & (word << 3) & WORD_HIGH_BITS)
+      break;
+    ptr += sizeof(word);
+  }
+
+  while (ptr < end && (unsigned char)*ptr < 0xf0)
+    ptr++;
+
+  return ptr;
+}
+
+/*
+ * Returns a pointer to the first byte which isn't part of a valid UTF-8
+ * sequence, or end if the whole input is valid. first_4byte is set to the
+ * first 4-byte sequence, or end if there's none. ASCII is skipped a word at a
+ * time.
+ */
+static const char *find_invalid_utf8(const char *ptr, const char *end, const char **first_4byte)
+{
+  const unsigned char *p = (const unsigned char *)ptr;
+  const unsigned char *e = (const unsigned char *)end;
+  uintptr_t word;
+
+  *first_4byte = end;
+
+  while (p < e) {
+    if ((size_t)(e - p) >= sizeof(word)) {
+      memcpy(&word, p, sizeof(word));
+      if ((word & WORD_HIGH_BITS) == 0) {
+        p += sizeof(word);
+        continue;
+      }
+    }
+
+    unsigned char c = *p;
+    size_t n;
+    unsigned char lo = 0x80, hi = 0xbf;
+
+    if (c < 0x80) {
+      p++;
+      continue;
+    } else if (c >= 0xc2 && c <= 0xdf) {
+      n = 1;
+    } else if (c >= 0xe0 && c <= 0xef) {
+      n = 2;
+      if (c == 0xe0) lo = 0xa0;
+      if (c == 0xed) hi = 0x9f;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+      n = 3;
+      if (c == 0xf0) lo = 0x90;
+      if (c == 0xf4) hi = 0x8f;
+    } else {
+      return (const char *)p;
+    }
+
+    if ((size_t)(e - p) <= n || p[1] < lo || p[1] > hi) {
+      return (const char *)p;
+    }
+    for (size_t i = 2; i <= n; i++) {
+      if ((p[i] & 0xc0) != 0x80) {
+        return (const char *)p;
+      }
+    }
+
+    if (n == 3 && *first_4byte == end) {
+      *first_4byte = (const char *)p;
+    }
+    p += n + 1;
+  }
+
+  return end;
+}
+
+static char *put_cesu8_unit(char *out, unsigned long code)
+{
+  *out++ = (char)(0xe0 | (code >> 12));
+  *out++ = (char)(0x80 | ((code >> 6) & 0x3f));
+  *out++ = (char)(0x80 | (code & 0x3f));
+  return out;
+}
+
+/*
+ * Returns the String as either ASCII or valid UTF-8, converting it from other
+ * encodings if needed.
+ */
+static VALUE utf8_string(struct state *state, VALUE str)
+{
+  rb_encoding *enc = rb_enc_get(str);
+  int cr = rb_enc_str_coderange(str);
+
+  if (cr == ENC_CODERANGE_7BIT && rb_enc_asciicompat(enc)) {
+    return str;
+  }
+
+  if (enc != rb_utf8_encoding()) {
+    VALUE utf8 = rb_str_conv_enc(str, enc, rb_utf8_encoding());
+    if (utf8 == str) {
+      clean_raise(state->ctx, rb_eEncodingError, "cannot convert Ruby string to UTF-8");
+    }
+    str = utf8;
+    cr = rb_enc_str_coderange(str);
+  }
+
+  if (cr == ENC_CODERANGE_BROKEN) {
+    clean_raise(state->ctx, rb_eEncodingError, "invalid byte sequence in UTF-8");
+  }
+
+  return str;
+}
+
+/*
+ * Copies UTF-8 to out as CESU-8, where pos is the first 4-byte sequence as
+ * returned by find_utf8_4byte. The output is at most 1.5 times the size of
+ * the input. Returns the end of the output.
+ */
+static char *write_cesu8(char *out, const char *ptr, const char *pos, const char *end)
+{
+  while (pos < end) {
+    memcpy(out, ptr, pos - ptr);
+    out += pos - ptr;
+
+    const unsigned char *seq = (const unsigned char *)pos;
+    unsigned long code = ((unsigned long)(seq[0] & 0x07) << 18) |
+                         ((unsigned long)(seq[1] & 0x3f) << 12) |
+                         ((unsigned long)(seq[2] & 0x3f) << 6) |
+                         (unsigned long)(seq[3] & 0x3f);
+    code -= 0x10000;
+    out = put_cesu8_unit(out, 0xd800 + (code >> 10));
+    out = put_cesu8_unit(out, 0xdc00 + (code & 0x3ff));
+
+    ptr = pos + 4;
+    pos = find_utf8_4byte(ptr, end);
+  }
+
+  memcpy(out, ptr, end - ptr);
+  return out + (end - ptr);
+}
+
+/*
+ * Pushes a Ruby String as a CESU-8 encoded JavaScript string. Valid UTF-8
+ * without any 4-byte sequences is already valid CESU-8 and is pushed as is.
+ * Otherwise only the 4-byte sequences are rewritten into surrogate pairs.
+ */
+static void encode_cesu8(struct state *state, VALUE str)
+{
+  duk_context *ctx = state->ctx;
+
+  str = utf8_string(state, str);
+
+  const char *ptr = RSTRING_PTR(str);
+  const char *end = RSTRING_END(str);
+  const char *pos = ENC_CODERANGE(str) == ENC_CODERANGE_7BIT ? end : find_utf8_4byte(ptr, end);
+
+  if (pos == end) {
+    duk_push_lstring(ctx, ptr, end - ptr);
+    RB_GC_GUARD(str);
+    return;
+  }
+
+  // Every 4-byte sequence becomes two 3-byte surrogates
+  VALUE tmp;
+  char *buf = ALLOCV(tmp, (end - ptr) + (end - ptr) / 2);
+  char *out = write_cesu8(buf, ptr, pos, end);
+
+  duk_push_lstring(ctx, buf, out - buf);
+  ALLOCV_END(tmp);
+  RB_GC_GUARD(str);
+}
+
+/*
+ * Returns a pointer to the first surrogate (0xED followed by 0xA0-0xBF) in a
+ * CESU-8 string, or end if there's none.
+ */
+static const char *find_cesu8_surrogate(const char *ptr, const char *end)
+{
+  while (ptr < end) {
+    ptr = memchr(ptr, 0xed, end - ptr);
+    if (ptr == NULL)
+      return end;
+    if (ptr + 1 < end && (unsigned char)ptr[1] >= 0xa0)
+      return ptr;
+    ptr++;
+  }
+
+  return end;
+}
+
+static unsigned long get_cesu8_unit(const unsigned char *seq)
+{
+  return 0xd000 | ((unsigned long)(seq[1] & 0x3f) << 6) | (seq[2] & 0x3f);
+}
+
+/*
+ * Converts CESU-8 to a UTF-8 Ruby String. Strings without surrogates are
+ * already valid UTF-8 and are copied as is. Otherwise each surrogate pair is
+ * merged into a 4-byte sequence. Returns nil for unpaired surrogates and
+ * symbols.
+ */
+static VALUE cesu8_to_utf8(const char *ptr, size_t len)
+{
+  const char *end = ptr + len;
+
+  // Symbols are strings starting with a byte which is invalid in UTF-8
+  if (len > 0 && ((unsigned char)ptr[0] == 0xff || ((unsigned char)ptr[0] & 0xc0) == 0x80)) {
+    return Qnil;
+  }
+
+  const char *pos = find_cesu8_surrogate(ptr, end);
+  if (pos == end) {
+    return rb_utf8_str_new(ptr, len);
+  }
+
+  // Merging surrogates only makes the string shorter
+  VALUE res = rb_utf8_str_new(NULL, len);
+  char *out = RSTRING_PTR(res);
+
+  while (pos < end) {
+    memcpy(out, ptr, pos - ptr);
+    out += pos - ptr;
+
+    const unsigned char *seq = (const unsigned char *)pos;
+    if (end - pos < 6 || seq[1] > 0xaf || seq[3] != 0xed || seq[4] < 0xb0 || seq[4] > 0xbf ||
+        (seq[2] & 0xc0) != 0x80 || (seq[5] & 0xc0) != 0x80) {
+      return Qnil;
+    }
+
+    unsigned long code = 0x10000 +
+      ((get_cesu8_unit(seq) - 0xd800) << 10) +
+      (get_cesu8_unit(seq + 3) - 0xdc00);
+    *out++ = (char)(0xf0 | (code >> 18));
+    *out++ = (char)(0x80 | ((code >> 12) & 0x3f));
+    *out++ = (char)(0x80 | ((code >> 6) & 0x3f));
+    *out++ = (char)(0x80 | (code & 0x3f));
+
+    ptr = pos + 6;
+    pos = find_cesu8_surrogate(ptr, end);
+  }
+
+  memcpy(out, ptr, end - ptr);
+  out += end - ptr;
+  rb_str_set_len(res, out - RSTRING_PTR(res));
+  return res;
+}
+
+/*
+ * Returns a JavaScript string as a UTF-8 Ruby String.
+ */
+static VALUE decode_cesu8(struct state *state, const char *ptr, size_t len)
+{
+  VALUE res = cesu8_to_utf8(ptr, len);
+  if (NIL_P(res)) {
+    clean_raise(state->ctx, rb_eEncodingError, "cannot convert JavaScript string to UTF-8");
+  }
+  return res;
+}
+
+/*
+ * Pushes a binary String as a Uint8Array. The bytes are copied into a
+ * Duktape buffer, since JavaScript can write to the array.
+ */
+static void ctx_push_binary(struct state *state, VALUE str)
+{
+  duk_context *ctx = state->ctx;
+  long len = RSTRING_LEN(str);
+
+  void *buf = duk_push_fixed_buffer(ctx, len);
+  if (len > 0) {
+    memcpy(buf, RSTRING_PTR(str), len);
+  }
+  duk_push_buffer_object(ctx, -1, 0, len, DUK_BUFOBJ_UINT8ARRAY);
+  duk_remove(ctx, -2);
+  RB_GC_GUARD(str);
+}
+
+/*
+ * Returns an object key as a frozen, deduplicated String (or a Symbol).
+ */
+static VALUE key_from_string(struct state *state, VALUE str)
+{
+  if (state->symbolize_keys) {
+    return rb_str_intern(str);
+  }
+
+#ifdef HAVE_RB_STR_TO_INTERNED_STR
+  return rb_str_to_interned_str(str);
+#else
+  return rb_str_freeze(str);
+#endif
+}
+
+/*
+ * Converts an object key. Duktape strings are interned, so keys are cached by
+ * the address of the string. The cached strings are kept alive in an array so
+ * their addresses can't be reused while they're in the cache.
+ */
+static VALUE ctx_stack_to_key(struct state *state, duk_idx_t index)
+{
+  duk_context *ctx = state->ctx;
+
+  if (!duk_is_string(ctx, index)) {
+    return ctx_stack_to_value_iter(state, index);
+  }
+
+  index = duk_normalize_index(ctx, index);
+  void *ptr = duk_get_heapptr(ctx, index);
+  st_data_t cached;
+  if (st_lookup(state->key_cache, (st_data_t)ptr, &cached)) {
+    return (VALUE)cached;
+  }
+
+  duk_size_t len;
+  const char *buf = duk_get_lstring(ctx, index, &len);
+  VALUE key = key_from_string(state, decode_cesu8(state, buf, len));
+
+  if (state->key_cache_ref < 0 || state->key_cache->num_entries >= KEY_CACHE_SIZE) {
+    st_clear(state->key_cache);
+    if (state->key_cache_ref >= 0) {
+      heap_unref(state->heap, ctx, state->key_cache_ref);
+    }
+    duk_push_array(ctx);
+    state->key_cache_ref = heap_ref(state->heap, ctx, -1);
+    duk_pop(ctx);
+  }
+
+  heap_push_ref(state->heap, ctx, state->key_cache_ref);
+  duk_dup(ctx, index);
+  duk_put_prop_index(ctx, -2, (duk_uarridx_t)state->key_cache->num_entries);
+  duk_pop(ctx);
+
+  st_insert(state->key_cache, (st_data_t)ptr, (st_data_t)key);
+  return key;
+}
+
+/*
+ * Remembers an object converted to Ruby, so it is converted once however
+ * many times it is referenced. The object is also kept alive until the
+ * conversion is done: values returned by getters can otherwise be freed and
+ * their address reused by another object.
+ */
+static void ctx_seen_js(struct state *state, duk_idx_t index, VALUE obj)
+{
+  duk_context *ctx = state->ctx;
+
+  duk_dup(ctx, index);
+  duk_put_prop_index(ctx, state->seen_idx, (duk_uarridx_t)state->seen_js->num_entries);
+  st_insert(state->seen_js, (st_data_t)duk_get_heapptr(ctx, index), (st_data_t)obj);
+}
+
+/*
+ * Starts filling an Array or Hash from the JavaScript object at index. The
+ * object stays on the stack until all its values have been read, and is
+ * popped then unless it's the value being converted.
+ */
+static void ctx_open_frame(struct state *state, duk_idx_t index, VALUE obj, duk_size_t length, int root)
+{
+  duk_context *ctx = state->ctx;
+
+  if (state->frames_len >= state->max_depth) {
+    clean_raise(ctx, eRangeError, "nesting of %d is too deep", state->max_depth + 1);
+  }
+  if (!duk_check_stack(ctx, 3)) {
+    clean_raise(ctx, eRangeError, "nesting of %ld is too deep", state->frames_len + 1);
+  }
+
+  if (state->frames_len == state->frames_capa) {
+    state->frames_capa = state->frames_capa ? state->frames_capa * 2 : 16;
+    state->frames = realloc(state->frames, sizeof(struct frame) * state->frames_capa);
+    if (state->frames == NULL) {
+      rb_memerror();
+    }
+  }
+
+  struct frame *f = &state->frames[state->frames_len++];
+  f->obj = obj;
+  f->index = index;
+  f->top = root ? duk_get_top(ctx) : index;
+  f->pos = 0;
+  f->length = length;
+  f->enum_index = -1;
+
+  if (!RB_TYPE_P(obj, T_ARRAY)) {
+    duk_enum(ctx, index, DUK_ENUM_OWN_PROPERTIES_ONLY);
+    f->enum_index = duk_get_top_index(ctx);
+  } else if (length > ARRAY_READ_MAX) {
+    duk_enum(ctx, index, DUK_ENUM_ARRAY_INDICES_ONLY);
+    f->enum_index = duk_get_top_index(ctx);
+  }
+}
+
+/*
+ * Converts the value at index. Arrays and objects are returned empty, with a
+ * frame to read their values from.
+ */
+static VALUE ctx_read_value(struct state *state, int index, int root)
+{
+  duk_context *ctx = state->ctx;
+  size_t len;
+  const char *buf;
+  int type;
+  st_data_t seen;
+
+  state->was_complex = 0;
+
+  type = duk_get_type(ctx, index);
+  switch (type) {
+    case DUK_TYPE_NULL:
+    case DUK_TYPE_UNDEFINED:
+      return Qnil;
+
+    case DUK_TYPE_NUMBER:
+      return rb_float_new(duk_get_number(ctx, index));
+
+    case DUK_TYPE_BOOLEAN:
+      return duk_get_boolean(ctx, index) ? Qtrue : Qfalse;
+
+    case DUK_TYPE_STRING:
+      buf = duk_get_lstring(ctx, index, &len);
+      return decode_cesu8(state, buf, len);
+
+    case DUK_TYPE_OBJECT:
+      if (duk_is_buffer_data(ctx, index)) {
+        buf = duk_get_buffer_data(ctx, index, &len);
+        return rb_str_new(buf, len);
+      } else if (duk_is_function(ctx, index)) {
+        state->was_complex = 1;
+        return state->complex_object;
+      } else if (state->seen_idx >= 0 && st_lookup(state->seen_js, (st_data_t)duk_get_heapptr(ctx, index), &seen)) {
+        return (VALUE)seen;
+      } else if (duk_is_array(ctx, index)) {
+        // Read the elements by index rather than enumerating them: this
+        // avoids stringifying every index and lets us size the Array up
+        // front. Holes are read as undefined and become nil. The length is
+        // set by JavaScript, so long arrays are enumerated as they may be
+        // sparse.
+        duk_size_t length = duk_get_length(ctx, index);
+        VALUE ary = rb_ary_new_capa(length > ARRAY_READ_MAX ? 0 : (long)length);
+        index = duk_normalize_index(ctx, index);
+        if (state->seen_idx >= 0) {
+          ctx_seen_js(state, index, ary);
+        }
+        ctx_open_frame(state, index, ary, length, root);
+        return ary;
+      } else if (duk_is_object(ctx, index)) {
+        VALUE hash = rb_hash_new();
+        index = duk_normalize_index(ctx, index);
+        if (state->seen_idx >= 0) {
+          ctx_seen_js(state, index, hash);
+        }
+        ctx_open_frame(state, index, hash, 0, root);
+        return hash;
+      } else {
+        state->was_complex = 1;
+        return state->complex_object;
+      }
+
+    case DUK_TYPE_BUFFER:
+      buf = duk_get_buffer(ctx, index, &len);
+      return rb_str_new(buf, len);
+
+    case DUK_TYPE_POINTER:
+    default:
+      return state->complex_object;
+  }
+
+  return Qnil;
+}
+
+/*
+ * Converts the value at index using a frame per open Array or Hash instead
+ * of recursing, so deeply nested values can't overflow the C stack.
+ */
+static VALUE ctx_stack_to_value_iter(struct state *state, int index)
+{
+  duk_context *ctx = state->ctx;
+  long base = state->frames_len;
+  VALUE res = ctx_read_value(state, index, 1);
+
+  while (state->frames_len > base) {
+    struct frame *f = &state->frames[state->frames_len - 1];
+    VALUE obj = f->obj;
+    VALUE key = Qnil;
+    long frames_len = state->frames_len;
+    int is_array = RB_TYPE_P(obj, T_ARRAY);
+    int by_key = f->enum_index >= 0;
+    long pos = 0;
+
+    if (is_array && by_key) {
+      if (!duk_next(ctx, f->enum_index, 1)) {
+        duk_set_top(ctx, f->top);
+        state->frames_len--;
+        continue;
+      }
+      pos = (long)duk_to_uint32(ctx, -2);
+      duk_remove(ctx, -2);
+    } else if (is_array) {
+      if (f->pos >= f->length) {
+        duk_set_top(ctx, f->top);
+        state->frames_len--;
+        continue;
+      }
+      duk_get_prop_index(ctx, f->index, (duk_uarridx_t)f->pos++);
+    } else {
+      if (!duk_next(ctx, f->enum_index, 1)) {
+        duk_set_top(ctx, f->top);
+        state->frames_len--;
+        continue;
+      }
+      key = ctx_stack_to_key(state, -2);
+      duk_remove(ctx, -2);
+    }
+
+    // Reading the value may open a frame for it, which leaves it on the stack
+    VALUE val = ctx_read_value(state, -1, 0);
+    if (state->frames_len == frames_len) {
+      duk_pop(ctx);
+    }
+
+    if (is_array && by_key) {
+      rb_ary_store(obj, pos, val);
+    } else if (is_array) {
+      rb_ary_push(obj, val);
+    } else if (!state->was_complex) {
+      rb_hash_aset(obj, key, val);
+    }
+  }
+
+  return res;
+}
+
+struct stack_to_value_args {
+  struct state *state;
+  int index;
+  duk_idx_t prev_idx;
+  long prev_frames_len;
+};
+
+static VALUE ctx_stack_to_value_body(VALUE ptr)
+{
+  struct stack_to_value_args *args = (struct stack_to_value_args *)ptr;
+  return ctx_stack_to_value_iter(args->state, args->index);
+}
+
+static VALUE ctx_stack_to_value_ensure(VALUE ptr)
+{
+  struct stack_to_value_args *args = (struct stack_to_value_args *)ptr;
+  struct state *state = args->state;
+
+  if (state->seen_idx >= 0) {
+    st_clear(state->seen_js);
+    // The stack has already been cleared if an error was raised
+    if (duk_get_top(state->ctx) > state->seen_idx) {
+      duk_remove(state->ctx, state->seen_idx);
+    }
+  }
+  state->seen_idx = args->prev_idx;
+  state->frames_len = args->prev_frames_len;
+  return Qnil;
+}
+
+/*
+ * Converts the value at index to Ruby. Objects referenced more than once
+ * are converted once, so shared structures stay shared and cyclic
+ * structures become cyclic Ruby objects.
+ */
+static VALUE ctx_stack_to_value(struct state *state, int index)
+{
+  duk_context *ctx = state->ctx;
+
+  if (duk_get_type(ctx, index) != DUK_TYPE_OBJECT) {
+    return ctx_stack_to_value_iter(state, index);
+  }
+
+  struct stack_to_value_args args;
+  args.state = state;
+  args.index = duk_normalize_index(ctx, index);
+  args.prev_idx = state->seen_idx;
+  args.prev_frames_len = state->frames_len;
+
+  if (args.prev_idx >= 0) {
+    // A getter called a Ruby function in the middle of a conversion. The
+    // objects seen so far belong to the outer call's stack frame, so convert
+    // this value without tracking them.
+    state->seen_idx = -1;
+  } else {
+    duk_push_array(ctx);
+    state->seen_idx = duk_get_top_index(ctx);
+  }
+
+  return rb_ensure(ctx_stack_to_value_body, (VALUE)&args, ctx_stack_to_value_ensure, (VALUE)&args);
+}
+
+/*
+ * Pushes the JavaScript object an Array or Hash was already converted to, or
+ * a new empty one which is remembered for it. Doing both in one st_update
+ * hashes the object only once.
+ */
+static int ctx_push_seen_i(st_data_t *key, st_data_t *value, st_data_t arg, int existing)
+{
+  duk_context *ctx = (duk_context *)arg;
+
+  if (existing) {
+    duk_push_heapptr(ctx, (void *)*value);
+    return ST_CONTINUE;
+  }
+
+  if (RB_TYPE_P((VALUE)*key, T_ARRAY)) {
+    duk_push_array(ctx);
+  } else {
+    duk_push_object(ctx);
+  }
+  *value = (st_data_t)duk_get_heapptr(ctx, -1);
+  return ST_CONTINUE;
+}
+
+/*
+ * Pushes a Ruby object converted to JavaScript. Returns 1 for an Array or
+ * Hash which was pushed empty and still has to be filled.
+ */
+static int ctx_push_ruby_value(struct state *state, VALUE obj)
+{
+  duk_context *ctx = state->ctx;
+
+  switch (TYPE(obj)) {
+    case T_FIXNUM:
+      duk_push_number(ctx, NUM2LONG(obj));
+      return 0;
+
+    case T_FLOAT:
+      duk_push_number(ctx, NUM2DBL(obj));
+      return 0;
+
+    case T_BIGNUM:
+      duk_push_number(ctx, NUM2DBL(obj));
+      return 0;
+
+    case T_SYMBOL:
+#ifdef HAVE_RB_SYM2STR
+      encode_cesu8(state, rb_sym2str(obj));
+#else
+      encode_cesu8(state, rb_id2str(SYM2ID(obj)));
+#endif
+      return 0;
+
+    case T_STRING:
+      if (state->binary && ENCODING_GET(obj) == rb_ascii8bit_encindex()) {
+        ctx_push_binary(state, obj);
+      } else {
+        encode_cesu8(state, obj);
+      }
+      return 0;
+
+    case T_TRUE:
+      duk_push_true(ctx);
+      return 0;
+
+    case T_FALSE:
+      duk_push_false(ctx);
+      return 0;
+
+    case T_NIL:
+      duk_push_null(ctx);
+      return 0;
+
+    case T_ARRAY:
+    case T_HASH:
+      return !st_update(state->seen_ruby, (st_data_t)obj, ctx_push_seen_i, (st_data_t)ctx);
+
+    default:
+      if (rb_obj_is_kind_of(obj, cRawJSON)) {
+        ctx_push_raw_json(state, obj);
+        return 0;
+      }
+      if (is_ref(obj)) {
+        ctx_push_ref(state, obj);
+        return 0;
+      }
+      // Cannot convert
+      break;
+  }
+
+  clean_raise(ctx, rb_eTypeError, "cannot convert %s", rb_obj_classname(obj));
+  return 0;
+}
+
+static void ctx_push_hash_key(struct state *state, VALUE key)
+{
+  switch (TYPE(key)) {
+    case T_SYMBOL:
+      ctx_push_ruby_value(state, key);
+      return;
+    case T_STRING:
+      encode_cesu8(state, key);
+      return;
+    default:
+      clean_raise(state->ctx, rb_eTypeError, "invalid key type %s", rb_obj_classname(key));
+  }
+}
+
+static void ctx_push_pending(struct state *state, VALUE obj)
+{
+  if (state->pending_len == state->pending_capa) {
+    state->pending_capa = state->pending_capa ? state->pending_capa * 2 : 16;
+    state->pending = realloc(state->pending, sizeof(VALUE) * state->pending_capa);
+    if (state->pending == NULL) {
+      rb_memerror();
+    }
+  }
+  state->pending[state->pending_len++] = obj;
+}
+
+static int ctx_push_hash_element(VALUE key, VALUE val, VALUE extra)
+{
+  struct state *state = (struct state*) extra;
+  ctx_push_pending(state, key);
+  ctx_push_pending(state, val);
+  return ST_CONTINUE;
+}
+
+/*
+ * Starts filling the empty Array or Hash on top of the stack. The pairs of a
+ * Hash are copied to the pending list first, since rb_hash_foreach can't be
+ * resumed.
+ */
+static void ctx_open_push_frame(struct state *state, VALUE obj)
+{
+  duk_context *ctx = state->ctx;
+
+  if (state->push_frames_len >= state->max_depth) {
+    clean_raise(ctx, eRangeError, "nesting of %d is too deep", state->max_depth + 1);
+  }
+  if (!duk_check_stack(ctx, 3)) {
+    clean_raise(ctx, eRangeError, "nesting of %ld is too deep", state->push_frames_len + 1);
+  }
+
+  if (state->push_frames_len == state->push_frames_capa) {
+    state->push_frames_capa = state->push_frames_capa ? state->push_frames_capa * 2 : 16;
+    state->push_frames = realloc(state->push_frames, sizeof(struct frame) * state->push_frames_capa);
+    if (state->push_frames == NULL) {
+      rb_memerror();
+    }
+  }
+
+  struct frame *f = &state->push_frames[state->push_frames_len++];
+  f->obj = obj;
+  f->index = duk_get_top_index(ctx);
+
+  if (RB_TYPE_P(obj, T_HASH)) {
+    f->top = (duk_idx_t)state->pending_len;
+    rb_hash_foreach(obj, ctx_push_hash_element, (VALUE)state);
+    f->pos = f->top;
+  } else {
+    f->top = -1;
+    f->pos = 0;
+  }
+}
+
+/*
+ * Pushes a Ruby object converted to JavaScript. Arrays and Hashes referenced
+ * more than once are converted once, and cycles are preserved. Every object
+ * converted so far is reachable from the value being built, so their heap
+ * pointers stay valid until the conversion is done.
+ *
+ * Nested values are converted using a frame per open Array or Hash instead
+ * of recursing, so they can't overflow the C stack.
+ */
+static void ctx_push_ruby_object(struct state *state, VALUE obj)
+{
+  duk_context *ctx = state->ctx;
+
+  // Left behind if a previous conversion raised
+  if (state->seen_ruby->num_entries || state->push_frames_len) {
+    st_clear(state->seen_ruby);
+    state->push_frames_len = 0;
+    state->pending_len = 0;
+  }
+
+  if (!ctx_push_ruby_value(state, obj)) {
+    return;
+  }
+
+  ctx_open_push_frame(state, obj);
+
+  while (state->push_frames_len > 0) {
+    struct frame *f = &state->push_frames[state->push_frames_len - 1];
+    VALUE val;
+
+    if (f->top < 0) {
+      if (f->pos >= (duk_size_t)RARRAY_LEN(f->obj)) {
+        goto close;
+      }
+      val = RARRAY_AREF(f->obj, f->pos);
+      f->pos++;
+    } else {
+      if (f->pos >= (duk_size_t)state->pending_len) {
+        goto close;
+      }
+      ctx_push_hash_key(state, state->pending[f->pos]);
+      val = state->pending[f->pos + 1];
+      f->pos += 2;
+    }
+
+    if (ctx_push_ruby_value(state, val)) {
+      ctx_open_push_frame(state, val);
+      continue;
+    }
+    goto put;
+
+close:
+    // The Array or Hash is complete, store it in its parent
+    if (f->top >= 0) {
+      state->pending_len = f->top;
+    }
+    if (--state->push_frames_len == 0) {
+      break;
+    }
+    f = &state->push_frames[state->push_frames_len - 1];
+
+put:
+    if (f->top < 0) {
+      duk_put_prop_index(ctx, f->index, (duk_uarridx_t)(f->pos - 1));
+    } else {
+      duk_put_prop(ctx, f->index);
+    }
+  }
+
+  st_clear(state->seen_ruby);
+}
+
+static duk_ret_t json_encode(duk_context *ctx, void *udata)
+{
+  duk_json_encode(ctx, -1);
+  return 1;
+}
+
+static duk_ret_t json_decode(duk_context *ctx, void *udata)
+{
+  duk_json_decode(ctx, -1);
+  return 1;
+}
+
+/*
+ * Serializes the value on top of the stack to JSON and clears the stack.
+ * Returns nil for values JSON.stringify doesn't serialize.
+ */
+static VALUE ctx_stack_to_json(struct state *state)
+{
+  duk_context *ctx = state->ctx;
+
+  if (duk_safe_call(ctx, json_encode, NULL, 1, 1) != DUK_EXEC_SUCCESS) {
+    raise_ctx_error(state);
+  }
+
+  VALUE res = Qnil;
+  if (duk_is_string(ctx, -1)) {
+    duk_size_t len;
+    const char *buf = duk_get_lstring(ctx, -1, &len);
+    res = decode_cesu8(state, buf, len);
+  }
+
+  duk_set_top(ctx, 0);
+  return res;
+}
+
+static void ctx_push_raw_json(struct state *state, VALUE obj)
+{
+  duk_context *ctx = state->ctx;
+  VALUE json = rb_ivar_get(obj, id_iv_json);
+  Check_Type(json, T_STRING);
+
+  encode_cesu8(state, json);
+  if (duk_safe_call(ctx, json_decode, NULL, 1, 1) != DUK_EXEC_SUCCESS) {
+    raise_ctx_error(state);
+  }
+}
+
+/*
+ * CBOR marshalling (see the marshal: :cbor option of Context::new). Ruby
+ * values are encoded here and decoded with duk_cbor_decode, and results are
+ * encoded with duk_cbor_encode and decoded here, so a whole structure crosses
+ * as a single buffer instead of one Duktape API call per value.
+ */
+struct cbor_writer {
+  struct state *state;
+  VALUE buf;
+};
+
+static void cbor_writer_init(struct cbor_writer *w, struct state *state)
+{
+  w->state = state;
+  w->buf = rb_str_buf_new(64);
+
+  // Left behind if a previous conversion raised
+  state->push_frames_len = 0;
+  state->pending_len = 0;
+}
+
+static char *cbor_reserve(struct cbor_writer *w, long len)
+{
+  long cur = RSTRING_LEN(w->buf);
+  rb_str_modify_expand(w->buf, len);
+  return RSTRING_PTR(w->buf) + cur;
+}
+
+static void cbor_commit(struct cbor_writer *w, char *end)
+{
+  rb_str_set_len(w->buf, end - RSTRING_PTR(w->buf));
+}
+
+static char *cbor_put_head(char *out, int major, uint64_t val)
+{
+  unsigned char ib = (unsigned char)(major << 5);
+  int len;
+
+  if (val < 24) {
+    *out++ = (char)(ib | val);
+    return out;
+  } else if (val <= 0xff) {
+    *out++ = (char)(ib | 24);
+    len = 1;
+  } else if (val <= 0xffff) {
+    *out++ = (char)(ib | 25);
+    len = 2;
+  } else if (val <= 0xffffffff) {
+    *out++ = (char)(ib | 26);
+    len = 4;
+  } else {
+    *out++ = (char)(ib | 27);
+    len = 8;
+  }
+
+  while (len-- > 0) {
+    *out++ = (char)(val >> (len * 8));
+  }
+  return out;
+}
+
+static void cbor_write_head(struct cbor_writer *w, int major, uint64_t val)
+{
+  cbor_commit(w, cbor_put_head(cbor_reserve(w, 9), major, val));
+}
+
+static void cbor_write_double(struct cbor_writer *w, double d)
+{
+  uint64_t bits;
+  memcpy(&bits, &d, sizeof(bits));
+
+  char *out = cbor_reserve(w, 9);
+  *out++ = (char)0xfb;
+  for (int i = 7; i >= 0; i--) {
+    *out++ = (char)(bits >> (i * 8));
+  }
+  cbor_commit(w, out);
+}
+
+static void cbor_write_string(struct cbor_writer *w, VALUE str)
+{
+  str = utf8_string(w->state, str);
+
+  const char *ptr = RSTRING_PTR(str);
+  const char *end = RSTRING_END(str);
+  const char *pos = ENC_CODERANGE(str) == ENC_CODERANGE_7BIT ? end : find_utf8_4byte(ptr, end);
+
+  // Duktape keeps text strings as they are, so they must be in CESU-8
+  long len = end - ptr;
+  for (const char *p = pos; p < end; p = find_utf8_4byte(p + 4, end)) {
+    len += 2;
+  }
+
+  char *out = cbor_put_head(cbor_reserve(w, 9 + len), 3, len);
+  cbor_commit(w, write_cesu8(out, ptr, pos, end));
+  RB_GC_GUARD(str);
+}
+
+static void cbor_write_key(struct cbor_writer *w, VALUE key)
+{
+  switch (TYPE(key)) {
+    case T_SYMBOL:
+#ifdef HAVE_RB_SYM2STR
+      cbor_write_string(w, rb_sym2str(key));
+#else
+      cbor_write_string(w, rb_id2str(SYM2ID(key)));
+#endif
+      return;
+    case T_STRING:
+      cbor_write_string(w, key);
+      return;
+    default:
+      clean_raise(w->state->ctx, rb_eTypeError, "invalid key type %s", rb_obj_classname(key));
+  }
+}
+
+/*
+ * Writes a value other than an Array or Hash. Returns 0 for Arrays and
+ * Hashes, which are written by cbor_write_value.
+ */
+static int cbor_write_scalar(struct cbor_writer *w, VALUE obj)
+{
+  switch (TYPE(obj)) {
+    case T_FIXNUM: {
+      long n = FIX2LONG(obj);
+      if (n >= 0) {
+        cbor_write_head(w, 0, (uint64_t)n);
+      } else {
+        cbor_write_head(w, 1, (uint64_t)(-1 - n));
+      }
+      return 1;
+    }
+
+    case T_FLOAT:
+    case T_BIGNUM:
+      cbor_write_double(w, NUM2DBL(obj));
+      return 1;
+
+    case T_SYMBOL:
+      cbor_write_key(w, obj);
+      return 1;
+
+    case T_STRING:
+      if (w->state->binary && ENCODING_GET(obj) == rb_ascii8bit_encindex()) {
+        char *out = cbor_put_head(cbor_reserve(w, 9 + RSTRING_LEN(obj)), 2, RSTRING_LEN(obj));
+        memcpy(out, RSTRING_PTR(obj), RSTRING_LEN(obj));
+        cbor_commit(w, out + RSTRING_LEN(obj));
+      } else {
+        cbor_write_string(w, obj);
+      }
+      return 1;
+
+    case T_TRUE:
+      cbor_write_head(w, 7, 21);
+      return 1;
+
+    case T_FALSE:
+      cbor_write_head(w, 7, 20);
+      return 1;
+
+    case T_NIL:
+      cbor_write_head(w, 7, 22);
+      return 1;
+
+    case T_ARRAY:
+    case T_HASH:
+      return 0;
+
+    default:
+      // Cannot convert
+      break;
+  }
+
+  clean_raise(w->state->ctx, rb_eTypeError, "cannot convert %s", rb_obj_classname(obj));
+  return 1;
+}
+
+/*
+ * Writes the head of an Array or Hash and opens a frame for its values, like
+ * ctx_open_push_frame.
+ */
+static void cbor_open_frame(struct cbor_writer *w, VALUE obj)
+{
+  struct state *state = w->state;
+
+  if (state->push_frames_len >= state->max_depth) {
+    clean_raise(state->ctx, eRangeError, "nesting of %d is too deep", state->max_depth + 1);
+  }
+
+  if (state->push_frames_len == state->push_frames_capa) {
+    state->push_frames_capa = state->push_frames_capa ? state->push_frames_capa * 2 : 16;
+    state->push_frames = realloc(state->push_frames, sizeof(struct frame) * state->push_frames_capa);
+    if (state->push_frames == NULL) {
+      rb_memerror();
+    }
+  }
+
+  struct frame *f = &state->push_frames[state->push_frames_len++];
+  f->obj = obj;
+
+  if (RB_TYPE_P(obj, T_HASH)) {
+    cbor_write_head(w, 5, RHASH_SIZE(obj));
+    f->top = (duk_idx_t)state->pending_len;
+    rb_hash_foreach(obj, ctx_push_hash_element, (VALUE)state);
+    f->pos = f->top;
+  } else {
+    cbor_write_head(w, 4, RARRAY_LEN(obj));
+    f->top = -1;
+    f->pos = 0;
+  }
+}
+
+/*
+ * Writes a Ruby value. Nested values are written using a frame per open
+ * Array or Hash instead of recursing, so they can't overflow the C stack.
+ */
+static void cbor_write_value(struct cbor_writer *w, VALUE obj)
+{
+  struct state *state = w->state;
+
+  if (cbor_write_scalar(w, obj)) {
+    return;
+  }
+
+  cbor_open_frame(w, obj);
+
+  while (state->push_frames_len > 0) {
+    struct frame *f = &state->push_frames[state->push_frames_len - 1];
+    VALUE val;
+
+    if (f->top < 0) {
+      if (f->pos >= (duk_size_t)RARRAY_LEN(f->obj)) {
+        state->push_frames_len--;
+        continue;
+      }
+      val = RARRAY_AREF(f->obj, f->pos);
+      f->pos++;
+    } else {
+      if (f->pos >= (duk_size_t)state->pending_len) {
+        state->pending_len = f->top;
+        state->push_frames_len--;
+        continue;
+      }
+      cbor_write_key(w, state->pending[f->pos]);
+      val = state->pending[f->pos + 1];
+      f->pos += 2;
+    }
+
+    if (!cbor_write_scalar(w, val)) {
+      cbor_open_frame(w, val);
+    }
+  }
+}
+
+static duk_ret_t cbor_encode(duk_context *ctx, void *udata)
+{
+  duk_cbor_encode(ctx, -1, 0);
+  return 1;
+}
+
+static duk_ret_t cbor_decode(duk_context *ctx, void *udata)
+{
+  duk_cbor_decode(ctx, -1, 0);
+  return 1;
+}
+
+/*
+ * Pushes the Ruby values as a single JavaScript array.
+ */
+static void ctx_push_cbor_array(struct state *state, int argc, VALUE *argv)
+{
+  duk_context *ctx = state->ctx;
+  struct cbor_writer w;
+  cbor_writer_init(&w, state);
+
+  cbor_write_head(&w, 4, argc);
+  for (int i = 0; i < argc; i++) {
+    cbor_write_value(&w, argv[i]);
+  }
+
+  // The buffer is only read while decoding, so it doesn't need to be copied
+  duk_push_external_buffer(ctx);
+  duk_config_buffer(ctx, -1, RSTRING_PTR(w.buf), RSTRING_LEN(w.buf));
+  if (duk_safe_call(ctx, cbor_decode, NULL, 1, 1) != DUK_EXEC_SUCCESS) {
+    raise_ctx_error(state);
+  }
+
+  RB_GC_GUARD(w.buf);
+}
+
+static VALUE hash_new_capa(long capa)
+{
+#ifdef HAVE_RB_HASH_NEW_CAPA
+  return rb_hash_new_capa(capa);
+#else
+  return rb_hash_new();
+#endif
+}
+
+struct cbor_reader {
+  struct state *state;
+  const unsigned char *ptr;
+  const unsigned char *end;
+  long prev_frames_len;
+};
+
+static void cbor_invalid(struct cbor_reader *r)
+{
+  clean_raise(r->state->ctx, eInternalError, "invalid CBOR data");
+}
+
+static uint64_t cbor_read_uint(struct cbor_reader *r, int len)
+{
+  uint64_t val = 0;
+
+  if (r->end - r->ptr < len) {
+    cbor_invalid(r);
+  }
+
+  while (len-- > 0) {
+    val = (val << 8) | *r->ptr++;
+  }
+  return val;
+}
+
+static uint64_t cbor_read_arg(struct cbor_reader *r, int ai)
+{
+  switch (ai) {
+    case 24: return cbor_read_uint(r, 1);
+    case 25: return cbor_read_uint(r, 2);
+    case 26: return cbor_read_uint(r, 4);
+    case 27: return cbor_read_uint(r, 8);
+    default:
+      if (ai >= 24) {
+        cbor_invalid(r);
+      }
+      return ai;
+  }
+}
+
+static double cbor_half_to_double(unsigned int half)
+{
+  int exp = (half >> 10) & 0x1f;
+  int mant = half & 0x3ff;
+  double d;
+
+  if (exp == 0) {
+    d = ldexp(mant, -24);
+  } else if (exp == 31) {
+    d = mant == 0 ? INFINITY : NAN;
+  } else {
+    d = ldexp(mant + 1024, exp - 25);
+  }
+
+  return (half & 0x8000) ? -d : d;
+}
+
+// The count of an Array or Hash whose end is marked by a break
+#define CBOR_INDEFINITE ((duk_size_t)-1)
+
+static int cbor_at_break(struct cbor_reader *r, duk_size_t count, duk_size_t i)
+{
+  if (count != CBOR_INDEFINITE) {
+    return i >= count;
+  }
+
+  if (r->ptr >= r->end) {
+    cbor_invalid(r);
+  }
+
+  if (*r->ptr == 0xff) {
+    r->ptr++;
+    return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * Opens a frame for the values of an Array or Hash with count entries, like
+ * ctx_open_frame.
+ */
+static void cbor_read_frame(struct cbor_reader *r, VALUE obj, duk_size_t count)
+{
+  struct state *state = r->state;
+
+  if (state->frames_len >= state->max_depth) {
+    clean_raise(state->ctx, eRangeError, "nesting of %d is too deep", state->max_depth + 1);
+  }
+
+  if (state->frames_len == state->frames_capa) {
+    state->frames_capa = state->frames_capa ? state->frames_capa * 2 : 16;
+    state->frames = realloc(state->frames, sizeof(struct frame) * state->frames_capa);
+    if (state->frames == NULL) {
+      rb_memerror();
+    }
+  }
+
+  struct frame *f = &state->frames[state->frames_len++];
+  f->obj = obj;
+  f->pos = 0;
+  f->length = count;
+}
+
+/*
+ * Reads a value. Arrays and Hashes are returned empty, with a frame to read
+ * their values from.
+ */
+static VALUE cbor_read_item(struct cbor_reader *r)
+{
+  int ib, major, ai;
+  uint64_t arg = 0;
+
+  do {
+    if (r->ptr >= r->end) {
+      cbor_invalid(r);
+    }
+
+    ib = *r->ptr++;
+    major = ib >> 5;
+    ai = ib & 0x1f;
+
+    if (ai == 31 && (major == 4 || major == 5)) {
+      arg = UINT64_MAX;
+    } else if (major != 7) {
+      arg = cbor_read_arg(r, ai);
+    }
+
+    // Tags aren't used by Duktape, use the value as is
+  } while (major == 6);
+
+  uint64_t avail = (uint64_t)(r->end - r->ptr);
+
+  switch (major) {
+    case 0:
+      return rb_float_new((double)arg);
+
+    case 1:
+      return rb_float_new(-1.0 - (double)arg);
+
+    case 2:
+    case 3: {
+      if (arg > avail) {
+        cbor_invalid(r);
+      }
+
+      const char *ptr = (const char *)r->ptr;
+      const char *end = ptr + arg;
+      r->ptr += arg;
+
+      if (major == 3) {
+        return decode_cesu8(r->state, ptr, arg);
+      }
+
+      // Duktape uses byte strings both for buffer data and for strings with
+      // surrogates (which aren't valid UTF-8), so decode those as text.
+      if (find_cesu8_surrogate(ptr, end) != end) {
+        VALUE str = cesu8_to_utf8(ptr, arg);
+        if (!NIL_P(str) && rb_enc_str_coderange(str) != ENC_CODERANGE_BROKEN) {
+          return str;
+        }
+      }
+      return rb_str_new(ptr, arg);
+    }
+
+    case 4: {
+      // Every element takes at least one byte
+      if (arg != UINT64_MAX && arg > avail) {
+        cbor_invalid(r);
+      }
+      VALUE ary = rb_ary_new_capa(arg == UINT64_MAX ? 0 : (long)arg);
+      cbor_read_frame(r, ary, arg == UINT64_MAX ? CBOR_INDEFINITE : (duk_size_t)arg);
+      return ary;
+    }
+
+    case 5: {
+      // Every entry takes at least two bytes
+      if (arg != UINT64_MAX && arg > avail / 2) {
+        cbor_invalid(r);
+      }
+      VALUE hash = hash_new_capa(arg == UINT64_MAX ? 0 : (long)arg);
+      cbor_read_frame(r, hash, arg == UINT64_MAX ? CBOR_INDEFINITE : (duk_size_t)arg);
+      return hash;
+    }
+
+    case 7:
+      switch (ai) {
+        case 20: return Qfalse;
+        case 21: return Qtrue;
+        case 22:
+        case 23: return Qnil;
+        case 25: return rb_float_new(cbor_half_to_double((unsigned int)cbor_read_uint(r, 2)));
+        case 26: {
+          uint32_t bits = (uint32_t)cbor_read_uint(r, 4);
+          float f;
+          memcpy(&f, &bits, sizeof(f));
+          return rb_float_new(f);
+        }
+        case 27: {
+          uint64_t bits = cbor_read_uint(r, 8);
+          double d;
+          memcpy(&d, &bits, sizeof(d));
+          return rb_float_new(d);
+        }
+      }
+      break;
+  }
+
+  cbor_invalid(r);
+  return Qnil;
+}
+
+/*
+ * Reads a value using a frame per open Array or Hash instead of recursing,
+ * so deeply nested values can't overflow the C stack. Arrays and Hashes are
+ * stored in their parent when they are opened, which keeps them reachable
+ * from the result.
+ */
+static VALUE cbor_read_body(VALUE ptr)
+{
+  struct cbor_reader *r = (struct cbor_reader *)ptr;
+  struct state *state = r->state;
+  long base = state->frames_len;
+  VALUE res = cbor_read_item(r);
+
+  while (state->frames_len > base) {
+    struct frame *f = &state->frames[state->frames_len - 1];
+    VALUE obj = f->obj;
+    long frames_len = state->frames_len;
+
+    if (cbor_at_break(r, f->length, f->pos)) {
+      state->frames_len--;
+      continue;
+    }
+    f->pos++;
+
+    if (RB_TYPE_P(obj, T_ARRAY)) {
+      rb_ary_push(obj, cbor_read_item(r));
+    } else {
+      VALUE key = cbor_read_item(r);
+      if (state->frames_len != frames_len) {
+        cbor_invalid(r);
+      }
+      if (RB_TYPE_P(key, T_STRING)) {
+        key = key_from_string(state, key);
+      }
+      rb_hash_aset(obj, key, cbor_read_item(r));
+    }
+  }
+
+  if (r->ptr != r->end) {
+    cbor_invalid(r);
+  }
+  return res;
+}
+
+static VALUE cbor_read_ensure(VALUE ptr)
+{
+  struct cbor_reader *r = (struct cbor_reader *)ptr;
+  r->state->frames_len = r->prev_frames_len;
+  return Qnil;
+}
+
+/*
+ * Converts CBOR data to a Ruby object.
+ */
+static VALUE cbor_read_value(struct state *state, const void *ptr, size_t len)
+{
+  struct cbor_reader r;
+  r.state = state;
+  r.ptr = ptr;
+  r.end = r.ptr + len;
+  r.prev_frames_len = state->frames_len;
+
+  return rb_ensure(cbor_read_body, (VALUE)&r, cbor_read_ensure, (VALUE)&r);
+}
+
+/*
+ * Converts the value on top of the stack to a Ruby object through CBOR.
+ */
+static VALUE ctx_stack_to_value_cbor(struct state *state)
+{
+  duk_context *ctx = state->ctx;
+
+  if (duk_safe_call(ctx, cbor_encode, NULL, 1, 1) != DUK_EXEC_SUCCESS) {
+    raise_ctx_error(state);
+  }
+
+  duk_size_t len;
+  const void *buf = duk_get_buffer(ctx, -1, &len);
+  return cbor_read_value(state, buf, len);
+}
+
+/*
+ * Converts the value on top of the stack to a Ruby object and clears the
+ * stack.
+ */
+static VALUE ctx_pop_result(struct state *state)
+{
+  VALUE res;
+  if (state->marshal_cbor) {
+    res = ctx_stack_to_value_cbor(state);
+  } else {
+    res = ctx_stack_to_value(state, -1);
+  }
+
+  duk_set_top(state->ctx, 0);
+  return res;
+}
+
+static int cbor_supports_args(int argc, VALUE *argv)
+{
+  for (int i = 0; i < argc; i++) {
+    if (rb_obj_is_kind_of(argv[i], cRawJSON) || is_ref(argv[i])) {
+      return 0;
+    }
+  }
+  return argc > 0;
+}
+
+/*
+ * Pushes arguments for a function call.
+ */
+static void ctx_push_args(struct state *state, int argc, VALUE *argv)
+{
+  duk_context *ctx = state->ctx;
+
+  if (!state->marshal_cbor || !cbor_supports_args(argc, argv)) {
+    for (int i = 0; i < argc; i++) {
+      ctx_push_ruby_object(state, argv[i]);
+    }
+    return;
+  }
+
+  ctx_push_cbor_array(state, argc, argv);
+
+  duk_idx_t arr_idx = duk_get_top_index(ctx);
+  for (int i = 0; i < argc; i++) {
+    duk_get_prop_index(ctx, arr_idx, i);
+  }
+  duk_remove(ctx, arr_idx);
+}
+
+/*
+ * Returns the exception for the error on top of the stack, leaving the values
+ * it reads on the stack. Raises InternalError after a fatal error instead.
+ */
+static VALUE ctx_error_exception(struct state *state)
+{
+  duk_context *ctx = state->ctx;
+  struct heap *heap = state->heap;
+
+  if (heap->is_fatal) {
+    rb_raise(eInternalError, "%s", heap->fatal_msg);
+  }
+
+  // Ruby exceptions raised by functions defined with define_function are
+  // raised again unless JavaScript caught them
+  if (!NIL_P(heap->callback_error)) {
+    VALUE exc = heap->callback_error;
+    void *ptr = heap->callback_error_ptr;
+    heap->callback_error = Qnil;
+    heap->callback_error_ptr = NULL;
+    if (duk_is_object(ctx, -1) && duk_get_heapptr(ctx, -1) == ptr) {
+      return exc;
+    }
+  }
+
+  duk_get_prop_string(ctx, -1, "name");
+  const char *name = duk_safe_to_string(ctx, -1);
+
+  duk_get_prop_string(ctx, -2, "message");
+  const char *message = duk_to_string(ctx, -1);
+
+  VALUE exc_class = error_name_class(name);
+  return rb_exc_new2(exc_class, message);
+}
+
+static void raise_ctx_error(struct state *state)
+{
+  VALUE exc = ctx_error_exception(state);
+  clean_raise_exc(state->ctx, exc);
+}
+
+/*
+ * Pushes the function compiled for source and filename by an earlier
+ * eval_string. Returns 0 if there isn't one.
+ */
+static int ctx_push_cached_eval(struct state *state, VALUE source, VALUE filename)
+{
+  if (state->eval_cache_capa == 0 || RSTRING_LEN(source) > state->eval_cache_max_source) {
+    return 0;
+  }
+
+  VALUE slot = Qnil;
+  if (!NIL_P(state->eval_cache)) {
+    slot = rb_hash_lookup(state->eval_cache, rb_assoc_new(source, filename));
+  }
+  if (!NIL_P(slot)) {
+    struct eval_cache_entry *entry = &state->eval_entries[FIX2INT(slot)];
+    entry->used = ++state->eval_cache_clock;
+    state->eval_cache_hits++;
+    heap_push_ref(state->heap, state->ctx, entry->ref);
+    return 1;
+  }
+
+  state->eval_cache_misses++;
+  return 0;
+}
+
+/*
+ * Remembers the function on top of the stack, compiled for source and
+ * filename, replacing the least recently used one when the cache is full.
+ */
+static void ctx_cache_eval(struct state *state, VALUE source, VALUE filename)
+{
+  if (state->eval_cache_capa == 0 || RSTRING_LEN(source) > state->eval_cache_max_source) {
+    return;
+  }
+
+  if (NIL_P(state->eval_cache)) {
+    state->eval_entries = malloc(sizeof(struct eval_cache_entry) * state->eval_cache_capa);
+    if (state->eval_entries == NULL) {
+      rb_memerror();
+    }
+    state->eval_cache = rb_hash_new();
+  }
+
+  VALUE key = rb_assoc_new(rb_str_new_frozen(source), rb_str_new_frozen(filename));
+  OBJ_FREEZE(key);
+
+  int slot = state->eval_cache_len;
+  if (state->eval_cache_len == state->eval_cache_capa) {
+    slot = 0;
+    for (int i = 1; i < state->eval_cache_len; i++) {
+      if (state->eval_entries[i].used < state->eval_entries[slot].used) {
+        slot = i;
+      }
+    }
+    rb_hash_delete(state->eval_cache, state->eval_entries[slot].key);
+    heap_unref(state->heap, state->ctx, state->eval_entries[slot].ref);
+  } else {
+    state->eval_cache_len++;
+  }
+
+  struct eval_cache_entry *entry = &state->eval_entries[slot];
+  entry->key = key;
+  entry->ref = heap_ref(state->heap, state->ctx, -1);
+  entry->used = ++state->eval_cache_clock;
+  rb_hash_aset(state->eval_cache, key, INT2FIX(slot));
+}
+
+/*
+ * call-seq:
+ *   eval_cache_stats -> hash
+ *
+ * Returns the number of compiled functions kept for #eval_string and how
+ * often they were found or not.
+ *
+ *     ctx.eval_string("1 + 1")
+ *     ctx.eval_string("1 + 1")
+ *     ctx.eval_cache_stats #=> {size: 1, capacity: 64, hits: 1, misses: 1}
+ *
+ */
+static VALUE ctx_eval_cache_stats(VALUE self)
+{
+  struct state *state;
+  Data_Get_Struct(self, struct state, state);
+
+  VALUE stats = rb_hash_new();
+  rb_hash_aset(stats, ID2SYM(rb_intern("size")), INT2FIX(state->eval_cache_len));
+  rb_hash_aset(stats, ID2SYM(rb_intern("capacity")), INT2FIX(state->eval_cache_capa));
+  rb_hash_aset(stats, ID2SYM(rb_intern("hits")), ULONG2NUM(state->eval_cache_hits));
+  rb_hash_aset(stats, ID2SYM(rb_intern("misses")), ULONG2NUM(state->eval_cache_misses));
+  return stats;
+}
+
+static void ctx_push_eval_result(struct state *state, int argc, VALUE *argv)
+{
+  VALUE source;
+  VALUE filename;
+
+  rb_scan_args(argc, argv, "11", &source, &filename);
+
+  if (NIL_P(filename)) {
+    filename = sDefaultFilename;
+  }
+
+  StringValue(source);
+  StringValue(filename);
+
+  if (!ctx_push_cached_eval(state, source, filename)) {
+    encode_cesu8(state, source);
+    encode_cesu8(state, filename);
+
+    if (ctx_pcompile(state, DUK_COMPILE_EVAL) == DUK_EXEC_ERROR) {
+      raise_ctx_error(state);
+    }
+
+    ctx_cache_eval(state, source, filename);
+  }
+
+  if (ctx_pcall(state, 0) == DUK_EXEC_ERROR) {
+    raise_ctx_error(state);
+  }
+}
+
+/*
+ * call-seq:
+ *   eval_string(string[, filename]) -> obj
+ *
+ * Evaluate JavaScript expression within context returning the value as a Ruby
+ * object.
+ *
+ *     ctx.eval_string("40 + 2") #=> 42
+ *
+ */
+static VALUE ctx_eval_string(int argc, VALUE *argv, VALUE self)
+{
+  struct state *state;
+  Data_Get_Struct(self, struct state, state);
+  check_fatal(state);
+
+  ctx_push_eval_result(state, argc, argv);
+
+  return ctx_pop_result(state);
+}
+
+/*
+ * call-seq:
+ *   eval_json(string[, filename]) -> string or nil
+ *
+ * Evaluate JavaScript expression within context returning the value
+ * serialized with JSON.stringify. This is much faster than #eval_string for
+ * large objects which are going to be serialized to JSON anyway. Returns nil
+ * if the value can't be serialized, such as undefined or a Function.
+ *
+ *     ctx.eval_json("({a: [1, 2]})") #=> "{\"a\":[1,2]}"
+ *
+ */
+static VALUE ctx_eval_json(int argc, VALUE *argv, VALUE self)
+{
+  struct state *state;
+  Data_Get_Struct(self, struct state, state);
+  check_fatal(state);
+
+  ctx_push_eval_result(state, argc, argv);
+
+  return ctx_stack_to_json(state);
+}
+
+/*
+ * call-seq:
+ *   exec_string(string[, filename]) -> nil
+ *
+ * Evaluate JavaScript expression within context returning the value as a Ruby
+ * object.
+ *
+ *     ctx.exec_string("var foo = 42")
+ *     ctx.eval_string("foo") #=> 42
+ *
+ */
+static VALUE ctx_exec_string(int argc, VALUE *argv, VALUE self)
+{
+  struct state *state;
+  Data_Get_Struct(self, struct state, state);
+  check_fatal(state);
+
+  VALUE source;
+  VALUE filename;
+
+  rb_scan_args(argc, argv, "11", &source, &filename);
+
+  if (NIL_P(filename)) {
+    filename = sDefaultFilename;
+  }
+
+  StringValue(source);
+  StringValue(filename);
+
+  if (!NIL_P(state->bytecode_cache)) {
+    VALUE script = rb_funcall(state->bytecode_cache, id_fetch, 2, source, filename);
+    ctx_push_script(state, script);
+  } else {
+    encode_cesu8(state, source);
+    encode_cesu8(state, filename);
+
+    if (ctx_pcompile(state, 0) == DUK_EXEC_ERROR) {
+      raise_ctx_error(state);
+    }
+  }
+
+  if (ctx_pcall(state, 0) == DUK_EXEC_ERROR) {
+    raise_ctx_error(state);
+  }
+
+  duk_set_top(state->ctx, 0);
+  return Qnil;
+}
+
+/*
+ * A file being compiled by ctx_push_file. The mapped file and the CESU-8
+ * copy are released by compile_file_release however compiling ends.
+ */
+struct compile_file {
+  struct state *state;
+  const char *ptr;
+  size_t len;
+  duk_uint_t flags;
+  void *map;
+  char *buf;
+  int err;
+};
+
+/*
+ * Compiles UTF-8 source code, with the filename on top of the stack. The
+ * source is compiled in place unless it contains 4-byte sequences, which
+ * have to be rewritten as CESU-8 first. Returns the result of duk_pcompile,
+ * or DUK_INVALID_INDEX if the source isn't valid UTF-8 or the buffer for
+ * rewriting it can't be allocated (with err set to ENOMEM).
+ */
+static VALUE compile_utf8(VALUE ptr)
+{
+  struct compile_file *file = (struct compile_file *)ptr;
+  const char *end = file->ptr + file->len;
+  const char *pos;
+
+  if (find_invalid_utf8(file->ptr, end, &pos) != end) {
+    return INT2NUM(DUK_INVALID_INDEX);
+  }
+
+  if (pos == end) {
+    return INT2NUM(ctx_pcompile_lstring(file->state, file->flags, file->ptr, file->len));
+  }
+
+  // Every 4-byte sequence becomes two 3-byte surrogates
+  file->buf = malloc(file->len + file->len / 2);
+  if (file->buf == NULL) {
+    file->err = ENOMEM;
+    return INT2NUM(DUK_INVALID_INDEX);
+  }
+
+  char *out = write_cesu8(file->buf, file->ptr, pos, end);
+  return INT2NUM(ctx_pcompile_lstring(file->state, file->flags, file->buf, out - file->buf));
+}
+
+static VALUE compile_file_release(VALUE ptr)
+{
+  struct compile_file *file = (struct compile_file *)ptr;
+
+  free(file->buf);
+  file->buf = NULL;
+#ifdef HAVE_MMAP
+  if (file->map != NULL) {
+    munmap(file->map, file->len);
+    file->map = NULL;
+  }
+#endif
+  return Qnil;
+}
+
+/*
+ * Compiles the file at path and pushes the function. Regular files are
+ * memory-mapped and compiled without copying them into Ruby or JavaScript
+ * strings first. Other files are read with File.binread.
+ */
+static void ctx_push_file(struct state *state, VALUE path, VALUE filename, duk_uint_t flags)
+{
+  duk_context *ctx = state->ctx;
+  VALUE ospath = rb_str_encode_ospath(path);
+
+  encode_cesu8(state, filename);
+
+  int fd = rb_cloexec_open(StringValueCStr(ospath), O_RDONLY, 0);
+  if (fd < 0) {
+    duk_set_top(ctx, 0);
+    rb_sys_fail_str(path);
+  }
+  rb_update_max_fd(fd);
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    int e = errno;
+    close(fd);
+    duk_set_top(ctx, 0);
+    rb_syserr_fail_str(e, path);
+  }
+
+  struct compile_file file = { state, NULL, 0, flags, NULL, NULL, 0 };
+  VALUE source = Qnil;
+#ifdef HAVE_MMAP
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    size_t len = (size_t)st.st_size;
+    void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    int e = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+      duk_set_top(ctx, 0);
+      rb_syserr_fail_str(e, path);
+    }
+
+    file.map = map;
+    file.ptr = map;
+    file.len = len;
+  } else
+#endif
+  {
+    close(fd);
+    source = rb_funcall(rb_cFile, id_binread, 1, ospath);
+    file.ptr = RSTRING_PTR(source);
+    file.len = RSTRING_LEN(source);
+  }
+
+  // Fatal errors raise out of Duktape unless it runs without the GVL
+  duk_int_t rc = NUM2INT(rb_ensure(compile_utf8, (VALUE)&file, compile_file_release, (VALUE)&file));
+  RB_GC_GUARD(source);
+
+  if (rc == DUK_INVALID_INDEX) {
+    if (file.err == ENOMEM) {
+      duk_set_top(ctx, 0);
+      rb_memerror();
+    }
+    clean_raise(ctx, rb_eEncodingError, "invalid byte sequence in UTF-8");
+  }
+
+  if (rc == DUK_EXEC_ERROR) {
+    raise_ctx_error(state);
+  }
+}
+
+/*
+ * call-seq:
+ *   exec_file(path[, filename]) -> nil
+ *
+ * Evaluate a JavaScript file within context. The filename used in stack
+ * traces defaults to the path.
+ *
+ *     ctx.exec_file("vendor/babel.js")
+ *     ctx.call_prop(["babel", "transform"], source)
+ *
+ * The file is memory-mapped and compiled in place, so large libraries aren't
+ * copied into a Ruby String first. It must be valid UTF-8.
+ *
+ */
+static VALUE ctx_exec_file(int argc, VALUE *argv, VALUE self)
+{
+  struct state *state;
+  Data_Get_Struct(self, struct state, state);
+  check_fatal(state);
+
+  VALUE path;
+  VALUE filename;
+
+  rb_scan_args(argc, argv, "11", &path, &filename);
+
+  FilePathValue(path);
+  filename = NIL_P(filename) ? path : filename;
+  StringValue(filename);
+
+  if (!NIL_P(state->bytecode_cache)) {
+    // The cache is keyed by the source
+    VALUE source = rb_funcall(rb_cFile, id_binread, 1, rb_str_encode_ospath(path));
+    rb_enc_associate(source, rb_utf8_encoding());
+    VALUE args[2] = { source, filename };
+    return ctx_exec_string(2, args, self);
+  }
+
+  ctx_push_file(state, path, filename, 0);
+
+  if (ctx_pcall(state, 0) == DUK_EXEC_ERROR) {
+    raise_ctx_error(state);
+  }
+
+  duk_set_top(state->ctx, 0);
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   eval_file(path[, filename]) -> obj
+ *
+ * Evaluate a JavaScript file within context returning the value of the last
+ * expression as a Ruby object. See #exec_file.
+ *
+ *     ctx.eval_file("config.js") #=> {"port" => 8080.0}
+ *
+ */
+static VALUE ctx_eval_file(int argc, VALUE *argv, VALUE self)
+{
+  struct state *state;
+  Data_Get_Struct(self, struct state, state);
+  check_fatal(state);
+
+  VALUE path;
+  VALUE filename;
+
+  rb_scan_args(argc, argv, "11", &path, &filename);
+
+  FilePathValue(path);
+  filename = NIL_P(filename) ? path : filename;
+  StringValue(filename);
+
+  ctx_push_file(state, path, filename, DUK_COMPILE_EVAL);
+
+  if (ctx_pcall(state, 0) == DUK_EXEC_ERROR) {
+    raise_ctx_error(state);
+  }
+
+  return ctx_pop_result(state);
+}
+
+static duk_ret_t dump_function(duk_context *ctx, void *udata)
+{
+  duk_dump_function(ctx);
+  return 1;
+}
+
+static duk_ret_t load_function(duk_context *ctx, void *udata)
+{
+  duk_load_function(ctx);
+  return 1;
+}
+
+static VALUE script_bytecode(VALUE script)
+{
+  if (!rb_obj_is_kind_of(script, cScript)) {
+    rb_raise(rb_eTypeError, "wrong argument type %s (expected Duktape::Script)", rb_obj_classname(script));
+  }
+
+  VALUE bytecode = rb_ivar_get(script, id_iv_bytecode);
+  if (!RB_TYPE_P(bytecode, T_STRING) || RSTRING_LEN(bytecode) == 0 || RSTRING_PTR(bytecode)[0] != (char)0xbf) {
+    rb_raise(rb_eArgError, "invalid bytecode in %s", rb_obj_classname(script));
+  }
+
+  return bytecode;
+}
+
+static void ctx_push_script(struct state *state, VALUE script)
+{
+  duk_context *ctx = state->ctx;
+  VALUE bytecode = script_bytecode(script);
+
+  // The bytecode is copied into the heap by duk_load_function, so there's no
+  // need to copy it into a Duktape buffer first.
+  duk_push_external_buffer(ctx);
+  duk_config_buffer(ctx, -1, RSTRING_PTR(bytecode), RSTRING_LEN(bytecode));
+
+  if (duk_safe_call(ctx, load_function, NULL, 1, 1) != DUK_EXEC_SUCCESS) {
+    raise_ctx_error(state);
+  }
+}
+
+/*
+ * call-seq:
+ *   eval_script(script) -> obj
+ *
+ * Run a precompiled Script within context returning the value of the last
+ * expression as a Ruby object.
+ *
+ *     script = Duktape::Script.compile("var n = 42; n + 1")
+ *     ctx.eval_script(script) #=> 43
+ *
+ */
+static VALUE ctx_eval_script(VALUE self, VALUE script)
+{
+  struct state *state;
+  Data_Get_Struct(self, struct state, state);
+  check_fatal(state);
+
+  ctx_push_script(state, script);
+
+  if (ctx_pcall(state, 0) == DUK_EXEC_ERROR) {
+    raise_ctx_error(state);
+  }
+
+  return ctx_pop_result(state);
+}
+
+/*
+ * call-seq:
+ *   exec_script(script) -> nil
+ *
+ * Run a precompiled Script within context. See Script::compile.
+ *
+ *     script = Duktape::Script.compile("var foo = 42")
+ *     ctx.exec_script(script)
+ *     ctx.eval_string("foo") #=> 42
+ *
+ */
+static VALUE ctx_exec_script(VALUE self, VALUE script)
+{
+  struct state *state;
+  Data_Get_Struct(self, struct state, state);
+  check_fatal(state);
+
+  ctx_push_script(state, script);
+
+  if (ctx_pcall(state, 0) == DUK_EXEC_ERROR) {
+    raise_ctx_error(state);
+  }
+
+  duk_set_top(state->ctx, 0);
+  return Qnil;
+}
+
+struct compile_args {
+  struct state *state;
+  VALUE klass;
+  VALUE source;
+  VALUE filename;
+};
+
+static VALUE script_do_compile(VALUE ptr)
+{
+  struct compile_args *args = (struct compile_args *)ptr;
+  struct state *state = args->state;
+  duk_context *ctx = state->ctx;
+
+  encode_cesu8(state, args->source);
+  encode_cesu8(state, args->filename);
+
+  if (ctx_pcompile(state, 0) == DUK_EXEC_ERROR) {
+    raise_ctx_error(state);
+  }
+
+  if (duk_safe_call(ctx, dump_function, NULL, 1, 1) != DUK_EXEC_SUCCESS) {
+    raise_ctx_error(state);
+  }
+
+  duk_size_t len;
+  void *buf = duk_get_buffer(ctx, -1, &len);
+  VALUE bytecode = rb_str_new(buf, len);
+  OBJ_FREEZE(bytecode);
+  duk_set_top(ctx, 0);
+
+  VALUE script = rb_obj_alloc(args->klass);
+  rb_ivar_set(script, id_iv_bytecode, bytecode);
+  rb_ivar_set(script, id_iv_filename, rb_str_new_frozen(args->filename));
+  return script;
+}
+
+static VALUE script_compile_ensure(VALUE ptr)
+{
+  struct compile_args *args = (struct compile_args *)ptr;
+
+  // Release the scratch heap right away instead of waiting for the GC
+  duk_destroy_heap(args->state->heap->ctx);
+  args->state->heap->ctx = NULL;
+  args->state->ctx = NULL;
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   Script.load(bytecode[, filename]) -> script
+ *
+ * Create a Script from bytecode previously returned by Script#bytecode.
+ *
+ * Duktape does not validate bytecode when loading it, so the bytecode must
+ * come from a trusted source and from the same version of Duktape.
+ *
+ */
+static VALUE script_s_load(int argc, VALUE *argv, VALUE klass)
+{
+  VALUE bytecode;
+  VALUE filename;
+
+  rb_scan_args(argc, argv, "11", &bytecode, &filename);
+
+  if (NIL_P(filename)) {
+    filename = sDefaultFilename;
+  }
+
+  StringValue(bytecode);
+  StringValue(filename);
+
+  bytecode = rb_str_new(RSTRING_PTR(bytecode), RSTRING_LEN(bytecode));
+  OBJ_FREEZE(bytecode);
+
+  VALUE script = rb_obj_alloc(klass);
+  rb_ivar_set(script, id_iv_bytecode, bytecode);
+  rb_ivar_set(script, id_iv_filename, rb_str_new_frozen(filename));
+
+  // Reject obviously invalid input right away
+  script_bytecode(script);
+  return script;
+}
+
+/*
+ * call-seq:
+ *   Script.compile(string[, filename]) -> script
+ *
+ * Compile JavaScript source code into bytecode which can be run in any
+ * context without being parsed again. See Context#exec_script and
+ * Context#eval_script.
+ *
+ *     script = Duktape::Script.compile(File.read("babel.js"), "babel.js")
+ *     ctx.exec_script(script)
+ *
+ */
+static VALUE script_s_compile(int argc, VALUE *argv, VALUE klass)
+{
+  struct compile_args args;
+  VALUE source;
+  VALUE filename;
+
+  rb_scan_args(argc, argv, "11", &source, &filename);
+
+  if (NIL_P(filename)) {
+    filename = sDefaultFilename;
+  }
+
+  StringValue(source);
+  StringValue(filename);
+
+  VALUE scratch = ctx_alloc(cContext);
+  Data_Get_Struct(scratch, struct state, args.state);
+  args.klass = klass;
+  args.source = source;
+  args.filename = filename;
+
+  VALUE script = rb_ensure(script_do_compile, (VALUE)&args, script_compile_ensure, (VALUE)&args);
+  RB_GC_GUARD(scratch);
+  return script;
+}
+
+static void ctx_get_one_prop(struct state *state, VALUE name, int strict)
+{
+  duk_context *ctx = state->ctx;
+
+  // Don't allow prop access on undefined/null
+  if (duk_check_type_mask(ctx, -1, DUK_TYPE_MASK_UNDEFINED | DUK_TYPE_MASK_NULL)) {
+    clean_raise(ctx, eTypeError, "invalid base value");
+  }
+
+  duk_push_lstring(ctx, RSTRING_PTR(name), RSTRING_LEN(name));
+  duk_bool_t exists = duk_get_prop(ctx, -2);
+
+  if (!exists && strict) {
+    const char *str = StringValueCStr(name);
+    clean_raise(ctx, eReferenceError, "identifier '%s' undefined", str);
+  }
+}
+
+static void ctx_get_nested_prop(struct state *state, VALUE props)
+{
+  duk_context *ctx = state->ctx;
+
+  switch (TYPE(props)) {
+    case T_STRING:
+      duk_push_global_object(ctx);
+      ctx_get_one_prop(state, props, 1);
+      return;
+
+    case T_ARRAY:
+      duk_push_global_object(ctx);
+
+      long len = RARRAY_LEN(props);
+      for (int i = 0; i < len; i++) {
+        VALUE item = rb_ary_entry(props, i);
+        Check_Type(item, T_STRING);
+
+        // Only do a strict check on the first item
+        ctx_get_one_prop(state, item, i == 0);
+      }
+      return;
+
+    default:
+      clean_raise(ctx, rb_eTypeError, "wrong argument type %s (expected String or Array)", rb_obj_classname(props));
+      return;
+  }
+}
+
+/*
+ * call-seq:
+ *   get_prop(name) -> obj
+ *   get_prop([names,...]) -> obj
+ *   get_prop(name, lazy: true) -> obj
+ *
+ * Access the property of the global object. An Array of names can be given
+ * to access the property on a nested object.
+ *
+ *     ctx.exec_string("var n = 42", "foo.js")
+ *     ctx.get_prop("n") #=> 42
+ *
+ *     ctx.get_prop(["Math", "PI"]) #=> 3.14
+ *
+ * With <code>lazy: true</code> objects (including functions) are returned
+ * as a Duktape::ObjectRef which converts properties only when they are
+ * read:
+ *
+ *     cfg = ctx.get_prop("config", lazy: true)
+ *     cfg["port"] #=> 8080
+ *
+ */
+static VALUE ctx_get_prop(int argc, VALUE *argv, VALUE self)
+{
+  struct state *state;
+  Data_Get_Struct(self, struct state, state);
+  check_fatal(state);
+
+  VALUE prop;
+  VALUE options;
+  rb_scan_args(argc, argv, "1:", &prop, &options);
+
+  ctx_get_nested_prop(state, prop);
+
+  if (!NIL_P(options) && RTEST(rb_hash_lookup(options, ID2SYM(id_lazy)))) {
+    VALUE res = ctx_stack_to_ref(self, state, -1, -2);
+    duk_set_top(state->ctx, 0);
+    return res;
+  }
+
+  return ctx_pop_result(state);
+}
+
+
+static void ctx_push_call_result(struct state *state, int argc, VALUE *argv)
+{
+  VALUE prop;
+  rb_scan_args(argc, argv, "1*", &prop, NULL);
+
+  ctx_get_nested_prop(state, prop);
+
+  // Swap receiver and function
+  duk_swap_top(state->ctx, -2);
+
+  ctx_push_args(state, argc - 1, argv + 1);
+
+  if (ctx_pcall_method(state, argc - 1) == DUK_EXEC_ERROR) {
+    raise_ctx_error(state);
+  }
+}
+
+/*
+ * call-seq:
+ *   call_prop(name, params,...) -> obj
+ *   call_prop([names,...], params,...) -> obj
+ *
+ * Call a function defined in the global scope with the given parameters. An
+ * Array of names can be given to call a function on a nested object.
+ *
+ *     ctx.call_prop("parseInt", "42")       #=> 42
+ *     ctx.call_prop(["Math", "pow"], 2, 10) #=> 1024
+ *
+ */
+static VALUE ctx_call_prop(int argc, VALUE* argv, VALUE self)
+{
+  struct state *state;
+  Data_Get_Struct(self, struct state, state);
+  check_fatal(state);
+
+  ctx_push_call_result(state, argc, argv);
+
+  return ctx_pop_result(state);
+}
+
+/*
+ * call-seq:
+ *   call_prop_json(name, params,...) -> string or nil
+ *   call_prop_json([names,...], params,...) -> string or nil
+ *
+ * Call a function like #call_prop, but return the result serialized with
+ * JSON.stringify. See #eval_json.
+ *
+ *     ctx.call_prop_json(["Object", "keys"], a: 1, b: 2) #=> "[\"a\",\"b\"]"
+ *
+ */
+static VALUE ctx_call_prop_json(int argc, VALUE* argv, VALUE self)
+{
+  struct state *state;
+  Data_Get_Struct(self, struct state, state);
+  check_fatal(state);
+
+  ctx_push_call_result(state, argc, argv);
+
+  return ctx_stack_to_json(state);
+}
+
+struct call_many_item {
+  struct state *state;
+  VALUE args;
+  duk_idx_t top;
+  int capture;
+};
+
+/*
+ * Calls the function below top (with its receiver) and converts the result.
+ */
+static VALUE call_many_item(VALUE ptr)
+{
+  struct call_many_item *item = (struct call_many_item *)ptr;
+  struct state *state = item->state;
+  duk_context *ctx = state->ctx;
+  VALUE args = item->args;
+  int nargs = (int)RARRAY_LEN(args);
+
+  duk_dup(ctx, item->top - 2);
+  duk_dup(ctx, item->top - 1);
+  ctx_push_args(state, nargs, (VALUE *)RARRAY_CONST_PTR(args));
+  RB_GC_GUARD(args);
+
+  VALUE res;
+  if (ctx_pcall_method(state, nargs) == DUK_EXEC_ERROR) {
+    if (!item->capture) {
+      raise_ctx_error(state);
+    }
+    res = ctx_error_exception(state);
+  } else if (state->marshal_cbor) {
+    res = ctx_stack_to_value_cbor(state);
+  } else {
+    res = ctx_stack_to_value(state, -1);
+  }
+
+  duk_set_top(ctx, item->top);
+  return res;
+}
+
+/*
+ * call-seq:
+ *   call_prop_many(name, [[params,...], ...]) -> array
+ *   call_prop_many([names,...], [[params,...], ...]) -> array
+ *   call_prop_many(name, calls, exception: false) -> array
+ *
+ * Call a function like #call_prop once for every list of parameters and
+ * return an Array of the results. The function is only looked up once.
+ * Items which aren't Arrays are passed as the only parameter.
+ *
+ *     ctx.call_prop_many(["Math", "pow"], [[2, 3], [2, 10]]) #=> [8, 1024]
+ *     ctx.call_prop_many("parseInt", ["1", "2", "3"])       #=> [1, 2, 3]
+ *
+ * The first error thrown by a call is raised. With <code>exception:
+ * false</code> the remaining calls are made, and the exception is returned
+ * in place of the result of a call which failed. This includes errors
+ * converting its arguments or result, such as Duktape::RangeError for values
+ * nested too deeply.
+ *
+ *     ctx.call_prop_many("decodeURIComponent", ["%41", "%"], exception: false)
+ *     #=> ["A", #<Duktape::URIError: ...>]
+ *
+ */
+static VALUE ctx_call_prop_many(int argc, VALUE *argv, VALUE self)
+{
+  struct state *state;
+  Data_Get_Struct(self, struct state, state);
+  check_fatal(state);
+
+  VALUE prop;
+  VALUE calls;
+  VALUE options;
+  rb_scan_args(argc, argv, "2:", &prop, &calls, &options);
+  Check_Type(calls, T_ARRAY);
+
+  struct call_many_item item;
+  item.state = state;
+  item.capture = !NIL_P(options) && rb_hash_lookup2(options, ID2SYM(id_exception), Qtrue) == Qfalse;
+
+  duk_context *ctx = state->ctx;
+  ctx_get_nested_prop(state, prop);
+
+  // Swap receiver and function
+  duk_swap_top(ctx, -2);
+  item.top = duk_get_top(ctx);
+
+  // Errors raised while converting clear the stack, so the function and its
+  // receiver are kept to push them again
+  int fn_ref = -1;
+  int this_ref = -1;
+  if (item.capture) {
+    fn_ref = heap_ref(state->heap, ctx, -2);
+    this_ref = heap_ref(state->heap, ctx, -1);
+  }
+
+  VALUE results = rb_ary_new_capa(RARRAY_LEN(calls));
+  for (long i = 0; i < RARRAY_LEN(calls); i++) {
+    item.args = rb_ary_entry(calls, i);
+    if (!RB_TYPE_P(item.args, T_ARRAY)) {
+      item.args = rb_ary_new_from_values(1, &item.args);
+    }
+
+    if (!item.capture) {
+      rb_ary_push(results, call_many_item((VALUE)&item));
+      continue;
+    }
+
+    int tag;
+    VALUE res = rb_protect(call_many_item, (VALUE)&item, &tag);
+    if (tag) {
+      res = rb_errinfo();
+      if (state->heap->is_fatal || !rb_obj_is_kind_of(res, rb_eStandardError)) {
+        if (!state->heap->is_fatal) {
+          heap_unref(state->heap, ctx, fn_ref);
+          heap_unref(state->heap, ctx, this_ref);
+        }
+        rb_jump_tag(tag);
+      }
+      rb_set_errinfo(Qnil);
+
+      duk_set_top(ctx, item.top - 2);
+      heap_push_ref(state->heap, ctx, fn_ref);
+      heap_push_ref(state->heap, ctx, this_ref);
+    }
+    rb_ary_push(results, res);
+  }
+
+  if (item.capture) {
+    heap_unref(state->heap, ctx, fn_ref);
+    heap_unref(state->heap, ctx, this_ref);
+  }
+  duk_set_top(ctx, 0);
+  return results;
+}
+
+/*
+ * A JavaScript value held by a Duktape::Function, Duktape::ObjectRef or
+ * Duktape::Handle. The value and the object it was read from (used as the
+ * receiver when calling it) are kept alive through references in the heap
+ * stash, so they can be pushed by pointer without looking up any property
+ * names. Handles have no receiver, and their ref is -1 once released.
+ */
+struct object_ref {
+  VALUE context;
+  struct heap *heap;
+  void *ptr;
+  void *this_ptr;
+  int ref;
+  int this_ref;
+};
+
+static void ref_mark(struct object_ref *ref)
+{
+  rb_gc_mark(ref->context);
+}
+
+static void ref_dealloc(void *ptr)
+{
+  struct object_ref *ref = (struct object_ref *)ptr;
+  if (ref->heap) {
+    if (ref->ref >= 0) {
+      heap_unref_later(ref->heap, ref->ref);
+    }
+    if (ref->this_ref >= 0) {
+      heap_unref_later(ref->heap, ref->this_ref);
+    }
+    heap_release(ref->heap);
+  }
+  free(ref);
+}
+
+/*
+ * Wraps the value at index and its receiver at this_index, which can be
+ * DUK_INVALID_INDEX for no receiver. Both are left on the stack.
+ */
+static VALUE ref_new(VALUE klass, VALUE context, struct state *state, duk_idx_t index, duk_idx_t this_index)
+{
+  duk_context *ctx = state->ctx;
+  index = duk_normalize_index(ctx, index);
+  if (this_index != DUK_INVALID_INDEX) {
+    this_index = duk_normalize_index(ctx, this_index);
+  }
+
+  struct object_ref *ref;
+  VALUE res = Data_Make_Struct(klass, struct object_ref, ref_mark, ref_dealloc, ref);
+  ref->context = context;
+  ref->ptr = duk_get_heapptr(ctx, index);
+  ref->ref = heap_ref(state->heap, ctx, index);
+  if (this_index != DUK_INVALID_INDEX) {
+    ref->this_ptr = duk_get_heapptr(ctx, this_index);
+    ref->this_ref = heap_ref(state->heap, ctx, this_index);
+  } else {
+    ref->this_ptr = NULL;
+    ref->this_ref = -1;
+  }
+  ref->heap = state->heap;
+  ref->heap->refcount++;
+  return res;
+}
+
+/*
+ * Converts the value at index, returning objects as a Duktape::ObjectRef
+ * instead of converting them.
+ */
+static VALUE ctx_stack_to_ref(VALUE context, struct state *state, duk_idx_t index, duk_idx_t this_index)
+{
+  duk_context *ctx = state->ctx;
+
+  if (duk_is_object(ctx, index) && !duk_is_buffer_data(ctx, index)) {
+    return ref_new(cObjectRef, context, state, index, this_index);
+  }
+
+  return ctx_stack_to_value(state, index);
+}
+
+static int is_ref(VALUE obj)
+{
+  return rb_obj_is_kind_of(obj, cObjectRef) ||
+    rb_obj_is_kind_of(obj, cFunction) ||
+    rb_obj_is_kind_of(obj, cHandle);
+}
+
+static void ctx_push_ref(struct state *state, VALUE obj)
+{
+  struct object_ref *ref;
+  Data_Get_Struct(obj, struct object_ref, ref);
+
+  if (ref->heap != state->heap) {
+    clean_raise(state->ctx, rb_eTypeError, "cannot pass %s to another heap", rb_obj_classname(obj));
+  }
+  if (ref->ref < 0) {
+    clean_raise(state->ctx, rb_eArgError, "%s has been released", rb_obj_classname(obj));
+  }
+
+  // Primitive values aren't heap allocated
+  if (ref->ptr) {
+    duk_push_heapptr(state->ctx, ref->ptr);
+  } else {
+    heap_push_ref(state->heap, state->ctx, ref->ref);
+  }
+}
+
+/*
+ * Pushes the referenced value and returns the state of its context.
+ */
+static struct state *ref_push(VALUE self, struct object_ref **out)
+{
+  struct object_ref *ref;
+  Data_Get_Struct(self, struct object_ref, ref);
+
+  struct state *state;
+  Data_Get_Struct(ref->context, struct state, state);
+  check_fatal(state);
+
+  duk_push_heapptr(state->ctx, ref->ptr);
+  *out = ref;
+  return state;
+}
+
+static void ctx_push_key(struct state *state, VALUE key)
+{
+  switch (TYPE(key)) {
+    case T_STRING:
+      encode_cesu8(state, key);
+      return;
+
+    case T_SYMBOL:
+#ifdef HAVE_RB_SYM2STR
+      encode_cesu8(state, rb_sym2str(key));
+#else
+      encode_cesu8(state, rb_id2str(SYM2ID(key)));
+#endif
+      return;
+
+    case T_FIXNUM:
+      duk_push_number(state->ctx, (double)FIX2LONG(key));
+      return;
+
+    default:
+      clean_raise(state->ctx, rb_eTypeError, "wrong argument type %s (expected String, Symbol or Integer)", rb_obj_classname(key));
+  }
+}
+
+/*
+ * call-seq:
+ *   function(name) -> function
+ *   function([names,...]) -> function
+ *
+ * Look up a function in the global scope once and return a Duktape::Function
+ * which can be called repeatedly. An Array of names can be given to look up a
+ * function on a nested object, which is then used as the receiver.
+ *
+ *     pow = ctx.function(["Math", "pow"])
+ *     pow.call(2, 10) #=> 1024
+ *
+ * The function is resolved when this method is called. Reassigning the
+ * property afterwards does not affect the returned object.
+ */
+static VALUE ctx_function(VALUE self, VALUE prop)
+{
+  struct state *state;
+  Data_Get_Struct(self, struct state, state);
+  check_fatal(state);
+
+  duk_context *ctx = state->ctx;
+  ctx_get_nested_prop(state, prop);
+
+  if (!duk_is_function(ctx, -1)) {
+    clean_raise(ctx, eTypeError, "not a function");
+  }
+
+  VALUE res = ref_new(cFunction, self, state, -1, -2);
+  duk_set_top(ctx, 0);
+  return res;
+}
+
+/*
+ * call-seq:
+ *   call(params,...) -> obj
+ *
+ * Call the function with the given parameters.
+ *
+ *     parse_int = ctx.function("parseInt")
+ *     parse_int.call("42") #=> 42
+ *
+ * An ObjectRef is called with the object it was read from as the receiver.
+ */
+static VALUE ref_call(int argc, VALUE *argv, VALUE self)
+{
+  struct object_ref *ref;
+  struct state *state = ref_push(self, &ref);
+  duk_context *ctx = state->ctx;
+
+  if (!duk_is_function(ctx, -1)) {
+    clean_raise(ctx, eTypeError, "not a function");
+  }
+
+  duk_push_heapptr(ctx, ref->this_ptr);
+  ctx_push_args(state, argc, argv);
+
+  if (ctx_pcall_method(state, argc) == DUK_EXEC_ERROR) {
+    raise_ctx_error(state);
+  }
+
+  return ctx_pop_result(state);
+}
+
+/*
+ * call-seq:
+ *   context -> context
+ *
+ * Returns the Context the value belongs to.
+ */
+static VALUE ref_context(VALUE self)
+{
+  struct object_ref *ref;
+  Data_Get_Struct(self, struct object_ref, ref);
+  return ref->context;
+}
+
+/*
+ * call-seq:
+ *   ref[key] -> obj
+ *
+ * Read a property of the object. Objects are returned as another ObjectRef,
+ * other values are converted as usual. Missing properties return nil.
+ *
+ *     cfg = ctx.get_prop("config", lazy: true)
+ *     cfg["servers"][0]["host"] #=> "example.com"
+ *
+ */
+static VALUE ref_aref(VALUE self, VALUE key)
+{
+  struct object_ref *ref;
+  struct state *state = ref_push(self, &ref);
+  duk_context *ctx = state->ctx;
+
+  ctx_push_key(state, key);
+  duk_get_prop(ctx, -2);
+
+  VALUE res = ctx_stack_to_ref(ref->context, state, -1, -2);
+  duk_set_top(ctx, 0);
+  return res;
+}
+
+/*
+ * call-seq:
+ *   dig(key, ...) -> obj
+ *
+ * Read a nested property. Returns nil as soon as a property is null or
+ * undefined, like optional chaining (<code>a?.b?.c</code>) in JavaScript.
+ *
+ *     cfg.dig("servers", 0, "host") #=> "example.com"
+ *
+ */
+static VALUE ref_dig(int argc, VALUE *argv, VALUE self)
+{
+  rb_check_arity(argc, 1, UNLIMITED_ARGUMENTS);
+
+  struct object_ref *ref;
+  struct state *state = ref_push(self, &ref);
+  duk_context *ctx = state->ctx;
+
+  for (int i = 0; i < argc; i++) {
+    if (duk_is_null_or_undefined(ctx, -1)) {
+      duk_set_top(ctx, 0);
+      return Qnil;
+    }
+    ctx_push_key(state, argv[i]);
+    duk_get_prop(ctx, -2);
+  }
+
+  VALUE res = ctx_stack_to_ref(ref->context, state, -1, -2);
+  duk_set_top(ctx, 0);
+  return res;
+}
+
+/*
+ * call-seq:
+ *   keys -> array
+ *
+ * Returns the own enumerable property names of the object.
+ */
+static VALUE ref_keys(VALUE self)
+{
+  struct object_ref *ref;
+  struct state *state = ref_push(self, &ref);
+  duk_context *ctx = state->ctx;
+
+  VALUE keys = rb_ary_new();
+  duk_enum(ctx, -1, DUK_ENUM_OWN_PROPERTIES_ONLY);
+  while (duk_next(ctx, -1, 0)) {
+    rb_ary_push(keys, ctx_stack_to_key(state, -1));
+    duk_pop(ctx);
+  }
+
+  duk_set_top(ctx, 0);
+  return keys;
+}
+
+/*
+ * call-seq:
+ *   each { |value| ... } -> ref
+ *   each { |key, value| ... } -> ref
+ *
+ * Yield each element of an array, or each own enumerable property of an
+ * object. Values are converted like #[].
+ *
+ * The stack is cleared before yielding, so the block can use the context.
+ */
+static VALUE ref_each(VALUE self)
+{
+  RETURN_ENUMERATOR(self, 0, 0);
+
+  struct object_ref *ref;
+  struct state *state = ref_push(self, &ref);
+  duk_context *ctx = state->ctx;
+
+  if (!duk_is_array(ctx, -1)) {
+    duk_set_top(ctx, 0);
+    VALUE keys = ref_keys(self);
+    for (long i = 0; i < RARRAY_LEN(keys); i++) {
+      VALUE key = RARRAY_AREF(keys, i);
+      rb_yield_values(2, key, ref_aref(self, key));
+    }
+    return self;
+  }
+
+  duk_size_t length = duk_get_length(ctx, -1);
+  duk_set_top(ctx, 0);
+
+  for (duk_uarridx_t i = 0; i < length; i++) {
+    check_fatal(state);
+    duk_push_heapptr(ctx, ref->ptr);
+    duk_get_prop_index(ctx, -1, i);
+    VALUE val = ctx_stack_to_ref(ref->context, state, -1, -2);
+    duk_set_top(ctx, 0);
+    rb_yield(val);
+  }
+
+  return self;
+}
+
+/*
+ * call-seq:
+ *   to_h -> hash
+ *
+ * Convert the whole object to a Hash, the same way as Context#get_prop
+ * without <code>lazy: true</code>.
+ */
+static VALUE ref_to_h(VALUE self)
+{
+  struct object_ref *ref;
+  struct state *state = ref_push(self, &ref);
+  duk_context *ctx = state->ctx;
+
+  if (duk_is_array(ctx, -1) || duk_is_function(ctx, -1)) {
+    clean_raise(ctx, rb_eTypeError, "can't convert %s to Hash", duk_is_array(ctx, -1) ? "array" : "function");
+  }
+
+  return ctx_pop_result(state);
+}
+
+/*
+ * call-seq:
+ *   array? -> true or false
+ *
+ * Returns true if the object is a JavaScript array.
+ */
+static VALUE ref_is_array(VALUE self)
+{
+  struct object_ref *ref;
+  struct state *state = ref_push(self, &ref);
+  VALUE res = duk_is_array(state->ctx, -1) ? Qtrue : Qfalse;
+  duk_set_top(state->ctx, 0);
+  return res;
+}
+
+/*
+ * call-seq:
+ *   function? -> true or false
+ *
+ * Returns true if the object is a JavaScript function.
+ */
+static VALUE ref_is_function(VALUE self)
+{
+  struct object_ref *ref;
+  struct state *state = ref_push(self, &ref);
+  VALUE res = duk_is_function(state->ctx, -1) ? Qtrue : Qfalse;
+  duk_set_top(state->ctx, 0);
+  return res;
+}
+
+/*
+ * call-seq:
+ *   pin(obj) -> handle
+ *
+ * Convert obj to JavaScript once and return a Duktape::Handle which can be
+ * passed as an argument any number of times without converting it again.
+ *
+ *     options = ctx.pin(presets: ["es2015"], sourceMaps: true)
+ *     sources.map { |src| ctx.call_prop(["babel", "transform"], src, options) }
+ *
+ * Every call receives the same JavaScript value, so changes made to it by
+ * JavaScript are seen by later calls. The value is released when the handle
+ * is garbage collected, or right away with Handle#release.
+ */
+static VALUE ctx_pin(VALUE self, VALUE obj)
+{
+  struct state *state;
+  Data_Get_Struct(self, struct state, state);
+  check_fatal(state);
+
+  ctx_push_ruby_object(state, obj);
+  VALUE res = ref_new(cHandle, self, state, -1, DUK_INVALID_INDEX);
+  duk_set_top(state->ctx, 0);
+  return res;
+}
+
+/*
+ * call-seq:
+ *   release -> nil
+ *
+ * Release the JavaScript value right away instead of when the handle is
+ * garbage collected. Passing a released handle raises ArgumentError.
+ */
+static VALUE handle_release(VALUE self)
+{
+  struct object_ref *ref;
+  Data_Get_Struct(self, struct object_ref, ref);
+
+  if (ref->ref >= 0) {
+    struct state *state;
+    Data_Get_Struct(ref->context, struct state, state);
+    if (ref->heap->is_fatal) {
+      heap_unref_later(ref->heap, ref->ref);
+    } else {
+      heap_unref(ref->heap, state->ctx, ref->ref);
+    }
+    ref->ref = -1;
+    ref->ptr = NULL;
+  }
+
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   released? -> true or false
+ *
+ * Returns true if #release has been called.
+ */
+static VALUE handle_is_released(VALUE self)
+{
+  struct object_ref *ref;
+  Data_Get_Struct(self, struct object_ref, ref);
+  return ref->ref < 0 ? Qtrue : Qfalse;
+}
+
+/*
+ * A call from JavaScript to a callback in the heap's callback table.
+ */
+struct callback_call {
+  duk_context *ctx;
+  struct heap *heap;
+  long idx;
+  unsigned long generation;
+  int nargs;
+  int is_released;
+  int is_error;
+  struct state *state;
+  duk_context *state_ctx;
+};
+
+/*
+ * The function may be called from another realm than the one defining it, so
+ * the state converts values on the stack of the calling context while the
+ * arguments and the result are converted. callback_call_with_gvl restores it.
+ */
+static VALUE callback_call_body(VALUE ptr)
+{
+  struct callback_call *call = (struct callback_call *)ptr;
+  struct callback *callback = &call->heap->callbacks[call->idx];
+  struct state *state = callback->state;
+  int nargs = call->nargs;
+
+  call->state = state;
+  call->state_ctx = state->ctx;
+  state->ctx = call->ctx;
+
+  VALUE result;
+  if (callback->mid) {
+    // methods are called with the converted arguments directly
+    VALUE recv = callback->recv;
+    ID mid = callback->mid;
+    VALUE tmp;
+    VALUE *argv = ALLOCV_N(VALUE, tmp, nargs);
+    for (int i = 0; i < nargs; i++)
+      argv[i] = ctx_stack_to_value(state, i);
+
+    state->ctx = call->state_ctx;
+    result = rb_funcallv_public(recv, mid, nargs, argv);
+    ALLOCV_END(tmp);
+  } else {
+    // before pushing each argument to the array, each one needs to be converted into a ruby value
+    VALUE block = callback->block;
+    VALUE args = rb_ary_new_capa(nargs);
+    for (int i = 0; i < nargs; i++)
+      rb_ary_push(args, ctx_stack_to_value(state, i));
+
+    state->ctx = call->state_ctx;
+    result = rb_proc_call(block, args); // yield
+  }
+
+  // The context may have been garbage collected by the block, and its entry
+  // reused
+  struct callback *after = &call->heap->callbacks[call->idx];
+  if (after->state != state || after->generation != call->generation) {
+    call->state = NULL;
+    call->is_released = 1;
+    return Qnil;
+  }
+
+  state->ctx = call->ctx;
+  ctx_push_ruby_object(state, result);
+  return Qnil;
+}
+
+static VALUE callback_error_message(VALUE exc)
+{
+  return rb_sprintf("%"PRIsVALUE": %"PRIsVALUE, rb_obj_class(exc), exc);
+}
+
+/*
+ * Runs the callback with the GVL. A Ruby exception is kept in the heap and
+ * replaced by a JavaScript Error on the stack, which the caller throws.
+ */
+static void *callback_call_with_gvl(void *ptr)
+{
+  struct callback_call *call = (struct callback_call *)ptr;
+  struct heap *heap = call->heap;
+
+  if (heap->callbacks[call->idx].state == NULL) {
+    call->is_released = 1;
+    return NULL;
+  }
+
+  int tag;
+  call->state = NULL;
+  rb_protect(callback_call_body, (VALUE)call, &tag);
+  if (call->state != NULL && heap->callbacks[call->idx].state == call->state) {
+    call->state->ctx = call->state_ctx;
+  }
+  if (!tag) {
+    return NULL;
+  }
+
+  VALUE exc = rb_errinfo();
+  rb_set_errinfo(Qnil);
+  if (!RB_TYPE_P(exc, T_OBJECT) || !rb_obj_is_kind_of(exc, rb_eException)) {
+    // throw, break and the like can't continue once JavaScript has unwound
+    exc = rb_exc_new_cstr(rb_eLocalJumpError, "unexpected jump out of a function called by JavaScript");
+  }
+
+  call->is_error = 1;
+  heap->callback_error = exc;
+
+  if (!heap->is_fatal) {
+    VALUE message = rb_protect(callback_error_message, exc, &tag);
+    if (tag) {
+      rb_set_errinfo(Qnil);
+      message = rb_str_new_cstr("Ruby exception");
+    }
+    duk_push_error_object(call->ctx, DUK_ERR_ERROR, "%.*s", (int)RSTRING_LEN(message), RSTRING_PTR(message));
+    heap->callback_error_ptr = duk_get_heapptr(call->ctx, -1);
+    RB_GC_GUARD(message);
+  }
+
+  return NULL;
+}
+
+// Functions beyond the range of magic values keep their index in this property
+#define CALLBACK_INDEX_PROP DUK_HIDDEN_SYMBOL("callback")
+// Functions using a reused entry keep its generation in this property
+#define CALLBACK_GENERATION_PROP DUK_HIDDEN_SYMBOL("generation")
+#define CALLBACK_MAX_MAGIC 0x7fff
+
+/*
+ * Calls a function defined with define_function or define_object. When
+ * JavaScript is running without the GVL, it's taken for the call.
+ */
+static duk_ret_t ctx_call_pushed_function(duk_context *ctx) {
+  struct callback_call call;
+  long idx = duk_get_current_magic(ctx);
+
+  if (idx < 0) {
+    duk_push_current_function(ctx);
+    duk_get_prop_string(ctx, -1, CALLBACK_INDEX_PROP);
+    idx = (long)duk_get_number(ctx, -1);
+    duk_pop_2(ctx);
+  }
+
+  duk_memory_functions funcs;
+  duk_get_memory_functions(ctx, &funcs);
+  struct heap *heap = (struct heap *)funcs.udata;
+
+  // Functions of a garbage collected context may outlive it
+  unsigned long generation = heap->callbacks[idx].generation;
+  if (generation > 0) {
+    duk_push_current_function(ctx);
+    duk_get_prop_string(ctx, -1, CALLBACK_GENERATION_PROP);
+    int is_current = duk_get_number_default(ctx, -1, 0) == (double)generation;
+    duk_pop_2(ctx);
+    if (!is_current) {
+      return duk_error(ctx, DUK_ERR_ERROR, "the context defining this function has been garbage collected");
+    }
+  }
+
+  call.ctx = ctx;
+  call.heap = heap;
+  call.idx = idx;
+  call.generation = generation;
+  call.nargs = duk_get_top(ctx); // number of arguments of the block (arity)
+  call.is_released = 0;
+  call.is_error = 0;
+
+  if (heap->without_gvl) {
+    heap->without_gvl = 0;
+    rb_thread_call_with_gvl(callback_call_with_gvl, &call);
+    heap->without_gvl = 1;
+  } else {
+    callback_call_with_gvl(&call);
+  }
+
+  if (call.is_released) {
+    return duk_error(ctx, DUK_ERR_ERROR, "the context defining this function has been garbage collected");
+  }
+
+  if (call.is_error) {
+    if (heap->is_fatal) {
+      // The heap can't be used anymore, so leave it without unwinding
+      if (heap->without_gvl) {
+        longjmp(*heap->fatal_jmp, 1);
+      }
+      VALUE exc = heap->callback_error;
+      heap->callback_error = Qnil;
+      rb_exc_raise(exc);
+    }
+    return duk_throw(ctx);
+  }
+
+  return 1;
+}
+
+/*
+ * Pushes a function calling the callback with the given index.
+ */
+static void ctx_push_callback(struct state *state, long idx)
+{
+  duk_context *ctx = state->ctx;
+  duk_push_c_function(ctx, ctx_call_pushed_function, DUK_VARARGS);
+
+  if (idx < CALLBACK_MAX_MAGIC) {
+    duk_set_magic(ctx, -1, (duk_int_t)idx);
+  } else {
+    duk_set_magic(ctx, -1, -1);
+    duk_push_number(ctx, (duk_double_t)idx);
+    duk_put_prop_string(ctx, -2, CALLBACK_INDEX_PROP);
+  }
+
+  unsigned long generation = state->heap->callbacks[idx].generation;
+  if (generation > 0) {
+    duk_push_number(ctx, (duk_double_t)generation);
+    duk_put_prop_string(ctx, -2, CALLBACK_GENERATION_PROP);
+  }
+}
+
+/*
+ * call-seq:
+ *   ctx_define_function(name, &block) -> nil
+ *
+ * Define a function defined in the global scope and identified by a name.
+ *
+ *     ctx.ctx_define_function("hello_world") { |ctx| 'Hello world' } #=> nil
+ *
+ */
+static VALUE ctx_define_function(VALUE self, VALUE prop)
+{
+  VALUE block;
+  struct state *state;
+  duk_context *ctx;
+
+  // a block is required
+  if (!rb_block_given_p())
+    rb_raise(rb_eArgError, "Expected block");
+
+  // get the context
+  Data_Get_Struct(self, struct state, state);
+  check_fatal(state);
+
+  ctx = state->ctx;
+  const char *name = StringValueCStr(prop);
+
+  block = rb_block_proc();
+
+  // the function finds the block and the state by its index in the table
+  long idx = heap_add_callback(state->heap, block, Qnil, 0, state);
+
+  // the c function is available in the global scope
+  duk_push_global_object(ctx);
+  ctx_push_callback(state, idx);
+  duk_put_prop_string(ctx, -2, name);
+  duk_pop(ctx);
+
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   define_object(name, obj, methods: names) -> nil
+ *
+ * Define an object in the global scope whose functions call the methods of
+ * obj. Arguments and results are converted like for #define_function.
+ *
+ *     ctx.define_object("db", repository, methods: [:find, :save])
+ *     ctx.eval_string("db.find(1)") #=> {"id" => 1.0}
+ *
+ * +methods+ defaults to the public methods of obj which aren't defined by
+ * Object. Only public methods can be given, and they're called like with
+ * +public_send+. The methods are looked up once, so calling them from JavaScript
+ * doesn't create a block for each of them.
+ */
+static VALUE ctx_define_object(int argc, VALUE *argv, VALUE self)
+{
+  struct state *state;
+  Data_Get_Struct(self, struct state, state);
+  check_fatal(state);
+
+  VALUE prop, obj, options;
+  rb_scan_args(argc, argv, "2:", &prop, &obj, &options);
+
+  const char *name = StringValueCStr(prop);
+
+  VALUE methods = NIL_P(options) ? Qnil : rb_hash_lookup(options, ID2SYM(id_methods));
+  if (NIL_P(methods)) {
+    methods = rb_funcall(obj, rb_intern("public_methods"), 0);
+    methods = rb_funcall(methods, '-', 1, rb_funcall(rb_cObject, rb_intern("public_instance_methods"), 0));
+  }
+  methods = rb_Array(methods);
+
+  long len = RARRAY_LEN(methods);
+  VALUE names = rb_ary_new_capa(len);
+  VALUE tmp;
+  ID *mids = ALLOCV_N(ID, tmp, len);
+  for (long i = 0; i < len; i++) {
+    VALUE method = RARRAY_AREF(methods, i);
+    mids[i] = rb_to_id(method);
+    if (!rb_obj_respond_to(obj, mids[i], FALSE)) {
+      ALLOCV_END(tmp);
+      rb_raise(rb_eArgError, "%"PRIsVALUE" isn't a public method of %"PRIsVALUE, rb_id2str(mids[i]), rb_inspect(obj));
+    }
+    rb_ary_push(names, rb_id2str(mids[i]));
+  }
+
+
+  duk_context *ctx = state->ctx;
+  duk_push_global_object(ctx);
+  duk_push_object(ctx);
+
+  for (long i = 0; i < len; i++) {
+    long idx = heap_add_callback(state->heap, Qnil, obj, mids[i], state);
+    ctx_push_callback(state, idx);
+    encode_cesu8(state, RARRAY_AREF(names, i));
+    duk_swap_top(ctx, -2);
+    duk_put_prop(ctx, -3);
+  }
+
+  duk_put_prop_string(ctx, -2, name);
+  duk_pop(ctx);
+
+  ALLOCV_END(tmp);
+  RB_GC_GUARD(names);
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   new_realm -> context
+ *
+ * Returns a new context with its own global object and built-ins, sharing
+ * the heap of this context. A realm is cheaper to create than a new Context
+ * and shares the string table and memory allocator with its parent. The heap
+ * is destroyed once the last of its contexts is garbage collected.
+ *
+ *     realm = ctx.new_realm
+ *     realm.exec_string("var a = 1")
+ *     ctx.eval_string("typeof a") #=> "undefined"
+ *
+ */
+static VALUE ctx_new_realm(VALUE self)
+{
+  struct state *parent;
+  Data_Get_Struct(self, struct state, parent);
+  check_fatal(parent);
+
+  struct state *state = malloc(sizeof(struct state));
+  state->heap = parent->heap;
+  state->ctx = NULL;
+  state->realm_ref = -1;
+  state->complex_object = parent->complex_object;
+  state->callbacks_head = -1;
+  state->bytecode_cache = parent->bytecode_cache;
+  state->marshal_cbor = parent->marshal_cbor;
+  state->symbolize_keys = parent->symbolize_keys;
+  state->binary = parent->binary;
+  state->max_depth = parent->max_depth;
+  state->eval_cache_capa = parent->eval_cache_capa;
+  state->eval_cache_max_source = parent->eval_cache_max_source;
+  state->key_cache = st_init_numtable();
+  state->key_cache_ref = -1;
+  state->seen_js = st_init_numtable();
+  state->seen_idx = -1;
+  state->seen_ruby = st_init_numtable();
+  state->frames = NULL;
+  state->frames_len = 0;
+  state->frames_capa = 0;
+  state->push_frames = NULL;
+  state->push_frames_len = 0;
+  state->push_frames_capa = 0;
+  state->pending = NULL;
+  state->pending_len = 0;
+  state->pending_capa = 0;
+  state->eval_cache = Qnil;
+  state->eval_entries = NULL;
+  state->eval_cache_len = 0;
+  state->eval_cache_clock = 0;
+  state->eval_cache_hits = 0;
+  state->eval_cache_misses = 0;
+  state->heap->refcount++;
+
+  VALUE realm = Data_Wrap_Struct(rb_obj_class(self), ctx_mark, ctx_dealloc, state);
+
+  duk_context *ctx = parent->ctx;
+  duk_push_thread_new_globalenv(ctx);
+  state->ctx = duk_get_context(ctx, -1);
+  state->realm_ref = heap_ref(state->heap, ctx, -1);
+  duk_set_top(ctx, 0);
+
+  ctx_undefine_require(state->ctx);
+
+  return realm;
+}
+
+/*
+ * :nodoc:
+ *
+ * Checks that we are in a fine state
+ */
+static VALUE ctx_is_valid(VALUE self)
+{
+  struct state *state;
+  Data_Get_Struct(self, struct state, state);
+
+  if (duk_is_valid_index(state->ctx, -1)) {
+    return Qfalse;
+  } else {
+    return Qtrue;
+  }
+}
+
+/*
+ * :nodoc:
+ *
+ * Invokes duk_fatal(). Only used for testing.
+ */
+static VALUE ctx_invoke_fatal(VALUE self)
+{
+  struct state *state;
+  Data_Get_Struct(self, struct state, state);
+
+  duk_fatal(state->ctx, "induced fatal error");
+
+  return Qnil;
+}
+
+/*
+ * :nodoc:
+ *
+ * Returns the size of the heap's callback table. Only used for testing.
+ */
+static VALUE ctx_callbacks_len(VALUE self)
+{
+  struct state *state;
+  Data_Get_Struct(self, struct state, state);
+
+  return LONG2NUM(state->heap->callbacks_len);
+}
+
+static void error_handler(void *udata, const char *msg)
+{
+  struct heap *heap = (struct heap *)udata;
+
+  if (msg == NULL) {
+    msg = "fatal error";
+  }
+  heap->is_fatal = 1;
+  snprintf(heap->fatal_msg, sizeof(heap->fatal_msg), "%s", msg);
+
+  if (heap->without_gvl) {
+    longjmp(*heap->fatal_jmp, 1);
+  }
+
+  rb_raise(eInternalError, "%s", msg);
+}
+
+static void check_fatal(struct state *state)
+{
+  if (state->heap->is_fatal) {
+    rb_raise(eInternalError, "fatal error");
+  }
+}
+
+/*
+ * call-seq:
+ *   RawJSON.new(json) -> raw_json
  *
- *     ctx.eval_string("40 + 2") #=> 42
+ * Wraps a String containing JSON. When passed to JavaScript it's decoded with
+ * JSON.parse instead of being converted like a Ruby object, which is useful
+ * for data that is already serialized.
+ *
+ *     ctx.call_prop("process", Duktape::RawJSON.new('{"a": [1, 2]}'))
  *
  */
-static VALUE ctx_eval_string(int argc, VALUE *argv, VALUE self)
+static VALUE raw_json_initialize(VALUE self, VALUE json)
 {
-  struct state *state;
-  Data_Get_Struct(self, struct state, state);
-  check_fatal(state);
+  StringValue(json);
+  rb_ivar_set(self, id_iv_json, rb_str_new_frozen(json));
+  return Qnil;
+}
 
-  VALUE source;
-  VALUE filename;
+VALUE complex_object_instance(VALUE self)
+{
+  return oComplexObject;
+}
 
-  rb_scan_args(argc, argv, "11", &source, &filename);
+/*
+ * call-seq:
+ *   Context.new
+ *   Context.new(complex_object: obj)
+ *   Context.new(bytecode_cache: cache)
+ *   Context.new(marshal: :cbor)
+ *   Context.new(symbolize_keys: true)
+ *   Context.new(binary: true)
+ *   Context.new(max_depth: 1000)
+ *   Context.new(eval_cache: 64)
+ *   Context.new(eval_cache_max_source: 4096)
+ *
+ * Returns a new JavaScript evaluation context.
+ *
+ * When a BytecodeCache is given, #exec_string and #exec_file look up the
+ * compiled bytecode in the cache instead of compiling the source every time.
+ *
+ * With <code>marshal: :cbor</code>, function arguments and results are
+ * converted through a single CBOR buffer instead of value by value, which is
+ * faster for large structures. In this mode JavaScript functions become empty
+ * Hashes instead of the complex object, and buffers become binary Strings.
+ * Blocks given to #define_function still receive converted arguments.
+ *
+ * Keys of objects are returned as frozen Strings, which are shared between
+ * all Hashes returned by the context. With <code>symbolize_keys: true</code>
+ * they're returned as Symbols instead.
+ *
+ * Strings with Encoding::BINARY are passed to JavaScript as text like other
+ * Strings. With <code>binary: true</code> they're passed as Uint8Arrays
+ * holding a copy of their bytes instead. JavaScript buffers and typed arrays
+ * are always returned as binary Strings.
+ *
+ * Arrays and objects nested deeper than +max_depth+ (1000 by default) raise
+ * Duktape::RangeError when converting them in either direction. With
+ * <code>marshal: :cbor</code> it can't be more than 1000.
+ *
+ * #eval_string and #eval_json keep the functions compiled for the last
+ * +eval_cache+ (64 by default) pairs of source and filename, so evaluating the
+ * same source again only calls the function. Sources longer than
+ * +eval_cache_max_source+ bytes (4096 by default) are compiled every time.
+ * Pass <code>eval_cache: 0</code> or +false+ to compile every time. See
+ * #eval_cache_stats.
+ *
+ */
+static VALUE ctx_initialize(int argc, VALUE *argv, VALUE self)
+{
+  struct state *state;
+  Data_Get_Struct(self, struct state, state);
 
-  if (NIL_P(filename)) {
-    filename = sDefaultFilename;
-  }
+  VALUE options;
+  rb_scan_args(argc, argv, ":", &options);
+  if (!NIL_P(options)) {
+    state->complex_object = rb_hash_lookup2(options, ID2SYM(id_complex_object), state->complex_object);
+    state->bytecode_cache = rb_hash_lookup2(options, ID2SYM(id_bytecode_cache), state->bytecode_cache);
+
+    state->symbolize_keys = RTEST(rb_hash_lookup(options, ID2SYM(id_symbolize_keys)));
+    state->binary = RTEST(rb_hash_lookup(options, ID2SYM(id_binary)));
+
+    VALUE eval_cache = rb_hash_lookup2(options, ID2SYM(id_eval_cache), Qundef);
+    if (eval_cache == Qfalse) {
+      state->eval_cache_capa = 0;
+    } else if (eval_cache != Qundef && !NIL_P(eval_cache)) {
+      state->eval_cache_capa = NUM2INT(eval_cache);
+      if (state->eval_cache_capa < 0) {
+        rb_raise(rb_eArgError, "eval_cache must not be negative");
+      }
+    }
 
-  StringValue(source);
-  StringValue(filename);
+    VALUE max_source = rb_hash_lookup(options, ID2SYM(id_eval_cache_max_source));
+    if (!NIL_P(max_source)) {
+      state->eval_cache_max_source = NUM2LONG(max_source);
+      if (state->eval_cache_max_source < 0) {
+        rb_raise(rb_eArgError, "eval_cache_max_source must not be negative");
+      }
+    }
 
-  ctx_push_ruby_object(state, source);
-  ctx_push_ruby_object(state, filename);
+    VALUE max_depth = rb_hash_lookup(options, ID2SYM(id_max_depth));
+    if (!NIL_P(max_depth)) {
+      state->max_depth = NUM2INT(max_depth);
+      if (state->max_depth < 1) {
+        rb_raise(rb_eArgError, "max_depth must be positive");
+      }
+    }
 
-  if (duk_pcompile(state->ctx, DUK_COMPILE_EVAL) == DUK_EXEC_ERROR) {
-    raise_ctx_error(state);
-  }
+    VALUE marshal = rb_hash_lookup(options, ID2SYM(id_marshal));
+    if (marshal == ID2SYM(id_cbor)) {
+      state->marshal_cbor = 1;
+    } else if (!NIL_P(marshal)) {
+      rb_raise(rb_eArgError, "unknown marshal mode %"PRIsVALUE, rb_inspect(marshal));
+    }
 
-  if (duk_pcall(state->ctx, 0) == DUK_EXEC_ERROR) {
-    raise_ctx_error(state);
+    if (state->marshal_cbor && state->max_depth > CBOR_MAX_DEPTH) {
+      rb_raise(rb_eArgError, "max_depth can't be more than %d with marshal: :cbor", CBOR_MAX_DEPTH);
+    }
   }
 
-  VALUE res = ctx_stack_to_value(state, -1);
-  duk_set_top(state->ctx, 0);
-  return res;
+  return Qnil;
 }
 
 /*
  * call-seq:
- *   exec_string(string[, filename]) -> nil
+ *   complex_object -> obj
  *
- * Evaluate JavaScript expression within context returning the value as a Ruby
- * object.
+ * Returns the default complex object, the value that would be returned if a
+ * JavaScript object had no representation in Ruby, such as a JavaScript
+ * Function. See also Context::new.
  *
- *     ctx.exec_string("var foo = 42")
- *     ctx.eval_string("foo") #=> 42
+ *     ctx.complex_object #=> #<Duktape::ComplexObject>
  *
  */
-static VALUE ctx_exec_string(int argc, VALUE *argv, VALUE self)
+static VALUE ctx_complex_object(VALUE self)
 {
   struct state *state;
   Data_Get_Struct(self, struct state, state);
-  check_fatal(state);
 
-  VALUE source;
-  VALUE filename;
+  return state->complex_object;
+}
 
-  rb_scan_args(argc, argv, "11", &source, &filename);
+#ifdef HAVE_PTHREAD_H
+/*
+ * An Executor runs call_prop jobs on native threads. Every worker owns the
+ * heap of one of the contexts it was started with, and arguments and results
+ * cross between threads as CBOR buffers, so Ruby only encodes the arguments
+ * when submitting a job and decodes the result when it's read from the
+ * Future. Workers never touch Ruby objects or the GVL.
+ */
+enum job_status {
+  JOB_QUEUED,
+  JOB_DONE,
+  JOB_ERROR,
+  JOB_FATAL,
+  JOB_NOMEM
+};
 
-  if (NIL_P(filename)) {
-    filename = sDefaultFilename;
+/*
+ * A job is shared between the queue (or the worker running it) and its
+ * Future, and freed once both released it. Its output is the CBOR encoded
+ * result, or the message of the error.
+ */
+struct job {
+  struct job *next;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int refcount;
+  enum job_status status;
+  char *input;
+  size_t input_len;
+  char *output;
+  size_t output_len;
+  char error_name[32];
+};
+
+struct worker {
+  struct executor *executor;
+  struct heap *heap;
+  pthread_t thread;
+};
+
+/*
+ * The executor is shared between its Ruby object and the workers, and freed
+ * by whichever of them releases it last, so that it can be garbage collected
+ * without waiting for running jobs.
+ */
+struct executor {
+  pthread_mutex_t lock;
+  int refcount;
+  pthread_cond_t work;
+  pthread_cond_t stopped;
+  struct job *head;
+  struct job *tail;
+  long queued;
+  long running;
+  unsigned long completed;
+  int shutdown;
+  int live;
+  int exited;
+  int joined;
+  struct worker *workers;
+  int workers_len;
+  VALUE contexts;
+  VALUE scratch;
+};
+
+struct future {
+  struct job *job;
+  VALUE scratch;
+  VALUE value;
+  int resolved;
+};
+
+static void job_release(struct job *job)
+{
+  pthread_mutex_lock(&job->lock);
+  int refcount = --job->refcount;
+  pthread_mutex_unlock(&job->lock);
+
+  if (refcount > 0) {
+    return;
   }
 
-  StringValue(source);
-  StringValue(filename);
+  pthread_mutex_destroy(&job->lock);
+  pthread_cond_destroy(&job->cond);
+  free(job->input);
+  free(job->output);
+  free(job);
+}
 
-  ctx_push_ruby_object(state, source);
-  ctx_push_ruby_object(state, filename);
+/*
+ * Stores the output of a job, wakes the threads waiting for it and releases
+ * the reference of the worker.
+ */
+static void job_finish(struct job *job, enum job_status status, const char *ptr, size_t len)
+{
+  char *output = malloc(len > 0 ? len : 1);
+  if (output == NULL) {
+    status = JOB_NOMEM;
+  } else {
+    memcpy(output, ptr, len);
+  }
 
-  if (duk_pcompile(state->ctx, 0) == DUK_EXEC_ERROR) {
-    raise_ctx_error(state);
+  pthread_mutex_lock(&job->lock);
+  job->status = status;
+  job->output = output;
+  job->output_len = len;
+  free(job->input);
+  job->input = NULL;
+  pthread_cond_broadcast(&job->cond);
+  pthread_mutex_unlock(&job->lock);
+
+  job_release(job);
+}
+
+/*
+ * Decodes [path, args...] and calls the function like ctx_push_call_result,
+ * returning the CBOR encoded result.
+ */
+static duk_ret_t worker_call(duk_context *ctx, void *udata)
+{
+  duk_cbor_decode(ctx, 0, 0);
+  duk_uarridx_t nargs = (duk_uarridx_t)duk_get_length(ctx, 0) - 1;
+  duk_get_prop_index(ctx, 0, 0);
+  duk_uarridx_t len = (duk_uarridx_t)duk_get_length(ctx, 1);
+
+  duk_push_undefined(ctx);
+  duk_push_global_object(ctx);
+  for (duk_uarridx_t i = 0; i < len; i++) {
+    if (duk_check_type_mask(ctx, -1, DUK_TYPE_MASK_UNDEFINED | DUK_TYPE_MASK_NULL)) {
+      return duk_error(ctx, DUK_ERR_TYPE_ERROR, "invalid base value");
+    }
+
+    duk_get_prop_index(ctx, 1, i);
+    duk_bool_t exists = duk_get_prop(ctx, -2);
+
+    // Only do a strict check on the first item
+    if (!exists && i == 0) {
+      duk_get_prop_index(ctx, 1, i);
+      return duk_error(ctx, DUK_ERR_REFERENCE_ERROR, "identifier '%s' undefined", duk_get_string(ctx, -1));
+    }
+    duk_remove(ctx, -3);
   }
 
-  if (duk_pcall(state->ctx, 0) == DUK_EXEC_ERROR) {
-    raise_ctx_error(state);
+  // Swap receiver and function
+  duk_swap_top(ctx, -2);
+
+  for (duk_uarridx_t i = 1; i <= nargs; i++) {
+    duk_get_prop_index(ctx, 0, i);
   }
+  duk_call_method(ctx, nargs);
 
-  duk_set_top(state->ctx, 0);
-  return Qnil;
+  duk_cbor_encode(ctx, -1, 0);
+  return 1;
 }
 
-static void ctx_get_one_prop(struct state *state, VALUE name, int strict)
+static duk_ret_t worker_error(duk_context *ctx, void *udata)
 {
-  duk_context *ctx = state->ctx;
+  duk_get_prop_string(ctx, 0, "name");
+  duk_safe_to_string(ctx, -1);
+  duk_get_prop_string(ctx, 0, "message");
+  duk_safe_to_string(ctx, -1);
+  return 2;
+}
 
-  // Don't allow prop access on undefined/null
-  if (duk_check_type_mask(ctx, -1, DUK_TYPE_MASK_UNDEFINED | DUK_TYPE_MASK_NULL)) {
-    clean_raise(ctx, eTypeError, "invalid base value");
+/*
+ * Runs a job. Returns 0 after a fatal error, which leaves the heap unusable.
+ */
+static int worker_run(struct heap *heap, struct job *job)
+{
+  duk_context *ctx = heap->ctx;
+  jmp_buf jmp;
+
+  heap->fatal_jmp = &jmp;
+  if (setjmp(jmp) != 0) {
+    job_finish(job, JOB_FATAL, heap->fatal_msg, strlen(heap->fatal_msg));
+    return 0;
   }
 
-  duk_push_lstring(ctx, RSTRING_PTR(name), RSTRING_LEN(name));
-  duk_bool_t exists = duk_get_prop(ctx, -2);
+  // The input is only read while decoding, so it doesn't need to be copied
+  duk_push_external_buffer(ctx);
+  duk_config_buffer(ctx, -1, job->input, job->input_len);
+
+  if (duk_safe_call(ctx, worker_call, NULL, 1, 1) == DUK_EXEC_SUCCESS) {
+    duk_size_t len;
+    const char *ptr = duk_get_buffer_data(ctx, -1, &len);
+    job_finish(job, JOB_DONE, ptr, len);
+  } else if (duk_safe_call(ctx, worker_error, NULL, 1, 2) == DUK_EXEC_SUCCESS) {
+    duk_size_t len;
+    const char *message = duk_get_lstring(ctx, -1, &len);
+    snprintf(job->error_name, sizeof(job->error_name), "%s", duk_get_string(ctx, -2));
+    job_finish(job, JOB_ERROR, message, len);
+  } else {
+    snprintf(job->error_name, sizeof(job->error_name), "Error");
+    job_finish(job, JOB_ERROR, "error", 5);
+  }
 
-  if (!exists && strict) {
-    const char *str = StringValueCStr(name);
-    clean_raise(ctx, eReferenceError, "identifier '%s' undefined", str);
+  duk_set_top(ctx, 0);
+  return 1;
+}
+
+/*
+ * Releases the heap of a worker which has stopped. If the context still
+ * exists, it's destroyed with the context by Ruby instead.
+ */
+static void worker_release_heap(struct heap *heap)
+{
+  jmp_buf jmp;
+
+  pthread_mutex_lock(&heap_refcount_lock);
+  int refcount = --heap->refcount;
+  heap->without_gvl = refcount == 0;
+  heap->fatal_jmp = refcount == 0 ? &jmp : NULL;
+  pthread_mutex_unlock(&heap_refcount_lock);
+
+  // A fatal error while running finalizers leaks the heap
+  if (refcount == 0 && setjmp(jmp) == 0) {
+    heap_destroy(heap);
   }
 }
 
-static void ctx_get_nested_prop(struct state *state, VALUE props)
+static void executor_release(struct executor *ex)
 {
-  duk_context *ctx = state->ctx;
+  pthread_mutex_lock(&ex->lock);
+  int refcount = --ex->refcount;
+  pthread_mutex_unlock(&ex->lock);
 
-  switch (TYPE(props)) {
-    case T_STRING:
-      duk_push_global_object(ctx);
-      ctx_get_one_prop(state, props, 1);
-      return;
+  if (refcount > 0) {
+    return;
+  }
 
-    case T_ARRAY:
-      duk_push_global_object(ctx);
+  pthread_mutex_destroy(&ex->lock);
+  pthread_cond_destroy(&ex->work);
+  pthread_cond_destroy(&ex->stopped);
+  free(ex->workers);
+  free(ex);
+}
 
-      long len = RARRAY_LEN(props);
-      for (int i = 0; i < len; i++) {
-        VALUE item = rb_ary_entry(props, i);
-        Check_Type(item, T_STRING);
+static void *worker_main(void *ptr)
+{
+  struct worker *worker = (struct worker *)ptr;
+  struct executor *ex = worker->executor;
+  struct heap *heap = worker->heap;
 
-        // Only do a strict check on the first item
-        ctx_get_one_prop(state, item, i == 0);
+  // Fatal errors jump back to worker_run, since they can't raise here
+  heap->without_gvl = 1;
+
+  for (;;) {
+    pthread_mutex_lock(&ex->lock);
+    while (ex->head == NULL && !ex->shutdown) {
+      pthread_cond_wait(&ex->work, &ex->lock);
+    }
+
+    // Queued jobs are still run after a shutdown
+    struct job *job = ex->head;
+    if (job == NULL) {
+      pthread_mutex_unlock(&ex->lock);
+      break;
+    }
+    ex->head = job->next;
+    if (ex->head == NULL) {
+      ex->tail = NULL;
+    }
+    ex->queued--;
+    ex->running++;
+    pthread_mutex_unlock(&ex->lock);
+
+    int ok = worker_run(heap, job);
+
+    pthread_mutex_lock(&ex->lock);
+    ex->running--;
+    ex->completed++;
+    pthread_mutex_unlock(&ex->lock);
+
+    if (!ok) {
+      break;
+    }
+  }
+
+  pthread_mutex_lock(&ex->lock);
+  if (--ex->live == 0) {
+    // Nothing would run the remaining jobs
+    while (ex->head != NULL) {
+      struct job *job = ex->head;
+      ex->head = job->next;
+      job_finish(job, JOB_FATAL, "no workers left", 15);
+    }
+    ex->tail = NULL;
+    ex->queued = 0;
+  }
+  pthread_mutex_unlock(&ex->lock);
+
+  worker_release_heap(heap);
+
+  pthread_mutex_lock(&ex->lock);
+  worker->heap = NULL;
+  ex->exited++;
+  pthread_cond_broadcast(&ex->stopped);
+  pthread_mutex_unlock(&ex->lock);
+
+  executor_release(ex);
+  return NULL;
+}
+
+static void executor_mark(struct executor *ex)
+{
+  rb_gc_mark(ex->contexts);
+  rb_gc_mark(ex->scratch);
+}
+
+/*
+ * Stops accepting jobs. With drop, the queued jobs are failed instead of
+ * being run.
+ */
+static void executor_stop(struct executor *ex, int drop)
+{
+  pthread_mutex_lock(&ex->lock);
+  ex->shutdown = 1;
+  while (drop && ex->head != NULL) {
+    struct job *job = ex->head;
+    ex->head = job->next;
+    job_finish(job, JOB_FATAL, "executor was garbage collected", 30);
+  }
+  if (drop) {
+    ex->tail = NULL;
+    ex->queued = 0;
+  }
+  pthread_cond_broadcast(&ex->work);
+  pthread_mutex_unlock(&ex->lock);
+}
+
+/*
+ * An executor which wasn't shut down drops its queued jobs. Running jobs
+ * finish in the background, since freeing must not block, and the last
+ * worker frees the executor.
+ */
+static void executor_dealloc(void *ptr)
+{
+  struct executor *ex = (struct executor *)ptr;
+
+  executor_stop(ex, 1);
+  if (!ex->joined) {
+    for (int i = 0; i < ex->workers_len; i++) {
+      pthread_detach(ex->workers[i].thread);
+    }
+  }
+  executor_release(ex);
+}
+
+static VALUE executor_alloc(VALUE klass)
+{
+  struct executor *ex = calloc(1, sizeof(struct executor));
+  if (ex == NULL) {
+    rb_memerror();
+  }
+
+  pthread_mutex_init(&ex->lock, NULL);
+  pthread_cond_init(&ex->work, NULL);
+  pthread_cond_init(&ex->stopped, NULL);
+  ex->refcount = 1;
+  ex->contexts = Qnil;
+  ex->scratch = Qnil;
+
+  return Data_Wrap_Struct(klass, executor_mark, executor_dealloc, ex);
+}
+
+/*
+ * :nodoc:
+ *
+ * Starts a worker for each of the contexts. Used by Executor#initialize.
+ */
+static VALUE executor_start(VALUE self, VALUE contexts)
+{
+  struct executor *ex;
+  Data_Get_Struct(self, struct executor, ex);
+
+  if (ex->workers != NULL) {
+    rb_raise(rb_eRuntimeError, "executor is already started");
+  }
+
+  Check_Type(contexts, T_ARRAY);
+  contexts = rb_ary_dup(contexts);
+  int len = (int)RARRAY_LEN(contexts);
+  if (len == 0) {
+    rb_raise(rb_eArgError, "an executor needs at least one context");
+  }
+
+  for (int i = 0; i < len; i++) {
+    VALUE context = rb_ary_entry(contexts, i);
+    if (!rb_obj_is_kind_of(context, cContext)) {
+      rb_raise(rb_eTypeError, "wrong argument type %s (expected Duktape::Context)", rb_obj_classname(context));
+    }
+
+    struct state *state;
+    Data_Get_Struct(context, struct state, state);
+    check_fatal(state);
+
+    struct heap *heap = state->heap;
+    if (state->realm_ref >= 0) {
+      rb_raise(rb_eArgError, "realms can't be used by an executor");
+    }
+    if (heap->executor) {
+      rb_raise(rb_eArgError, "context is already used by an executor");
+    }
+    for (int j = 0; j < i; j++) {
+      struct state *other;
+      Data_Get_Struct(rb_ary_entry(contexts, j), struct state, other);
+      if (other->heap == heap) {
+        rb_raise(rb_eArgError, "context is passed more than once");
       }
-      return;
+    }
+  }
+
+  // Contexts which are still in use by other threads are waited for. Once
+  // taken over by the executor they can't be used from Ruby anymore, so no
+  // functions can be defined in them after checking for them here.
+  for (int i = 0; i < len; i++) {
+    struct state *state;
+    Data_Get_Struct(rb_ary_entry(contexts, i), struct state, state);
+    struct heap *heap = state->heap;
+
+    heap_lock(heap);
+    heap->executor = 1;
+    int has_callbacks = heap->callbacks_used > 0;
+    heap_unlock((VALUE)heap);
+
+    // Workers can't call into Ruby
+    if (has_callbacks) {
+      for (int j = 0; j <= i; j++) {
+        struct state *other;
+        Data_Get_Struct(rb_ary_entry(contexts, j), struct state, other);
+        other->heap->executor = 0;
+      }
+      rb_raise(rb_eArgError, "contexts with functions defined in Ruby can't be used by an executor");
+    }
+  }
+
+  // Results are converted with the options of the first context
+  struct state *first;
+  Data_Get_Struct(rb_ary_entry(contexts, 0), struct state, first);
+  VALUE scratch = ctx_alloc(cContext);
+  struct state *scratch_state;
+  Data_Get_Struct(scratch, struct state, scratch_state);
+  scratch_state->symbolize_keys = first->symbolize_keys;
+  scratch_state->binary = first->binary;
+  scratch_state->max_depth = first->max_depth;
+
+  ex->contexts = contexts;
+  ex->scratch = scratch;
+  ex->workers = calloc(len, sizeof(struct worker));
+  if (ex->workers == NULL) {
+    rb_memerror();
+  }
+
+  // Signals are handled by Ruby's threads
+  sigset_t all, prev;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &prev);
+
+  int err = 0;
+  for (int i = 0; i < len; i++) {
+    struct state *state;
+    Data_Get_Struct(rb_ary_entry(contexts, i), struct state, state);
+
+    struct worker *worker = &ex->workers[ex->workers_len];
+    worker->executor = ex;
+    worker->heap = state->heap;
+    worker->heap->refcount++;
+
+    pthread_mutex_lock(&ex->lock);
+    ex->live++;
+    ex->refcount++;
+    pthread_mutex_unlock(&ex->lock);
+
+    err = pthread_create(&worker->thread, NULL, worker_main, worker);
+    if (err != 0) {
+      pthread_mutex_lock(&ex->lock);
+      ex->live--;
+      ex->refcount--;
+      pthread_mutex_unlock(&ex->lock);
+      heap_release(worker->heap);
+      break;
+    }
+    ex->workers_len++;
+  }
 
-    default:
-      clean_raise(ctx, rb_eTypeError, "wrong argument type %s (expected String or Array)", rb_obj_classname(props));
-      return;
+  pthread_sigmask(SIG_SETMASK, &prev, NULL);
+
+  if (err != 0) {
+    executor_stop(ex, 1);
+    rb_syserr_fail(err, "pthread_create");
   }
+
+  return Qnil;
 }
 
-/*
- * call-seq:
- *   get_prop(name) -> obj
- *   get_prop([names,...]) -> obj
- *
- * Access the property of the global object. An Array of names can be given
- * to access the property on a nested object.
- *
- *     ctx.exec_string("var n = 42", "foo.js")
- *     ctx.get_prop("n") #=> 42
- *
- *     ctx.get_prop(["Math", "PI"]) #=> 3.14
- *
- */
-static VALUE ctx_get_prop(VALUE self, VALUE prop)
+static struct executor *executor_get(VALUE self)
 {
-  struct state *state;
-  Data_Get_Struct(self, struct state, state);
-  check_fatal(state);
+  struct executor *ex;
+  Data_Get_Struct(self, struct executor, ex);
 
-  ctx_get_nested_prop(state, prop);
+  if (ex->shutdown) {
+    rb_raise(rb_eRuntimeError, "executor has been shut down");
+  }
+  if (ex->live == 0) {
+    rb_raise(eInternalError, "executor has no running workers");
+  }
+  return ex;
+}
 
-  VALUE res = ctx_stack_to_value(state, -1);
-  duk_set_top(state->ctx, 0);
-  return res;
+static void future_mark(struct future *future)
+{
+  rb_gc_mark(future->scratch);
+  rb_gc_mark(future->value);
+}
+
+static void future_dealloc(void *ptr)
+{
+  struct future *future = (struct future *)ptr;
+  if (future->job != NULL) {
+    job_release(future->job);
+  }
+  free(future);
 }
 
+static VALUE future_new(struct job *job, VALUE scratch)
+{
+  struct future *future = malloc(sizeof(struct future));
+  if (future == NULL) {
+    job_release(job);
+    rb_memerror();
+  }
+
+  future->job = job;
+  future->scratch = scratch;
+  future->value = Qnil;
+  future->resolved = 0;
+  return Data_Wrap_Struct(cFuture, future_mark, future_dealloc, future);
+}
 
 /*
  * call-seq:
- *   call_prop(name, params,...) -> obj
- *   call_prop([names,...], params,...) -> obj
+ *   submit(name, params,...) -> future
+ *   submit([names,...], params,...) -> future
  *
- * Call a function defined in the global scope with the given parameters. An
- * Array of names can be given to call a function on a nested object.
+ * Queue a call of a function like Context#call_prop and return a
+ * Duktape::Future for its result. The job is run by the first idle worker.
  *
- *     ctx.call_prop("parseInt", "42")       #=> 42
- *     ctx.call_prop(["Math", "pow"], 2, 10) #=> 1024
+ *     futures = sources.map { |src| executor.submit(["babel", "transform"], src) }
+ *     futures.map(&:value)
  *
+ * Arguments and results are converted like with <code>marshal: :cbor</code>.
  */
-static VALUE ctx_call_prop(int argc, VALUE* argv, VALUE self)
+static VALUE executor_submit(int argc, VALUE *argv, VALUE self)
 {
+  struct executor *ex = executor_get(self);
   struct state *state;
-  Data_Get_Struct(self, struct state, state);
-  check_fatal(state);
+  Data_Get_Struct(ex->scratch, struct state, state);
 
   VALUE prop;
   rb_scan_args(argc, argv, "1*", &prop, NULL);
 
-  ctx_get_nested_prop(state, prop);
+  struct cbor_writer w;
+  cbor_writer_init(&w, state);
 
-  // Swap receiver and function
-  duk_swap_top(state->ctx, -2);
+  cbor_write_head(&w, 4, argc);
+  switch (TYPE(prop)) {
+    case T_STRING:
+      cbor_write_head(&w, 4, 1);
+      cbor_write_string(&w, prop);
+      break;
+
+    case T_ARRAY:
+      cbor_write_head(&w, 4, RARRAY_LEN(prop));
+      for (long i = 0; i < RARRAY_LEN(prop); i++) {
+        VALUE item = rb_ary_entry(prop, i);
+        Check_Type(item, T_STRING);
+        cbor_write_string(&w, item);
+      }
+      break;
 
-  // Push arguments
+    default:
+      rb_raise(rb_eTypeError, "wrong argument type %s (expected String or Array)", rb_obj_classname(prop));
+  }
   for (int i = 1; i < argc; i++) {
-    ctx_push_ruby_object(state, argv[i]);
+    cbor_write_value(&w, argv[i]);
   }
 
-  if (duk_pcall_method(state->ctx, (argc - 1)) == DUK_EXEC_ERROR) {
-    raise_ctx_error(state);
+  struct job *job = calloc(1, sizeof(struct job));
+  if (job == NULL) {
+    rb_memerror();
+  }
+  job->input_len = RSTRING_LEN(w.buf);
+  job->input = malloc(job->input_len);
+  if (job->input == NULL) {
+    free(job);
+    rb_memerror();
+  }
+  memcpy(job->input, RSTRING_PTR(w.buf), job->input_len);
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->cond, NULL);
+  job->refcount = 2;
+  job->status = JOB_QUEUED;
+  RB_GC_GUARD(w.buf);
+
+  VALUE future = future_new(job, ex->scratch);
+
+  pthread_mutex_lock(&ex->lock);
+  if (ex->live == 0) {
+    // The last worker stopped after a fatal error meanwhile
+    pthread_mutex_unlock(&ex->lock);
+    job_finish(job, JOB_FATAL, "no workers left", 15);
+    return future;
+  }
+  if (ex->tail == NULL) {
+    ex->head = job;
+  } else {
+    ex->tail->next = job;
   }
+  ex->tail = job;
+  ex->queued++;
+  pthread_cond_signal(&ex->work);
+  pthread_mutex_unlock(&ex->lock);
 
-  VALUE res = ctx_stack_to_value(state, -1);
-  duk_set_top(state->ctx, 0);
-  return res;
+  return future;
 }
 
-static duk_ret_t ctx_call_pushed_function(duk_context *ctx) {
-  VALUE block; // the block to yield
-  struct state *state;
-  int nargs = duk_get_top(ctx); // number of arguments of the block (arity)
-  VALUE args = rb_ary_new(); // the block to yield needs an array of arguments
-  VALUE result; // the result returned by yielding the block
-
-  duk_push_current_function(ctx);
-
-  // get the block which is a property of the pushed function
-  duk_get_prop_string(ctx, -1, "block");
-  block = (VALUE) duk_get_pointer(ctx, -1);
-  duk_pop(ctx);
+struct executor_wait {
+  struct executor *ex;
+  int interrupted;
+};
 
-  // get the state so that we don't need to a create a new one
-  duk_get_prop_string(ctx, -1, "state");
-  state = (struct state *) duk_get_pointer(ctx, -1);
-  duk_pop(ctx);
+static void *executor_wait_without_gvl(void *ptr)
+{
+  struct executor_wait *wait = (struct executor_wait *)ptr;
+  struct executor *ex = wait->ex;
 
-  // before pushing each argument to the array, each one needs to be converted into a ruby value
-  for (int i = 0; i < nargs; i++)
-    rb_ary_push(args, ctx_stack_to_value(state, i));
+  pthread_mutex_lock(&ex->lock);
+  while (ex->exited < ex->workers_len && !wait->interrupted) {
+    pthread_cond_wait(&ex->stopped, &ex->lock);
+  }
+  pthread_mutex_unlock(&ex->lock);
+  return NULL;
+}
 
-  result = rb_proc_call(block, args); // yield
-  ctx_push_ruby_object(state, result);
+static void executor_wait_ubf(void *ptr)
+{
+  struct executor_wait *wait = (struct executor_wait *)ptr;
 
-  return 1;
+  pthread_mutex_lock(&wait->ex->lock);
+  wait->interrupted = 1;
+  pthread_cond_broadcast(&wait->ex->stopped);
+  pthread_mutex_unlock(&wait->ex->lock);
 }
 
 /*
  * call-seq:
- *   ctx_define_function(name, &block) -> nil
- *
- * Define a function defined in the global scope and identified by a name.
- *
- *     ctx.ctx_define_function("hello_world") { |ctx| 'Hello world' } #=> nil
+ *   shutdown -> nil
  *
+ * Stop accepting jobs and wait until the workers have run the queued ones.
+ * The heaps of the workers are destroyed afterwards.
  */
-static VALUE ctx_define_function(VALUE self, VALUE prop)
+static VALUE executor_shutdown(VALUE self)
 {
-  VALUE block;
-  struct state *state;
-  duk_context *ctx;
+  struct executor *ex;
+  Data_Get_Struct(self, struct executor, ex);
 
-  // a block is required
-  if (!rb_block_given_p())
-    rb_raise(rb_eArgError, "Expected block");
+  executor_stop(ex, 0);
 
-  // get the context
-  Data_Get_Struct(self, struct state, state);
-  check_fatal(state);
+  struct executor_wait wait = { ex, 0 };
+  while (ex->exited < ex->workers_len) {
+    wait.interrupted = 0;
+    rb_thread_call_without_gvl(executor_wait_without_gvl, &wait, executor_wait_ubf, &wait);
+    rb_thread_check_ints();
+  }
 
-  ctx = state->ctx;
+  // The workers have released their heaps and are about to return
+  if (!ex->joined) {
+    ex->joined = 1;
+    for (int i = 0; i < ex->workers_len; i++) {
+      pthread_join(ex->workers[i].thread, NULL);
+    }
+  }
+  return Qnil;
+}
 
-  // the c function is available in the global scope
-  duk_push_global_object(ctx);
+/*
+ * call-seq:
+ *   shutdown? -> true or false
+ *
+ * Returns true once #shutdown has been called.
+ */
+static VALUE executor_is_shutdown(VALUE self)
+{
+  struct executor *ex;
+  Data_Get_Struct(self, struct executor, ex);
 
-  duk_push_c_function(ctx, ctx_call_pushed_function, DUK_VARARGS);
+  return ex->shutdown ? Qtrue : Qfalse;
+}
 
-  block = rb_block_proc();
-  rb_ary_push(state->blocks, block); // block will be properly garbage collected
+/*
+ * call-seq:
+ *   stats -> hash
+ *
+ * Returns a Hash with the number of +threads+ which are still running, the
+ * number of +queued+ and +running+ jobs, and the number of +completed+ jobs.
+ */
+static VALUE executor_stats(VALUE self)
+{
+  struct executor *ex;
+  Data_Get_Struct(self, struct executor, ex);
+
+  pthread_mutex_lock(&ex->lock);
+  int live = ex->live;
+  long queued = ex->queued;
+  long running = ex->running;
+  unsigned long completed = ex->completed;
+  pthread_mutex_unlock(&ex->lock);
+
+  VALUE stats = rb_hash_new();
+  rb_hash_aset(stats, ID2SYM(rb_intern("threads")), INT2NUM(live));
+  rb_hash_aset(stats, ID2SYM(rb_intern("queued")), LONG2NUM(queued));
+  rb_hash_aset(stats, ID2SYM(rb_intern("running")), LONG2NUM(running));
+  rb_hash_aset(stats, ID2SYM(rb_intern("completed")), ULONG2NUM(completed));
+  return stats;
+}
 
-  // both block and state are required by the pushed function
-  duk_push_string(ctx, "block");
-  duk_push_pointer(ctx, (void *) block);
-  duk_def_prop(ctx, -3,  DUK_DEFPROP_HAVE_VALUE | DUK_DEFPROP_HAVE_WRITABLE | 0);
+static int job_is_done(struct job *job)
+{
+  pthread_mutex_lock(&job->lock);
+  int done = job->status != JOB_QUEUED;
+  pthread_mutex_unlock(&job->lock);
+  return done;
+}
+
+struct future_wait {
+  struct job *job;
+  struct timespec *deadline;
+  int interrupted;
+};
 
-  duk_push_string(ctx, "state");
-  duk_push_pointer(ctx, (void *) state);
-  duk_def_prop(ctx, -3,  DUK_DEFPROP_HAVE_VALUE | DUK_DEFPROP_HAVE_WRITABLE | 0);
+static void *future_wait_without_gvl(void *ptr)
+{
+  struct future_wait *wait = (struct future_wait *)ptr;
+  struct job *job = wait->job;
+
+  pthread_mutex_lock(&job->lock);
+  while (job->status == JOB_QUEUED && !wait->interrupted) {
+    if (wait->deadline == NULL) {
+      pthread_cond_wait(&job->cond, &job->lock);
+    } else if (pthread_cond_timedwait(&job->cond, &job->lock, wait->deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&job->lock);
+  return NULL;
+}
 
-  duk_put_prop_string(ctx, -2, StringValueCStr(prop));
+static void future_wait_ubf(void *ptr)
+{
+  struct future_wait *wait = (struct future_wait *)ptr;
 
-  return Qnil;
+  pthread_mutex_lock(&wait->job->lock);
+  wait->interrupted = 1;
+  pthread_cond_broadcast(&wait->job->cond);
+  pthread_mutex_unlock(&wait->job->lock);
 }
 
 /*
- * :nodoc:
- *
- * Checks that we are in a fine state
+ * Waits for the job without the GVL. Returns 0 if it didn't finish within
+ * the timeout (nil waits forever).
  */
-static VALUE ctx_is_valid(VALUE self)
+static int future_wait_job(struct future *future, VALUE timeout)
 {
-  struct state *state;
-  Data_Get_Struct(self, struct state, state);
+  if (future->resolved || job_is_done(future->job)) {
+    return 1;
+  }
 
-  if (duk_is_valid_index(state->ctx, -1)) {
-    return Qfalse;
-  } else {
-    return Qtrue;
+  struct timespec deadline;
+  struct future_wait wait = { future->job, NULL, 0 };
+
+  if (!NIL_P(timeout)) {
+    double secs = NUM2DBL(timeout);
+    if (secs < 0) {
+      secs = 0;
+    }
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += (time_t)secs;
+    deadline.tv_nsec += (long)((secs - (double)(time_t)secs) * 1e9);
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    wait.deadline = &deadline;
+  }
+
+  for (;;) {
+    wait.interrupted = 0;
+    rb_thread_call_without_gvl(future_wait_without_gvl, &wait, future_wait_ubf, &wait);
+
+    if (job_is_done(future->job)) {
+      return 1;
+    }
+    if (!wait.interrupted) {
+      return 0;
+    }
+    rb_thread_check_ints();
   }
 }
 
 /*
- * :nodoc:
- *
- * Invokes duk_fatal(). Only used for testing.
+ * Converts the output of a finished job. The job is released afterwards,
+ * since the value or exception is kept by the future.
  */
-static VALUE ctx_invoke_fatal(VALUE self)
+static void future_resolve(struct future *future)
 {
+  struct job *job = future->job;
   struct state *state;
-  Data_Get_Struct(self, struct state, state);
+  Data_Get_Struct(future->scratch, struct state, state);
 
-  duk_fatal(state->ctx, "induced fatal error");
+  switch (job->status) {
+    case JOB_DONE:
+      future->value = cbor_read_value(state, job->output, job->output_len);
+      break;
 
-  return Qnil;
-}
+    case JOB_ERROR:
+      future->value = rb_exc_new(error_name_class(job->error_name), job->output, job->output_len);
+      break;
 
-static void error_handler(void *udata, const char *msg)
-{
-  struct state *state = (struct state *)udata;
+    case JOB_FATAL:
+      future->value = rb_exc_new(eInternalError, job->output, job->output_len);
+      break;
 
-  if (msg == NULL) {
-    msg = "fatal error";
+    default:
+      future->value = rb_exc_new_cstr(rb_eNoMemError, "failed to allocate memory");
+      break;
   }
-  state->is_fatal = 1;
-  rb_raise(eInternalError, "%s", msg);
-}
 
-static void check_fatal(struct state *state)
-{
-  if (state->is_fatal) {
-    rb_raise(eInternalError, "fatal error");
-  }
+  future->resolved = job->status == JOB_DONE ? 1 : 2;
+  future->job = NULL;
+  job_release(job);
 }
 
-VALUE complex_object_instance(VALUE self)
+/*
+ * call-seq:
+ *   value(timeout = nil) -> obj
+ *
+ * Wait for the job and return the result of the function. Errors thrown by
+ * JavaScript are raised like by Context#call_prop. Raises
+ * Duktape::Future::TimeoutError if the job didn't finish within +timeout+
+ * seconds.
+ */
+static VALUE future_value(int argc, VALUE *argv, VALUE self)
 {
-  return oComplexObject;
+  struct future *future;
+  Data_Get_Struct(self, struct future, future);
+
+  VALUE timeout;
+  rb_scan_args(argc, argv, "01", &timeout);
+
+  if (!future_wait_job(future, timeout)) {
+    rb_raise(eFutureTimeoutError, "job didn't finish in time");
+  }
+  if (!future->resolved) {
+    future_resolve(future);
+  }
+  if (future->resolved == 2) {
+    rb_exc_raise(future->value);
+  }
+  return future->value;
 }
 
 /*
  * call-seq:
- *   Context.new
- *   Context.new(complex_object: obj)
- *
- * Returns a new JavaScript evaluation context.
+ *   wait(timeout = nil) -> future or nil
  *
+ * Wait until the job has finished, but at most +timeout+ seconds. Returns
+ * nil if it's still queued or running.
  */
-static VALUE ctx_initialize(int argc, VALUE *argv, VALUE self)
+static VALUE future_wait(int argc, VALUE *argv, VALUE self)
 {
-  struct state *state;
-  Data_Get_Struct(self, struct state, state);
+  struct future *future;
+  Data_Get_Struct(self, struct future, future);
 
-  VALUE options;
-  rb_scan_args(argc, argv, ":", &options);
-  if (!NIL_P(options))
-    state->complex_object = rb_hash_lookup2(options, ID2SYM(id_complex_object), state->complex_object);
+  VALUE timeout;
+  rb_scan_args(argc, argv, "01", &timeout);
 
-  return Qnil;
+  return future_wait_job(future, timeout) ? self : Qnil;
 }
 
 /*
  * call-seq:
- *   complex_object -> obj
- *
- * Returns the default complex object, the value that would be returned if a
- * JavaScript object had no representation in Ruby, such as a JavaScript
- * Function. See also Context::new.
- *
- *     ctx.complex_object #=> #<Duktape::ComplexObject>
+ *   done? -> true or false
  *
+ * Returns true if the job has finished, either with a result or an error.
  */
-static VALUE ctx_complex_object(VALUE self)
+static VALUE future_is_done(VALUE self)
 {
-  struct state *state;
-  Data_Get_Struct(self, struct state, state);
+  struct future *future;
+  Data_Get_Struct(self, struct future, future);
 
-  return state->complex_object;
+  return future->resolved || job_is_done(future->job) ? Qtrue : Qfalse;
+}
+#else
+/*
+ * :nodoc:
+ */
+static VALUE executor_start(VALUE self, VALUE contexts)
+{
+  rb_raise(rb_eNotImpError, "Duktape::Executor needs pthreads");
+  return Qnil;
 }
+#endif
 
-void Init_duktape_ext()
+/*
+ * Methods using a heap are wrapped so that they hold its lock (see
+ * heap_lock) until they return.
+ */
+struct locked_call {
+  VALUE self;
+  int arity;
+  int argc;
+  VALUE *argv;
+  union {
+    VALUE (*v)(int, VALUE *, VALUE);
+    VALUE (*m0)(VALUE);
+    VALUE (*m1)(VALUE, VALUE);
+  } fn;
+};
+
+static VALUE locked_call_body(VALUE ptr)
+{
+  struct locked_call *call = (struct locked_call *)ptr;
+
+  switch (call->arity) {
+  case 0:
+    return call->fn.m0(call->self);
+  case 1:
+    return call->fn.m1(call->self, call->argv[0]);
+  default:
+    return call->fn.v(call->argc, call->argv, call->self);
+  }
+}
+
+static VALUE with_heap_lock(struct locked_call *call)
 {
-  int one = 1;
-  if (*(char*)(&one) == 1) {
-    utf16enc = rb_enc_find("UTF-16LE");
+  struct heap *heap;
+
+  if (call->arity >= 0) {
+    rb_check_arity(call->argc, call->arity, call->arity);
+  }
+
+  if (rb_obj_is_kind_of(call->self, cContext)) {
+    struct state *state;
+    Data_Get_Struct(call->self, struct state, state);
+    heap = state->heap;
   } else {
-    utf16enc = rb_enc_find("UTF-16BE");
+    struct object_ref *ref;
+    Data_Get_Struct(call->self, struct object_ref, ref);
+    heap = ref->heap;
+  }
+
+  if (heap->executor) {
+    rb_raise(rb_eRuntimeError, "context is used by an executor");
   }
+
+  heap_lock(heap);
+
+  // The context may have been taken over while waiting for the lock
+  if (heap->executor) {
+    heap_unlock((VALUE)heap);
+    rb_raise(rb_eRuntimeError, "context is used by an executor");
+  }
+
+  return rb_ensure(locked_call_body, (VALUE)call, heap_unlock, (VALUE)heap);
+}
+
+#define LOCKED(func, arity, member) \
+  static VALUE func##_locked(int argc, VALUE *argv, VALUE self) \
+  { \
+    struct locked_call call = { self, arity, argc, argv }; \
+    call.fn.member = func; \
+    return with_heap_lock(&call); \
+  }
+
+LOCKED(ctx_eval_string, -1, v)
+LOCKED(ctx_eval_json, -1, v)
+LOCKED(ctx_exec_string, -1, v)
+LOCKED(ctx_exec_file, -1, v)
+LOCKED(ctx_eval_file, -1, v)
+LOCKED(ctx_eval_script, 1, m1)
+LOCKED(ctx_exec_script, 1, m1)
+LOCKED(ctx_get_prop, -1, v)
+LOCKED(ctx_call_prop, -1, v)
+LOCKED(ctx_call_prop_json, -1, v)
+LOCKED(ctx_call_prop_many, -1, v)
+LOCKED(ctx_define_function, 1, m1)
+LOCKED(ctx_define_object, -1, v)
+LOCKED(ctx_new_realm, 0, m0)
+LOCKED(ctx_function, 1, m1)
+LOCKED(ctx_pin, 1, m1)
+LOCKED(ref_call, -1, v)
+LOCKED(ref_aref, 1, m1)
+LOCKED(ref_dig, -1, v)
+LOCKED(ref_keys, 0, m0)
+LOCKED(ref_each, 0, m0)
+LOCKED(ref_to_h, 0, m0)
+LOCKED(ref_is_array, 0, m0)
+LOCKED(ref_is_function, 0, m0)
+LOCKED(handle_release, 0, m0)
+
+void Init_duktape_ext()
+{
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  // Contexts can be used from any Ractor. The values shared between Ractors
+  // below are frozen, and everything else lives in a Context.
+  rb_ext_ractor_safe(true);
+#endif
+
   id_complex_object = rb_intern("complex_object");
+  id_iv_bytecode = rb_intern("@bytecode");
+  id_iv_filename = rb_intern("@filename");
+  id_iv_json = rb_intern("@json");
+  id_bytecode_cache = rb_intern("bytecode_cache");
+  id_marshal = rb_intern("marshal");
+  id_symbolize_keys = rb_intern("symbolize_keys");
+  id_binary = rb_intern("binary");
+  id_cbor = rb_intern("cbor");
+  id_fetch = rb_intern("fetch");
+  id_lazy = rb_intern("lazy");
+  id_max_depth = rb_intern("max_depth");
+  id_eval_cache = rb_intern("eval_cache");
+  id_eval_cache_max_source = rb_intern("eval_cache_max_source");
+  id_binread = rb_intern("binread");
+  id_methods = rb_intern("methods");
+  id_exception = rb_intern("exception");
 
   mDuktape = rb_define_module("Duktape");
   cContext = rb_define_class_under(mDuktape, "Context", rb_cObject);
   cComplexObject = rb_define_class_under(mDuktape, "ComplexObject", rb_cObject);
+  cScript = rb_define_class_under(mDuktape, "Script", rb_cObject);
+  cFunction = rb_define_class_under(mDuktape, "Function", rb_cObject);
+  cRawJSON = rb_define_class_under(mDuktape, "RawJSON", rb_cObject);
+  cObjectRef = rb_define_class_under(mDuktape, "ObjectRef", rb_cObject);
+  cHandle = rb_define_class_under(mDuktape, "Handle", rb_cObject);
 
   eInternalError = rb_define_class_under(mDuktape, "InternalError", rb_eStandardError);
   eUnimplementedError = rb_define_class_under(mDuktape, "UnimplementedError", eInternalError);
@@ -718,82 +5317,86 @@ void Init_duktape_ext()
 
   rb_define_method(cContext, "initialize", ctx_initialize, -1);
   rb_define_method(cContext, "complex_object", ctx_complex_object, 0);
-  rb_define_method(cContext, "eval_string", ctx_eval_string, -1);
-  rb_define_method(cContext, "exec_string", ctx_exec_string, -1);
-  rb_define_method(cContext, "get_prop", ctx_get_prop, 1);
-  rb_define_method(cContext, "call_prop", ctx_call_prop, -1);
-  rb_define_method(cContext, "define_function", ctx_define_function, 1);
+  rb_define_method(cContext, "eval_string", ctx_eval_string_locked, -1);
+  rb_define_method(cContext, "eval_json", ctx_eval_json_locked, -1);
+  rb_define_method(cContext, "exec_string", ctx_exec_string_locked, -1);
+  rb_define_method(cContext, "exec_file", ctx_exec_file_locked, -1);
+  rb_define_method(cContext, "eval_file", ctx_eval_file_locked, -1);
+  rb_define_method(cContext, "eval_script", ctx_eval_script_locked, -1);
+  rb_define_method(cContext, "exec_script", ctx_exec_script_locked, -1);
+  rb_define_method(cContext, "get_prop", ctx_get_prop_locked, -1);
+  rb_define_method(cContext, "call_prop", ctx_call_prop_locked, -1);
+  rb_define_method(cContext, "call_prop_json", ctx_call_prop_json_locked, -1);
+  rb_define_method(cContext, "call_prop_many", ctx_call_prop_many_locked, -1);
+  rb_define_method(cContext, "define_function", ctx_define_function_locked, -1);
+  rb_define_method(cContext, "define_object", ctx_define_object_locked, -1);
+  rb_define_method(cContext, "new_realm", ctx_new_realm_locked, -1);
+  rb_define_method(cContext, "function", ctx_function_locked, -1);
+  rb_define_method(cContext, "pin", ctx_pin_locked, -1);
+  rb_define_method(cContext, "eval_cache_stats", ctx_eval_cache_stats, 0);
   rb_define_method(cContext, "_valid?", ctx_is_valid, 0);
   rb_define_method(cContext, "_invoke_fatal", ctx_invoke_fatal, 0);
+  rb_define_method(cContext, "_callbacks_len", ctx_callbacks_len, 0);
 
   oComplexObject = rb_obj_alloc(cComplexObject);
+  OBJ_FREEZE(oComplexObject);
   rb_define_singleton_method(cComplexObject, "instance", complex_object_instance, 0);
   rb_ivar_set(cComplexObject, rb_intern("duktape.instance"), oComplexObject);
 
+  rb_undef_method(CLASS_OF(cScript), "new");
+  rb_define_singleton_method(cScript, "compile", script_s_compile, -1);
+  rb_define_singleton_method(cScript, "load", script_s_load, -1);
+  rb_define_attr(cScript, "bytecode", 1, 0);
+  rb_define_attr(cScript, "filename", 1, 0);
+
+  rb_undef_alloc_func(cFunction);
+  rb_undef_method(CLASS_OF(cFunction), "new");
+  rb_define_method(cFunction, "call", ref_call_locked, -1);
+  rb_define_method(cFunction, "context", ref_context, 0);
+
+  rb_undef_alloc_func(cObjectRef);
+  rb_undef_method(CLASS_OF(cObjectRef), "new");
+  rb_include_module(cObjectRef, rb_mEnumerable);
+  rb_define_method(cObjectRef, "[]", ref_aref_locked, -1);
+  rb_define_method(cObjectRef, "dig", ref_dig_locked, -1);
+  rb_define_method(cObjectRef, "keys", ref_keys_locked, -1);
+  rb_define_method(cObjectRef, "each", ref_each_locked, -1);
+  rb_define_method(cObjectRef, "to_h", ref_to_h_locked, -1);
+  rb_define_method(cObjectRef, "array?", ref_is_array_locked, -1);
+  rb_define_method(cObjectRef, "function?", ref_is_function_locked, -1);
+  rb_define_method(cObjectRef, "call", ref_call_locked, -1);
+  rb_define_method(cObjectRef, "context", ref_context, 0);
+
+  rb_undef_alloc_func(cHandle);
+  rb_undef_method(CLASS_OF(cHandle), "new");
+  rb_define_method(cHandle, "release", handle_release_locked, -1);
+  rb_define_method(cHandle, "released?", handle_is_released, 0);
+  rb_define_method(cHandle, "context", ref_context, 0);
+
+  rb_define_method(cRawJSON, "initialize", raw_json_initialize, 1);
+  rb_define_attr(cRawJSON, "json", 1, 0);
+  rb_define_alias(cRawJSON, "to_s", "json");
+
+  cExecutor = rb_define_class_under(mDuktape, "Executor", rb_cObject);
+  rb_define_private_method(cExecutor, "_start", executor_start, 1);
+#ifdef HAVE_PTHREAD_H
+  rb_define_alloc_func(cExecutor, executor_alloc);
+  rb_define_method(cExecutor, "submit", executor_submit, -1);
+  rb_define_method(cExecutor, "shutdown", executor_shutdown, 0);
+  rb_define_method(cExecutor, "shutdown?", executor_is_shutdown, 0);
+  rb_define_method(cExecutor, "stats", executor_stats, 0);
+
+  cFuture = rb_define_class_under(mDuktape, "Future", rb_cObject);
+  eFutureTimeoutError = rb_define_class_under(cFuture, "TimeoutError", rb_eStandardError);
+  rb_undef_alloc_func(cFuture);
+  rb_undef_method(CLASS_OF(cFuture), "new");
+  rb_define_method(cFuture, "value", future_value, -1);
+  rb_define_method(cFuture, "wait", future_wait, -1);
+  rb_define_method(cFuture, "done?", future_is_done, 0);
+#endif
+
   sDefaultFilename = rb_str_new2("(duktape)");
   OBJ_FREEZE(sDefaultFilename);
   rb_global_variable(&sDefaultFilename);
 }
 
-
-/* UTF8 crap which is not exposed by Ruby */
-
-static const unsigned long utf8_limits[] = {
-    0x0,			/* 1 */
-    0x80,			/* 2 */
-    0x800,			/* 3 */
-    0x10000,			/* 4 */
-    0x200000,			/* 5 */
-    0x4000000,			/* 6 */
-    0x80000000,			/* 7 */
-};
-
-static unsigned long
-utf8_to_uv(const char *p, long *lenp)
-{
-  int c = *p++ & 0xff;
-  unsigned long uv = c;
-  long n;
-
-  if (!(uv & 0x80)) {
-    *lenp = 1;
-    return uv;
-  }
-  if (!(uv & 0x40)) {
-    *lenp = 1;
-    rb_raise(rb_eArgError, "malformed UTF-8 character");
-  }
-
-  if      (!(uv & 0x20)) { n = 2; uv &= 0x1f; }
-  else if (!(uv & 0x10)) { n = 3; uv &= 0x0f; }
-  else if (!(uv & 0x08)) { n = 4; uv &= 0x07; }
-  else if (!(uv & 0x04)) { n = 5; uv &= 0x03; }
-  else if (!(uv & 0x02)) { n = 6; uv &= 0x01; }
-  else {
-    *lenp = 1;
-    rb_raise(rb_eArgError, "malformed UTF-8 character");
-  }
-  if (n > *lenp) {
-    rb_raise(rb_eArgError, "malformed UTF-8 character (expected %ld bytes, given %ld bytes)",
-        n, *lenp);
-  }
-  *lenp = n--;
-  if (n != 0) {
-    while (n--) {
-      c = *p++ & 0xff;
-      if ((c & 0xc0) != 0x80) {
-        *lenp -= n + 1;
-        rb_raise(rb_eArgError, "malformed UTF-8 character");
-      }
-      else {
-        c &= 0x3f;
-        uv = uv << 6 | c;
-      }
-    }
-  }
-  n = *lenp - 1;
-  if (uv < utf8_limits[n]) {
-    rb_raise(rb_eArgError, "redundant UTF-8 sequence");
-  }
-  return uv;
-}
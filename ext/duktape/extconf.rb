@@ -3,5 +3,10 @@ require 'zlib'
 
 $CFLAGS += ' -std=c99'
 have_func 'rb_sym2str'
+have_func 'rb_str_to_interned_str'
+have_func 'rb_hash_new_capa'
+have_func 'mmap', 'sys/mman.h'
+have_func 'rb_ext_ractor_safe', 'ruby.h'
+have_header 'pthread.h'
 create_makefile 'duktape_ext'
 
@@ -1,6 +1,6 @@
 require 'duktape_ext'
 require 'duktape/version'
-
-module Duktape
-end
-
+require 'duktape/bytecode_cache'
+require 'duktape/template'
+require 'duktape/pool'
+require 'duktape/executor'
@@ -0,0 +1,134 @@
+require 'digest/sha2'
+require 'fileutils'
+
+module Duktape
+  # Stores compiled Scripts in a directory so that the same source only needs
+  # to be compiled once, even across processes.
+  #
+  #     cache = Duktape::BytecodeCache.new("tmp/duktape")
+  #     ctx = Duktape::Context.new(bytecode_cache: cache)
+  #     ctx.exec_file("vendor/babel.js")
+  #
+  # Entries are keyed by the source, the filename, the gem version and the
+  # platform. Every entry carries a checksum of its bytecode, and entries which
+  # can't be read or don't match their checksum are compiled again.
+  #
+  # The last +size+ Scripts used are also kept in memory. The directory isn't
+  # cleaned up automatically: when the sources are generated dynamically, call
+  # #prune now and then to remove the entries which weren't used recently.
+  class BytecodeCache
+    MAGIC = "DUKRB1".b.freeze
+    HEADER_SIZE = MAGIC.bytesize + 32
+
+    attr_reader :dir
+
+    # The maximum number of Scripts kept in memory.
+    attr_reader :size
+
+    def initialize(dir, size: 64)
+      raise ArgumentError, "size must be a non-negative Integer" unless size.is_a?(Integer) && size >= 0
+
+      @dir = File.expand_path(dir)
+      @size = size
+      @scripts = {} # least recently used first
+      @mutex = Mutex.new
+      FileUtils.mkdir_p(@dir)
+    end
+
+    # Returns a Script for the source, compiling it only if no valid entry
+    # exists in memory or on disk.
+    def fetch(source, filename)
+      key = key_for(source, filename)
+
+      script = @mutex.synchronize do
+        script = @scripts.delete(key)
+        @scripts[key] = script if script
+      end
+      return script if script
+
+      path = File.join(@dir, "#{key}.bc")
+      script = read(path, filename)
+
+      unless script
+        script = Script.compile(source, filename)
+        write(path, script.bytecode)
+      end
+
+      @mutex.synchronize do
+        @scripts.delete(key)
+        @scripts[key] = script
+        @scripts.shift while @scripts.size > @size
+      end
+      script
+    end
+
+    # call-seq:
+    #   prune(max_entries) -> count
+    #
+    # Removes all but the +max_entries+ files which were written or read most
+    # recently (by any process) and returns the number of removed files.
+    # Scripts kept in memory stay usable.
+    def prune(max_entries)
+      raise ArgumentError, "max_entries must be a non-negative Integer" unless max_entries.is_a?(Integer) && max_entries >= 0
+
+      entries = Dir[File.join(@dir, "*.bc")].map do |path|
+        begin
+          [path, File.mtime(path)]
+        rescue SystemCallError
+          nil
+        end
+      end.compact
+      return 0 if entries.size <= max_entries
+
+      removed = entries.sort_by { |_, mtime| mtime }.first(entries.size - max_entries)
+      removed.each { |path, _| File.unlink(path) rescue nil }
+      removed.size
+    end
+
+    # Removes all entries from the cache.
+    def clear
+      @mutex.synchronize { @scripts.clear }
+      FileUtils.rm_f(Dir[File.join(@dir, "*.bc")])
+    end
+
+    private
+
+    def key_for(source, filename)
+      digest = Digest::SHA256.new
+      [VERSION, RUBY_PLATFORM, filename, source].each do |part|
+        part = part.to_s.b
+        digest << [part.bytesize].pack("Q>") << part
+      end
+      digest.hexdigest
+    end
+
+    def read(path, filename)
+      data = File.binread(path)
+      return if data.bytesize <= HEADER_SIZE
+      return unless data.start_with?(MAGIC)
+
+      checksum = data.byteslice(MAGIC.bytesize, 32)
+      bytecode = data.byteslice(HEADER_SIZE, data.bytesize - HEADER_SIZE)
+      return unless Digest::SHA256.digest(bytecode) == checksum
+
+      # Mark the entry as used for #prune
+      File.utime(nil, nil, path) rescue nil
+      Script.load(bytecode, filename)
+    rescue SystemCallError, ArgumentError
+      nil
+    end
+
+    def write(path, bytecode)
+      tmp = "#{path}.#{Process.pid}.#{Thread.current.object_id}.tmp"
+      File.open(tmp, "wb") do |f|
+        f.write(MAGIC)
+        f.write(Digest::SHA256.digest(bytecode))
+        f.write(bytecode)
+      end
+      File.rename(tmp, path)
+    rescue SystemCallError
+      # The cache is only an optimization; carry on with the compiled script.
+      File.unlink(tmp) rescue nil
+    end
+  end
+end
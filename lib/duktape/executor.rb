@@ -0,0 +1,39 @@
+module Duktape
+  # An Executor runs calls on a fixed number of native threads, each owning
+  # the heap of its own context. Jobs are queued with #submit, which returns
+  # a Future for the result.
+  #
+  #     executor = Duktape::Executor.new(threads: 8, setup: ->(ctx) { ctx.exec_file("vendor/babel.js") })
+  #     futures = sources.map { |src| executor.submit(["babel", "transform"], src) }
+  #     results = futures.map(&:value)
+  #     executor.shutdown
+  #
+  # Arguments are encoded when a job is submitted and results are decoded
+  # when Future#value is called, both like with <code>marshal: :cbor</code>.
+  # Everything in between runs without Ruby, so the threads use all cores.
+  #
+  # Contexts are created from the Template or +options+ and passed to +setup+
+  # before the threads start. Since the workers can't call into Ruby, they
+  # must not define functions with Context#define_function or
+  # Context#define_object, and they can't be used from Ruby anymore.
+  #
+  # A worker which hits a fatal error stops. Call #shutdown when done; an
+  # executor which is garbage collected drops the jobs still in its queue.
+  class Executor
+    # The number of threads.
+    attr_reader :size
+
+    def initialize(threads:, setup: nil, template: nil, **options)
+      raise ArgumentError, "threads must be a positive Integer" unless threads.is_a?(Integer) && threads > 0
+      raise ArgumentError, "options can't be used with a template" if template && !options.empty?
+
+      @size = threads
+      contexts = Array.new(threads) do
+        ctx = template ? template.new_context : Context.new(**options)
+        setup.call(ctx) if setup
+        ctx
+      end
+      _start(contexts)
+    end
+  end
+end
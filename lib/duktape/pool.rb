@@ -0,0 +1,247 @@
+module Duktape
+  # A Pool hands out a bounded number of contexts to threads, so libraries
+  # only have to be loaded into a few contexts which are then reused. Since
+  # JavaScript runs without the GVL, a pool of N contexts can run N calls in
+  # parallel.
+  #
+  #     pool = Duktape::Pool.new(size: 4, setup: ->(ctx) { ctx.exec_file("vendor/babel.js") })
+  #     pool.with { |ctx| ctx.call_prop(["babel", "transform"], source) }
+  #
+  # Contexts are created when they are first needed, or up front with +min+.
+  # Pass a Template to create them from it instead of from +options+.
+  #
+  # With +reset+, contexts are replaced by fresh ones when they are checked
+  # in, so no state leaks between uses. It can also be a callable which
+  # cleans up the context instead; contexts for which it raises are replaced.
+  # Contexts which raised InternalError are always replaced.
+  #
+  # With +idle_timeout+, contexts which weren't used for that many seconds
+  # are closed when contexts are checked in or #evict_idle is called, keeping
+  # at least +min+ of them.
+  class Pool
+    # Raised when no context becomes available within the timeout.
+    class TimeoutError < StandardError; end
+
+    # The maximum number of contexts.
+    attr_reader :size
+
+    def initialize(size:, min: 0, setup: nil, template: nil, reset: false, timeout: nil, idle_timeout: nil, **options)
+      raise ArgumentError, "size must be a positive Integer" unless size.is_a?(Integer) && size > 0
+      raise ArgumentError, "min must be between 0 and size" unless min.is_a?(Integer) && (0..size).cover?(min)
+      raise ArgumentError, "options can't be used with a template" if template && !options.empty?
+
+      @size = size
+      @min = min
+      @setup = setup
+      @template = template
+      @reset = reset
+      @timeout = timeout
+      @idle_timeout = idle_timeout
+      @options = options
+
+      @mutex = Mutex.new
+      @available = ConditionVariable.new
+      @idle = [] # [ctx, checked in at], oldest first
+      @in_use = {}.compare_by_identity
+      @created = 0
+      @waiting = 0
+      @checkouts = 0
+      @timeouts = 0
+      @evicted = 0
+      @wait_time = 0.0
+      @max_wait_time = 0.0
+      @busy_time = 0.0
+      @started_at = now
+
+      min.times do
+        @idle << [create, now]
+        @created += 1
+      end
+    end
+
+    # call-seq:
+    #   with(timeout: nil) { |ctx| ... } -> obj
+    #
+    # Checks out a context, yields it and checks it in again. Returns the
+    # result of the block.
+    def with(timeout: @timeout)
+      ctx = checkout(timeout: timeout)
+      begin
+        yield ctx
+      rescue InternalError
+        discard(ctx)
+        ctx = nil
+        raise
+      ensure
+        checkin(ctx) if ctx
+      end
+    end
+
+    # call-seq:
+    #   checkout(timeout: nil) -> ctx
+    #
+    # Returns an idle context, or a new one if fewer than +size+ exist.
+    # Otherwise waits until a context is checked in, raising TimeoutError
+    # after +timeout+ seconds. Every context has to be passed to #checkin.
+    def checkout(timeout: @timeout)
+      started_at = now
+      ctx = reserve(timeout && started_at + timeout)
+
+      unless ctx
+        begin
+          ctx = create
+        rescue Exception
+          @mutex.synchronize do
+            @created -= 1
+            @available.signal
+          end
+          raise
+        end
+      end
+
+      @mutex.synchronize do
+        checked_out_at = now
+        wait_time = checked_out_at - started_at
+        @in_use[ctx] = checked_out_at
+        @checkouts += 1
+        @wait_time += wait_time
+        @max_wait_time = wait_time if wait_time > @max_wait_time
+      end
+
+      ctx
+    end
+
+    # call-seq:
+    #   checkin(ctx) -> nil
+    #
+    # Returns a context obtained from #checkout to the pool.
+    def checkin(ctx)
+      @mutex.synchronize do
+        checked_out_at = @in_use.delete(ctx)
+        raise ArgumentError, "context isn't checked out from this pool" unless checked_out_at
+        @busy_time += now - checked_out_at
+      end
+
+      keep = if @reset.respond_to?(:call)
+        begin
+          @reset.call(ctx)
+          true
+        rescue StandardError
+          false
+        end
+      else
+        !@reset
+      end
+
+      @mutex.synchronize do
+        if keep
+          @idle << [ctx, now]
+        else
+          @created -= 1
+        end
+        evict_idle_contexts
+        @available.signal
+      end
+
+      nil
+    end
+
+    # Closes the contexts which have been idle for longer than +idle_timeout+
+    # and returns how many were closed.
+    def evict_idle
+      @mutex.synchronize { evict_idle_contexts }
+    end
+
+    # Returns a Hash with the number of contexts (+created+, +idle+, +in_use+),
+    # the number of threads +waiting+ for one, counters for +checkouts+,
+    # +timeouts+ and +evicted+ contexts, the total and maximum time spent
+    # waiting for a context in seconds, and the +utilization+: the fraction
+    # of the pool's capacity that was checked out since it was created.
+    def stats
+      @mutex.synchronize do
+        time = now
+        busy_time = @in_use.values.inject(@busy_time) { |sum, at| sum + (time - at) }
+        uptime = time - @started_at
+
+        {
+          size: @size,
+          created: @created,
+          idle: @idle.size,
+          in_use: @in_use.size,
+          waiting: @waiting,
+          checkouts: @checkouts,
+          timeouts: @timeouts,
+          evicted: @evicted,
+          wait_time: @wait_time,
+          max_wait_time: @max_wait_time,
+          utilization: uptime > 0 ? busy_time / (uptime * @size) : 0.0,
+        }
+      end
+    end
+
+    private
+
+    def now
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+
+    # Takes the most recently used idle context, so the others can become
+    # idle long enough to be evicted. Returns nil when a new context should
+    # be created instead.
+    def reserve(deadline)
+      @mutex.synchronize do
+        loop do
+          entry = @idle.pop
+          return entry[0] if entry
+
+          if @created < @size
+            @created += 1
+            return nil
+          end
+
+          remaining = deadline && deadline - now
+          if remaining && remaining <= 0
+            @timeouts += 1
+            raise TimeoutError, "no context became available in time"
+          end
+
+          @waiting += 1
+          begin
+            @available.wait(@mutex, remaining)
+          ensure
+            @waiting -= 1
+          end
+        end
+      end
+    end
+
+    def discard(ctx)
+      @mutex.synchronize do
+        checked_out_at = @in_use.delete(ctx)
+        @busy_time += now - checked_out_at if checked_out_at
+        @created -= 1
+        @available.signal
+      end
+    end
+
+    def evict_idle_contexts
+      return 0 unless @idle_timeout
+
+      cutoff = now - @idle_timeout
+      count = 0
+      while @created > @min && !@idle.empty? && @idle.first[1] < cutoff
+        @idle.shift
+        @created -= 1
+        count += 1
+      end
+      @evicted += count
+      count
+    end
+
+    def create
+      ctx = @template ? @template.new_context : Context.new(**@options)
+      @setup.call(ctx) if @setup
+      ctx
+    end
+  end
+end
@@ -0,0 +1,74 @@
+module Duktape
+  # A Template records the steps needed to set up a context and builds fresh
+  # contexts from them. Sources are compiled to bytecode once, when they are
+  # added to the template, so every new context only has to run them.
+  #
+  #     template = Duktape::Template.new
+  #     template.exec_file("vendor/babel.js")
+  #     template.define_function("log") { |msg| puts msg }
+  #
+  #     ctx = template.new_context
+  #     ctx.call_prop(["babel", "transform"], source)
+  #
+  # Duktape can't snapshot a heap, and functions loaded from bytecode lose
+  # their closures, so the recorded scripts are run again for every context
+  # rather than copying the resulting globals.
+  class Template
+    # Options passed to Context.new for every new context.
+    attr_reader :options
+
+    def initialize(**options)
+      @options = options
+      @steps = []
+    end
+
+    # call-seq:
+    #   exec_string(string[, filename]) -> self
+    #
+    # Compile the source and run it in every new context.
+    def exec_string(source, filename = nil)
+      exec_script(Script.compile(source, filename))
+    end
+
+    # call-seq:
+    #   exec_file(path[, filename]) -> self
+    #
+    # Compile the file and run it in every new context.
+    def exec_file(path, filename = path.to_s)
+      exec_string(File.read(path, encoding: Encoding::UTF_8), filename)
+    end
+
+    # call-seq:
+    #   exec_script(script) -> self
+    #
+    # Run the Script in every new context.
+    def exec_script(script)
+      raise ::TypeError, "wrong argument type #{script.class} (expected Duktape::Script)" unless script.is_a?(Script)
+      @steps << [:exec_script, script]
+      self
+    end
+
+    # call-seq:
+    #   define_function(name, &block) -> self
+    #
+    # Define the function in every new context. See Context#define_function.
+    def define_function(name, &block)
+      raise ArgumentError, "Expected block" unless block
+      @steps << [:define_function, name.to_s, block]
+      self
+    end
+
+    # Returns a new Context with all the recorded steps applied.
+    def new_context
+      ctx = Context.new(**@options)
+      @steps.each do |method, *args|
+        if method == :define_function
+          ctx.define_function(args[0], &args[1])
+        else
+          ctx.public_send(method, *args)
+        end
+      end
+      ctx
+    end
+  end
+end
@@ -1,3 +1,3 @@
 module Duktape
-  VERSION = "2.7.0.0"
+  VERSION = "2.7.0.0".freeze
 end
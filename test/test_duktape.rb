@@ -3,7 +3,10 @@ $LOAD_PATH << (root + '/lib') << (root + '/ext/duktape')
 
 require 'minitest'
 require 'minitest/autorun'
+require 'minitest/mock'
 require 'duktape'
+require 'tmpdir'
+require 'pathname'
 
 class TestDuktape < Minitest::Spec
   def setup
@@ -70,6 +73,23 @@ class TestDuktape < Minitest::Spec
       assert_equal [1, [2, [3]]], @ctx.eval_string('[1, [2, [3]]]')
     end
 
+    def test_sparse_array
+      assert_equal [1, nil, 3], @ctx.eval_string('[1, , 3]')
+      assert_equal [1, nil, nil], @ctx.eval_string('var a = [1]; a.length = 3; a')
+      assert_equal [nil, nil, 2], @ctx.eval_string('var a = []; a[2] = 2; a')
+    end
+
+    def test_long_sparse_array
+      assert_equal [], @ctx.eval_string('var a = []; a.length = 1e8; a')
+      assert_equal [], @ctx.eval_string('var a = []; a.length = 4294967295; a')
+      assert_equal [1, nil, 3], @ctx.eval_string('var a = [1, , 3]; a.length = 1e8; a')
+    end
+
+    def test_large_array
+      ary = @ctx.eval_string('var a = []; for (var i = 0; i < 100000; i++) a.push(i); a')
+      assert_equal (0...100000).to_a, ary
+    end
+
     def test_object
       assert_equal({ "a" => 1, "b" => 2 }, @ctx.eval_string('({a: 1, b: 2})'))
       assert_equal({ "a" => 1, "b" => [2] }, @ctx.eval_string('({a: 1, b: [2]})'))
@@ -123,6 +143,105 @@ class TestDuktape < Minitest::Spec
     end
   end
 
+  describe "eval cache" do
+    def test_hits_and_misses
+      assert_equal({ size: 0, capacity: 64, hits: 0, misses: 0 }, @ctx.eval_cache_stats)
+      3.times { assert_equal 2, @ctx.eval_string('1 + 1') }
+      @ctx.eval_json('[1]')
+      assert_equal({ size: 2, capacity: 64, hits: 2, misses: 2 }, @ctx.eval_cache_stats)
+    end
+
+    def test_runs_every_time
+      @ctx.exec_string('var n = 0')
+      assert_equal 1, @ctx.eval_string('++n')
+      assert_equal 2, @ctx.eval_string('++n')
+      assert_equal [3], @ctx.eval_string('var a = []; a.push(++n); a')
+      assert_equal [4], @ctx.eval_string('var a = []; a.push(++n); a')
+    end
+
+    def test_fresh_closures
+      f1 = 'var fs = fs || []; fs.push(function() { return fs.length }); fs.length'
+      assert_equal 1, @ctx.eval_string(f1)
+      assert_equal 2, @ctx.eval_string(f1)
+      assert_equal false, @ctx.eval_string('fs[0] === fs[1]')
+    end
+
+    def test_filename
+      source = 'try { throw new Error("x") } catch (e) { e.fileName }'
+      assert_equal 'a.js', @ctx.eval_string(source, 'a.js')
+      assert_equal 'a.js', @ctx.eval_string(source, 'a.js')
+      assert_equal 'b.js', @ctx.eval_string(source, 'b.js')
+      assert_equal 'a.js', @ctx.eval_string(source, 'a.js')
+      assert_equal 'b.js', @ctx.eval_string(source, 'b.js')
+      assert_equal({ size: 2, capacity: 64, hits: 3, misses: 2 }, @ctx.eval_cache_stats)
+    end
+
+    def test_syntax_errors_are_not_cached
+      2.times { assert_raises(Duktape::SyntaxError) { @ctx.eval_string('1 +') } }
+      assert_equal 0, @ctx.eval_cache_stats[:size]
+    end
+
+    def test_least_recently_used
+      @ctx = Duktape::Context.new(eval_cache: 2)
+      @ctx.eval_string('1')
+      @ctx.eval_string('2')
+      @ctx.eval_string('1')
+      @ctx.eval_string('3') # evicts 2
+      @ctx.eval_string('1')
+      @ctx.eval_string('2')
+      assert_equal({ size: 2, capacity: 2, hits: 2, misses: 4 }, @ctx.eval_cache_stats)
+    end
+
+    def test_long_sources_are_not_cached
+      source = "1 + #{' ' * 5000}1"
+      2.times { assert_equal 2, @ctx.eval_string(source) }
+      assert_equal({ size: 0, capacity: 64, hits: 0, misses: 0 }, @ctx.eval_cache_stats)
+
+      @ctx = Duktape::Context.new(eval_cache_max_source: 8192)
+      2.times { assert_equal 2, @ctx.eval_string(source) }
+      assert_equal({ size: 1, capacity: 64, hits: 1, misses: 1 }, @ctx.eval_cache_stats)
+      assert_equal 2, @ctx.new_realm.eval_string(source)
+    end
+
+    def test_invalid_max_source
+      assert_raises(ArgumentError) { Duktape::Context.new(eval_cache_max_source: -1) }
+      assert_raises(TypeError) { Duktape::Context.new(eval_cache_max_source: 'a') }
+    end
+
+    def test_mutated_source
+      source = +'1 + 1'
+      assert_equal 2, @ctx.eval_string(source)
+      source.replace('2 + 2')
+      assert_equal 4, @ctx.eval_string(source)
+    end
+
+    def test_disabled
+      [0, false].each do |size|
+        @ctx = Duktape::Context.new(eval_cache: size)
+        2.times { assert_equal 2, @ctx.eval_string('1 + 1') }
+        assert_equal({ size: 0, capacity: 0, hits: 0, misses: 0 }, @ctx.eval_cache_stats)
+      end
+    end
+
+    def test_invalid_size
+      assert_raises(ArgumentError) { Duktape::Context.new(eval_cache: -1) }
+      assert_raises(TypeError) { Duktape::Context.new(eval_cache: 'a') }
+    end
+
+    def test_realm
+      @ctx.exec_string('var a = 1')
+      realm = @ctx.new_realm
+      realm.exec_string('var a = 2')
+      assert_equal 1, @ctx.eval_string('a')
+      assert_equal 2, realm.eval_string('a')
+      assert_equal 2, realm.eval_string('a')
+      assert_equal 1, realm.eval_cache_stats[:hits]
+      realm = nil
+      GC.start
+      assert_equal 1, @ctx.eval_string('a')
+    end
+  end
+
   describe "#exec_string" do
     def test_with_filename
       @ctx.exec_string('a = 1', __FILE__)
@@ -172,392 +291,2037 @@ class TestDuktape < Minitest::Spec
     end
   end
 
-  describe "#get_prop" do
-    def test_basic
-      @ctx.eval_string('a = 1')
-      assert_equal 1.0, @ctx.get_prop('a')
+  describe "Script" do
+    def test_compile
+      script = Duktape::Script.compile('a = 1', __FILE__)
+      assert_equal __FILE__, script.filename
+      assert_equal Encoding::BINARY, script.bytecode.encoding
+      assert script.bytecode.frozen?
     end
 
-    def test_nested
-      @ctx.eval_string('a = {}; a.b = {}; a.b.c = 1')
-      assert_equal 1.0, @ctx.get_prop(['a', 'b', 'c'])
+    def test_exec_script
+      script = Duktape::Script.compile('var a = 1; function inc(n) { return n + 1 }')
+      @ctx.exec_script(script)
+      assert_equal 1.0, @ctx.eval_string('a')
+      assert_equal 2.0, @ctx.call_prop('inc', 1)
     end
 
-    def test_nested_undefined
-      @ctx.eval_string('a = {}')
-      assert_nil @ctx.get_prop(['a', 'missing'])
+    def test_eval_script
+      script = Duktape::Script.compile('var a = 41; a + 1')
+      assert_equal 42.0, @ctx.eval_script(script)
     end
 
-    def test_missing
-      err = assert_raises(Duktape::ReferenceError) do
-        @ctx.get_prop('a')
+    def test_reuse_in_many_contexts
+      script = Duktape::Script.compile('var a = (typeof a === "number") ? a + 1 : 1')
+
+      3.times do
+        ctx = Duktape::Context.new
+        ctx.exec_script(script)
+        assert_equal 1.0, ctx.get_prop('a')
       end
 
-      assert_equal "identifier 'a' undefined", err.message
+      @ctx.exec_script(script)
+      @ctx.exec_script(script)
+      assert_equal 2.0, @ctx.get_prop('a')
     end
 
-    def test_nested_reference_error
-      err = assert_raises(Duktape::ReferenceError) do
-        @ctx.get_prop(['a', 'b'])
+    def test_filename_stacktrace
+      script = Duktape::Script.compile(<<-EOF, __FILE__)
+        function run() {
+          try {
+            throw new Error;
+          } catch (err) {
+            return err.stack.toString();
+          }
+        }
+
+        run();
+      EOF
+
+      assert_includes @ctx.eval_script(script), "#{__FILE__}:3"
+    end
+
+    def test_syntax_error
+      err = assert_raises(Duktape::SyntaxError) do
+        Duktape::Script.compile('{')
       end
 
-      assert_equal "identifier 'a' undefined", err.message
+      assert_equal "parse error (line 1, end of input)", err.message
     end
 
-    def test_nested_type_error
-      @ctx.eval_string('a = {};')
+    def test_throw_error
+      script = Duktape::Script.compile('throw new Error("boom")')
 
-      err = assert_raises(Duktape::TypeError) do
-        @ctx.get_prop(['a', 'b', 'c'])
+      err = assert_raises(Duktape::Error) do
+        @ctx.exec_script(script)
       end
 
-      assert_equal 'invalid base value', err.message
+      assert_equal "boom", err.message
     end
-  end
 
-  describe "#call_prop" do
-    before do
-      @ctx.eval_string('function id(a) { return a }')
+    def test_requires_script
+      assert_raises(TypeError) do
+        @ctx.exec_script('a = 1')
+      end
     end
 
-    def test_str
-      assert_equal 'Hei', @ctx.call_prop('id', 'Hei')
+    def test_rejects_invalid_bytecode
+      script = Duktape::Script.compile('a = 1')
+      script.instance_variable_set(:@bytecode, "garbage")
+
+      assert_raises(ArgumentError) do
+        @ctx.exec_script(script)
+      end
     end
 
-    def test_symbols
-      assert_equal "hello", @ctx.call_prop('id', :hello)
+    def test_cannot_be_instantiated
+      assert_raises(NoMethodError) do
+        Duktape::Script.new
+      end
     end
+  end
 
-    def test_fixnum
-      assert_equal 2.0, @ctx.call_prop('id', 2)
-      assert_equal 1507843033737.0, @ctx.call_prop('id', 1507843033737)
+  describe "#exec_file" do
+    def test_basic
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, "a.js")
+        File.write(path, "var a = 1")
+        @ctx.exec_file(path)
+        assert_equal 1.0, @ctx.get_prop('a')
+      end
     end
 
-    def test_float
-      assert_equal 2.0, @ctx.call_prop('id', 2.0)
+    def test_filename_defaults_to_path
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, "a.js")
+        File.write(path, "function run() { return new Error().stack }")
+        @ctx.exec_file(path)
+        assert_includes @ctx.call_prop('run'), "#{path}:1"
+      end
     end
 
-    def test_bignum
-      assert_equal 2**100, @ctx.call_prop('id', 2**100)
+    def test_missing_file
+      assert_raises(Errno::ENOENT) do
+        @ctx.exec_file("/nonexistent/file.js")
+      end
     end
 
-    def test_true
-      assert_equal true, @ctx.call_prop('id', true)
+    def test_filename
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, "a.js")
+        File.write(path, "function run() { return new Error().stack }")
+        @ctx.exec_file(path, "lib.js")
+        assert_includes @ctx.call_prop('run'), "lib.js:1"
+      end
     end
 
-    def test_false
-      assert_equal false, @ctx.call_prop('id', false)
+    def test_pathname
+      Dir.mktmpdir do |dir|
+        path = Pathname.new(dir) + "a.js"
+        path.write("var a = 1")
+        @ctx.exec_file(path)
+        assert_equal 1.0, @ctx.get_prop('a')
+      end
     end
 
-    def test_nil
-      assert_nil @ctx.call_prop('id', nil)
+    def test_empty_file
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, "a.js")
+        File.write(path, "")
+        assert_nil @ctx.exec_file(path)
+        assert_nil @ctx.exec_file("/dev/null")
+      end
     end
 
-    def test_arrays
-      assert_equal [1.0], @ctx.call_prop('id', [1])
-      assert_equal [['foo', [1.0]]], @ctx.call_prop('id', [['foo', [1]]])
+    def test_unicode
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, "a.js")
+        File.write(path, "var a = 'æ€😀'; var b = '😀'.length")
+        @ctx.exec_file(path)
+        assert_equal 'æ€😀', @ctx.get_prop('a')
+        assert_equal 2, @ctx.get_prop('b')
+      end
     end
 
-    def test_hashes
-      assert_equal({'hello' => 123}, @ctx.call_prop('id', {'hello' => 123}))
-      assert_equal({'hello' => [{'foo' => 123}]}, @ctx.call_prop('id', {'hello' => [{'foo' => 123}]}))
+    def test_invalid_utf8
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, "a.js")
+        ["var a = '\xff'", "var a = '\xed\xa0\x80'", "var a = '\xf0\x9f'"].each do |source|
+          File.binwrite(path, source)
+          assert_raises(EncodingError) { @ctx.exec_file(path) }
+        end
+        assert_equal 42, @ctx.eval_string('42')
+      end
     end
 
-    def test_hashes_with_symbol_key
-      assert_equal({'hello' => 123}, @ctx.call_prop('id', {:hello => 123}))
+    def test_syntax_error
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, "a.js")
+        File.write(path, "var a = ")
+        assert_raises(Duktape::SyntaxError) { @ctx.exec_file(path) }
+      end
     end
+  end
 
-    def test_hashes_with_complex_entries
-      assert_raises TypeError do
-        @ctx.call_prop('id', {:hello => Object.new})
+  describe "#eval_file" do
+    def test_basic
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, "a.js")
+        File.write(path, "var a = 1; ({a: a, b: [a + 1]})")
+        assert_equal({ 'a' => 1, 'b' => [2] }, @ctx.eval_file(path))
+        assert_equal 1, @ctx.get_prop('a')
       end
+    end
 
-      assert_raises TypeError do
-        @ctx.call_prop('id', {123 => "hello"})
+    def test_error
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, "a.js")
+        File.write(path, "null.foo")
+        err = assert_raises(Duktape::TypeError) { @ctx.eval_file(path, "lib.js") }
+        assert_includes err.message, "null"
       end
     end
 
-    def test_hashes_with_complex_values
-      res = @ctx.eval_string('({a:1,b:function(){}})')
-      assert_equal({'a' => 1}, res)
+    def test_missing_file
+      assert_raises(Errno::ENOENT) do
+        @ctx.eval_file("/nonexistent/file.js")
+      end
     end
+  end
 
-    def test_objects_with_prototypes
-      res = @ctx.eval_string <<-JS
-      function A() {
-        this.value = 123;
-        this.fn = function() {};
-      }
-      A.prototype.b = 456;
-      A.prototype.c = function() {};
-      new A;
-      JS
+  describe "BytecodeCache" do
+    before do
+      @dir = Dir.mktmpdir
+      @cache = Duktape::BytecodeCache.new(@dir)
+      @ctx = Duktape::Context.new(bytecode_cache: @cache)
+    end
 
-      assert_equal({'value' => 123}, res)
+    after do
+      FileUtils.remove_entry(@dir)
     end
 
-    def test_binding
-      @ctx.eval_string <<-JS
-        var self = this
-        function test() { return this === self }
-      JS
-      assert_equal true, @ctx.call_prop('test')
+    def entries
+      Dir[File.join(@dir, "*.bc")]
     end
 
-    def test_nested_property
-      @ctx.eval_string <<-JS
-        a = {}
-        a.b = {}
-        a.b.id = function(v) { return v; }
-      JS
-      assert_equal 'Hei', @ctx.call_prop(['a', 'b', 'id'], 'Hei')
+    def test_exec_string
+      @ctx.exec_string('var a = 1', 'a.js')
+      assert_equal 1.0, @ctx.get_prop('a')
+      assert_equal 1, entries.size
     end
 
-    def test_nested_binding
-      @ctx.eval_string <<-JS
-        a = {}
-        a.b = {}
-        a.b.test = function() { return this == a.b; }
-      JS
-      assert_equal true, @ctx.call_prop(['a', 'b', 'test'])
+    def test_exec_file
+      path = File.join(@dir, "a.js")
+      File.write(path, "var a = 1")
+      @ctx.exec_file(path)
+      assert_equal 1.0, @ctx.get_prop('a')
+      assert_equal 1, entries.size
     end
 
-    def test_throw_error
-      @ctx.eval_string('function fail(msg) { throw new Error(msg) }')
+    def test_reuses_entries_across_caches
+      @ctx.exec_string('var a = 1', 'a.js')
 
-      err = assert_raises(Duktape::Error) do
-        @ctx.call_prop('fail', 'boom')
+      cache = Duktape::BytecodeCache.new(@dir)
+      ctx = Duktape::Context.new(bytecode_cache: cache)
+
+      Duktape::Script.stub(:compile, ->(*) { flunk "should not compile" }) do
+        ctx.exec_string('var a = 1', 'a.js')
       end
+      assert_equal 1.0, ctx.get_prop('a')
+    end
 
-      assert_equal "boom", err.message
+    def test_key_includes_source_and_filename
+      @ctx.exec_string('var a = 1', 'a.js')
+      @ctx.exec_string('var a = 2', 'a.js')
+      @ctx.exec_string('var a = 2', 'b.js')
+      assert_equal 3, entries.size
     end
 
-    def test_reference_error
-      err = assert_raises(Duktape::ReferenceError) do
-        @ctx.call_prop('missing')
+    def test_keeps_filename
+      @ctx.exec_string('function run() { return new Error().stack }', 'a.js')
+      assert_includes @ctx.call_prop('run'), "a.js:1"
+    end
+
+    def test_recovers_from_corrupt_entries
+      @ctx.exec_string('var a = 1', 'a.js')
+      entries.each { |path| File.binwrite(path, File.binread(path).reverse) }
+
+      ctx = Duktape::Context.new(bytecode_cache: Duktape::BytecodeCache.new(@dir))
+      ctx.exec_string('var a = 1', 'a.js')
+      assert_equal 1.0, ctx.get_prop('a')
+    end
+
+    def test_recovers_from_truncated_entries
+      @ctx.exec_string('var a = 1', 'a.js')
+      entries.each { |path| File.binwrite(path, File.binread(path)[0, 10]) }
+
+      ctx = Duktape::Context.new(bytecode_cache: Duktape::BytecodeCache.new(@dir))
+      ctx.exec_string('var a = 1', 'a.js')
+      assert_equal 1.0, ctx.get_prop('a')
+    end
+
+    def test_syntax_error
+      assert_raises(Duktape::SyntaxError) do
+        @ctx.exec_string('{', 'a.js')
       end
+      assert_empty entries
+    end
 
-      assert_equal "identifier 'missing' undefined", err.message
+    def test_memory_lru
+      cache = Duktape::BytecodeCache.new(@dir, size: 2)
+      a = cache.fetch('var a = 1', 'a.js')
+      b = cache.fetch('var b = 1', 'b.js')
+      assert_same a, cache.fetch('var a = 1', 'a.js')
+
+      # b is the least recently used one
+      cache.fetch('var c = 1', 'c.js')
+      assert_same a, cache.fetch('var a = 1', 'a.js')
+      refute_same b, cache.fetch('var b = 1', 'b.js')
+      assert_equal 3, entries.size
+
+      cache = Duktape::BytecodeCache.new(@dir, size: 0)
+      refute_same cache.fetch('var a = 1', 'a.js'), cache.fetch('var a = 1', 'a.js')
+      assert_raises(ArgumentError) { Duktape::BytecodeCache.new(@dir, size: -1) }
     end
 
-    def test_nested_reference_error
-      err = assert_raises(Duktape::ReferenceError) do
-        @ctx.call_prop(['missing', 'foo'])
+    def test_prune
+      %w[a b c].each_with_index do |name, i|
+        @ctx.exec_string("var #{name} = 1", "#{name}.js")
+        entry = entries.max_by { |path| File.mtime(path) }
+        File.utime(Time.now - 100 + i, Time.now - 100 + i, entry)
       end
+      newest = entries.max_by { |path| File.mtime(path) }
 
-      assert_equal "identifier 'missing' undefined", err.message
+      assert_equal 0, @cache.prune(3)
+      assert_equal 2, @cache.prune(1)
+      assert_equal [newest], entries
+
+      # Entries read from disk count as used
+      oldest = entries.first
+      Duktape::BytecodeCache.new(@dir).fetch('var d = 1', 'd.js')
+      File.utime(Time.now - 1000, Time.now - 1000, oldest)
+      Duktape::BytecodeCache.new(@dir).fetch('var c = 1', 'c.js')
+      assert_equal 1, @cache.prune(1)
+      assert_equal [oldest], entries
+
+      assert_equal 1, @cache.prune(0)
+      assert_empty entries
+    end
+
+    def test_clear
+      @ctx.exec_string('var a = 1', 'a.js')
+      @cache.clear
+      assert_empty entries
+    end
+  end
+
+  describe "Template" do
+    before do
+      @template = Duktape::Template.new
+    end
+
+    def test_exec_string
+      @template.exec_string('var a = 1; function inc(n) { return n + 1 }')
+      ctx = @template.new_context
+      assert_equal 1.0, ctx.get_prop('a')
+      assert_equal 2.0, ctx.call_prop('inc', 1)
+    end
+
+    def test_contexts_are_isolated
+      @template.exec_string('var a = 1')
+      one = @template.new_context
+      two = @template.new_context
+
+      one.exec_string('a = 2')
+      assert_equal 2.0, one.get_prop('a')
+      assert_equal 1.0, two.get_prop('a')
+    end
+
+    def test_compiles_once
+      @template.exec_string('var a = 1')
+
+      Duktape::Script.stub(:compile, ->(*) { flunk "should not compile" }) do
+        3.times { assert_equal 1.0, @template.new_context.get_prop('a') }
+      end
+    end
+
+    def test_syntax_error
+      assert_raises(Duktape::SyntaxError) do
+        @template.exec_string('{')
+      end
+    end
+
+    def test_exec_script
+      @template.exec_script(Duktape::Script.compile('var a = 1'))
+      assert_equal 1.0, @template.new_context.get_prop('a')
+
+      assert_raises(TypeError) do
+        @template.exec_script('var a = 1')
+      end
+    end
+
+    def test_exec_file
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, "a.js")
+        File.write(path, "function run() { return new Error().stack }")
+        @template.exec_file(path)
+        assert_includes @template.new_context.call_prop('run'), "#{path}:1"
+      end
+    end
+
+    def test_define_function
+      @template.define_function("square") { |x| x * x }
+      @template.exec_string('var a = square(3)')
+      assert_equal 9.0, @template.new_context.get_prop('a')
+    end
+
+    def test_options
+      template = Duktape::Template.new(complex_object: false)
+      assert_equal false, template.new_context.eval_string('(function() {})')
+    end
+
+    def test_babel
+      @template.exec_file(File.expand_path("../fixtures/babel.js", __FILE__), "(execjs)")
+      ctx = @template.new_context
+      assert_equal 64, ctx.call_prop(["babel", "eval"], "((x) => x * x)(8)")
+    end
+  end
+
+  describe "#new_realm" do
+    def test_globals_are_isolated
+      @ctx.exec_string('var a = 1')
+      realm = @ctx.new_realm
+
+      assert_equal 'undefined', realm.eval_string('typeof a')
+      realm.exec_string('var a = 2; var b = 3')
+      assert_equal 1.0, @ctx.get_prop('a')
+      assert_equal 2.0, realm.get_prop('a')
+      assert_equal 'undefined', @ctx.eval_string('typeof b')
+    end
+
+    def test_builtins_are_isolated
+      realm = @ctx.new_realm
+      realm.exec_string('Array.prototype.first = function() { return this[0] }')
+
+      assert_equal 1.0, realm.eval_string('[1, 2].first()')
+      assert_equal 'undefined', @ctx.eval_string('typeof [].first')
+      assert_equal 'undefined', @ctx.new_realm.eval_string('typeof [].first')
+    end
+
+    def test_no_require
+      assert_equal 'undefined', @ctx.new_realm.eval_string('typeof require')
+    end
+
+    def test_define_function
+      realm = @ctx.new_realm
+      realm.define_function("square") { |x| x * x }
+
+      assert_equal 9.0, realm.eval_string('square(3)')
+      assert_equal 'undefined', @ctx.eval_string('typeof square')
+    end
+
+    def test_exec_script
+      script = Duktape::Script.compile('var a = 1')
+      realm = @ctx.new_realm
+      realm.exec_script(script)
+      assert_equal 1.0, realm.get_prop('a')
+    end
+
+    def test_options
+      ctx = Duktape::Context.new(complex_object: false)
+      assert_equal false, ctx.new_realm.eval_string('(function() {})')
+    end
+
+    def test_nested
+      realm = @ctx.new_realm.new_realm
+      realm.exec_string('var a = 1')
+      assert_equal 1.0, realm.get_prop('a')
+    end
+
+    def test_call_from_parent
+      realm = @ctx.new_realm
+      realm.exec_string('var a = 1')
+      @ctx.define_function("realm_a") { realm.get_prop('a') }
+
+      assert_equal 2.0, @ctx.eval_string('realm_a() + 1')
+    end
+
+    def test_outlives_parent
+      realm = Duktape::Context.new.new_realm
+      GC.start
+      realm.exec_string('var a = [1, 2, 3]')
+      assert_equal [1.0, 2.0, 3.0], realm.get_prop('a')
+    end
+
+    def test_many_realms
+      100.times do |i|
+        realm = @ctx.new_realm
+        realm.exec_string("var a = #{i}")
+        assert_equal i.to_f, realm.get_prop('a')
+      end
+      GC.start
+      assert_equal 'undefined', @ctx.new_realm.eval_string('typeof a')
+    end
+  end
+
+  describe "#eval_json" do
+    def test_object
+      assert_equal '{"a":[1,2.5,"b",null,true]}', @ctx.eval_json('({a: [1, 2.5, "b", null, true]})')
+    end
+
+    def test_encoding
+      json = @ctx.eval_json('["\u00e9\ud83d\ude04"]')
+      assert_equal "[\"\u00e9\u{1f604}\"]", json
+      assert_equal Encoding::UTF_8, json.encoding
+    end
+
+    def test_not_serializable
+      assert_nil @ctx.eval_json('undefined')
+      assert_nil @ctx.eval_json('(function() {})')
+    end
+
+    def test_cyclic
+      assert_raises(Duktape::TypeError) do
+        @ctx.eval_json('var a = {}; a.a = a; a')
+      end
+    end
+
+    def test_with_filename
+      assert_equal '1', @ctx.eval_json('1', __FILE__)
+    end
+
+    def test_error
+      assert_raises(Duktape::ReferenceError) do
+        @ctx.eval_json('fail')
+      end
+    end
+  end
+
+  describe "#call_prop_json" do
+    def test_call
+      @ctx.exec_string('function pair(a, b) { return {a: a, b: b} }')
+      assert_equal '{"a":1,"b":"x"}', @ctx.call_prop_json('pair', 1, 'x')
+      assert_equal '["a","b"]', @ctx.call_prop_json(['Object', 'keys'], a: 1, b: 2)
+    end
+
+    def test_error
+      @ctx.exec_string('function fail() { throw new RangeError("boom") }')
+      assert_raises(Duktape::RangeError) do
+        @ctx.call_prop_json('fail')
+      end
+    end
+  end
+
+  describe "#call_prop_many" do
+    def test_call
+      assert_equal [8, 1024], @ctx.call_prop_many(['Math', 'pow'], [[2, 3], [2, 10]])
+      assert_equal [1, 2, 3], @ctx.call_prop_many('parseInt', ['1', '2', '3'])
+      @ctx.exec_string('function list() { return Array.prototype.slice.call(arguments) }')
+      assert_equal [[1, 2], [], [[3]]], @ctx.call_prop_many('list', [[1, 2], [], [[3]]])
+      assert_equal [], @ctx.call_prop_many('parseInt', [])
+    end
+
+    def test_receiver
+      @ctx.exec_string('var counter = { n: 0, add: function(x) { return this.n += x } }')
+      assert_equal [1, 3, 6], @ctx.call_prop_many(['counter', 'add'], [1, 2, 3])
+    end
+
+    def test_cbor
+      ctx = Duktape::Context.new(marshal: :cbor)
+      ctx.exec_string('function pair(a, b) { return {a: a, b: b} }')
+      assert_equal [{ 'a' => 1, 'b' => 'x' }, { 'a' => [2], 'b' => nil }],
+        ctx.call_prop_many('pair', [[1, 'x'], [[2], nil]])
+    end
+
+    def test_error
+      @ctx.exec_string('var calls = 0; function check(x) { calls++; if (x < 0) throw new RangeError("negative " + x); return x }')
+      err = assert_raises(Duktape::RangeError) do
+        @ctx.call_prop_many('check', [1, -2, 3, -4])
+      end
+      assert_equal "negative -2", err.message
+      assert_equal 2, @ctx.get_prop('calls')
+
+      results = @ctx.call_prop_many('check', [1, -2, 3, -4], exception: false)
+      assert_equal 6, @ctx.get_prop('calls')
+      assert_equal [1, 3], results.values_at(0, 2)
+      assert_kind_of Duktape::RangeError, results[1]
+      assert_equal "negative -4", results[3].message
+
+      assert_raises(Duktape::ReferenceError) { @ctx.call_prop_many('missing', [[]]) }
+      assert_raises(TypeError) { @ctx.call_prop_many('check', 1) }
+    end
+
+    def test_conversion_errors
+      ctx = Duktape::Context.new(max_depth: 3)
+      ctx.exec_string('function nest(n) { var v = 1; while (n--) v = [v]; return v }')
+      results = ctx.call_prop_many('nest', [1, 5, 2, [[[[[1]]]]], 0], exception: false)
+      assert_equal [[1], [[1]], 1], results.values_at(0, 2, 4)
+      assert_kind_of Duktape::RangeError, results[1]
+      assert_kind_of Duktape::RangeError, results[3]
+      assert ctx._valid?
+
+      assert_raises(Duktape::RangeError) { ctx.call_prop_many('nest', [1, 5, 2]) }
+
+      ctx.exec_string('function sym() { return Symbol("x") }')
+      results = ctx.call_prop_many('sym', [[]], exception: false)
+      assert_kind_of EncodingError, results[0]
+    end
+
+    def test_ruby_exception
+      @ctx.define_function('fail') { |x| raise ArgumentError, "bad #{x}" }
+      results = @ctx.call_prop_many('fail', ['x'], exception: false)
+      assert_kind_of ArgumentError, results[0]
+      assert_equal "bad x", results[0].message
+    end
+  end
+
+  describe "RawJSON" do
+    def test_argument
+      @ctx.exec_string('function sum(obj) { return obj.a[0] + obj.a[1] }')
+      assert_equal 3.0, @ctx.call_prop('sum', Duktape::RawJSON.new('{"a": [1, 2]}'))
+    end
+
+    def test_nested
+      @ctx.exec_string('function id(obj) { return obj }')
+      raw = Duktape::RawJSON.new('{"b": "\u00e9"}')
+      assert_equal({ 'a' => [{ 'b' => 'é' }] }, @ctx.call_prop('id', a: [raw]))
+      assert_equal '{"a":{"b":"é"}}', @ctx.call_prop_json('id', a: raw)
+    end
+
+    def test_to_s
+      raw = Duktape::RawJSON.new('[1]')
+      assert_equal '[1]', raw.to_s
+      assert raw.json.frozen?
+    end
+
+    def test_requires_string
+      assert_raises(TypeError) do
+        Duktape::RawJSON.new(123)
+      end
+    end
+
+    def test_invalid_json
+      @ctx.exec_string('function id(obj) { return obj }')
+      assert_raises(Duktape::SyntaxError) do
+        @ctx.call_prop('id', Duktape::RawJSON.new('{'))
+      end
+    end
+  end
+
+  describe "#get_prop" do
+    def test_basic
+      @ctx.eval_string('a = 1')
+      assert_equal 1.0, @ctx.get_prop('a')
+    end
+
+    def test_nested
+      @ctx.eval_string('a = {}; a.b = {}; a.b.c = 1')
+      assert_equal 1.0, @ctx.get_prop(['a', 'b', 'c'])
+    end
+
+    def test_nested_undefined
+      @ctx.eval_string('a = {}')
+      assert_nil @ctx.get_prop(['a', 'missing'])
+    end
+
+    def test_missing
+      err = assert_raises(Duktape::ReferenceError) do
+        @ctx.get_prop('a')
+      end
+
+      assert_equal "identifier 'a' undefined", err.message
+    end
+
+    def test_nested_reference_error
+      err = assert_raises(Duktape::ReferenceError) do
+        @ctx.get_prop(['a', 'b'])
+      end
+
+      assert_equal "identifier 'a' undefined", err.message
+    end
+
+    def test_nested_type_error
+      @ctx.eval_string('a = {};')
+
+      err = assert_raises(Duktape::TypeError) do
+        @ctx.get_prop(['a', 'b', 'c'])
+      end
+
+      assert_equal 'invalid base value', err.message
+    end
+  end
+
+  describe "#call_prop" do
+    before do
+      @ctx.eval_string('function id(a) { return a }')
+    end
+
+    def test_str
+      assert_equal 'Hei', @ctx.call_prop('id', 'Hei')
+    end
+
+    def test_symbols
+      assert_equal "hello", @ctx.call_prop('id', :hello)
+    end
+
+    def test_fixnum
+      assert_equal 2.0, @ctx.call_prop('id', 2)
+      assert_equal 1507843033737.0, @ctx.call_prop('id', 1507843033737)
+    end
+
+    def test_float
+      assert_equal 2.0, @ctx.call_prop('id', 2.0)
+    end
+
+    def test_bignum
+      assert_equal 2**100, @ctx.call_prop('id', 2**100)
+    end
+
+    def test_true
+      assert_equal true, @ctx.call_prop('id', true)
+    end
+
+    def test_false
+      assert_equal false, @ctx.call_prop('id', false)
+    end
+
+    def test_nil
+      assert_nil @ctx.call_prop('id', nil)
+    end
+
+    def test_arrays
+      assert_equal [1.0], @ctx.call_prop('id', [1])
+      assert_equal [['foo', [1.0]]], @ctx.call_prop('id', [['foo', [1]]])
+    end
+
+    def test_hashes
+      assert_equal({'hello' => 123}, @ctx.call_prop('id', {'hello' => 123}))
+      assert_equal({'hello' => [{'foo' => 123}]}, @ctx.call_prop('id', {'hello' => [{'foo' => 123}]}))
+    end
+
+    def test_hashes_with_symbol_key
+      assert_equal({'hello' => 123}, @ctx.call_prop('id', {:hello => 123}))
+    end
+
+    def test_hashes_with_complex_entries
+      assert_raises TypeError do
+        @ctx.call_prop('id', {:hello => Object.new})
+      end
+
+      assert_raises TypeError do
+        @ctx.call_prop('id', {123 => "hello"})
+      end
+    end
+
+    def test_hashes_with_complex_values
+      res = @ctx.eval_string('({a:1,b:function(){}})')
+      assert_equal({'a' => 1}, res)
+    end
+
+    def test_objects_with_prototypes
+      res = @ctx.eval_string <<-JS
+      function A() {
+        this.value = 123;
+        this.fn = function() {};
+      }
+      A.prototype.b = 456;
+      A.prototype.c = function() {};
+      new A;
+      JS
+
+      assert_equal({'value' => 123}, res)
+    end
+
+    def test_binding
+      @ctx.eval_string <<-JS
+        var self = this
+        function test() { return this === self }
+      JS
+      assert_equal true, @ctx.call_prop('test')
+    end
+
+    def test_nested_property
+      @ctx.eval_string <<-JS
+        a = {}
+        a.b = {}
+        a.b.id = function(v) { return v; }
+      JS
+      assert_equal 'Hei', @ctx.call_prop(['a', 'b', 'id'], 'Hei')
+    end
+
+    def test_nested_binding
+      @ctx.eval_string <<-JS
+        a = {}
+        a.b = {}
+        a.b.test = function() { return this == a.b; }
+      JS
+      assert_equal true, @ctx.call_prop(['a', 'b', 'test'])
+    end
+
+    def test_throw_error
+      @ctx.eval_string('function fail(msg) { throw new Error(msg) }')
+
+      err = assert_raises(Duktape::Error) do
+        @ctx.call_prop('fail', 'boom')
+      end
+
+      assert_equal "boom", err.message
+    end
+
+    def test_reference_error
+      err = assert_raises(Duktape::ReferenceError) do
+        @ctx.call_prop('missing')
+      end
+
+      assert_equal "identifier 'missing' undefined", err.message
+    end
+
+    def test_nested_reference_error
+      err = assert_raises(Duktape::ReferenceError) do
+        @ctx.call_prop(['missing', 'foo'])
+      end
+
+      assert_equal "identifier 'missing' undefined", err.message
+    end
+
+    def test_nested_type_error
+      @ctx.eval_string 'a = {}'
+
+      err = assert_raises(Duktape::TypeError) do
+        @ctx.call_prop(['a', 'missing'])
+      end
+
+      assert_equal 'undefined not callable', err.message
+    end
+
+    def test_unknown_argument_type
+      err = assert_raises(TypeError) do
+        @ctx.call_prop('id', Object.new)
+      end
+      assert_match /Object/, err.message
+
+      assert_raises(TypeError) do
+        @ctx.call_prop('id', [Object.new])
+      end
+
+      assert_raises(TypeError) do
+        @ctx.call_prop('id', {123 => Object.new})
+      end
+
+      assert_raises(TypeError) do
+        @ctx.call_prop('id', {'key' => Object.new})
+      end
+    end
+  end
+
+  describe "#function" do
+    def test_call
+      @ctx.exec_string('function add(a, b) { return a + b }')
+      add = @ctx.function('add')
+
+      assert_kind_of Duktape::Function, add
+      assert_same @ctx, add.context
+      assert_equal 3.0, add.call(1, 2)
+      assert_equal 'ab', add.call('a', 'b')
+    end
+
+    def test_nested
+      pow = @ctx.function(['Math', 'pow'])
+      assert_equal 1024.0, pow.call(2, 10)
+    end
+
+    def test_receiver
+      @ctx.exec_string('var obj = { n: 1, inc: function() { return ++this.n } }')
+      inc = @ctx.function(['obj', 'inc'])
+
+      inc.call
+      assert_equal 3.0, inc.call
+      assert_equal 3.0, @ctx.get_prop(['obj', 'n'])
+    end
+
+    def test_resolved_once
+      @ctx.exec_string('function f() { return 1 }')
+      f = @ctx.function('f')
+      @ctx.exec_string('f = function() { return 2 }')
+
+      assert_equal 1.0, f.call
+    end
+
+    def test_outlives_property
+      @ctx.exec_string('var obj = { f: function(x) { return [x] } }')
+      f = @ctx.function(['obj', 'f'])
+      @ctx.exec_string('delete obj.f; delete this.obj')
+      GC.start
+
+      assert_equal [{ 'a' => 1.0 }], f.call(a: 1)
+    end
+
+    def test_missing
+      assert_raises(Duktape::ReferenceError) do
+        @ctx.function('missing')
+      end
+
+      assert_raises(Duktape::TypeError) do
+        @ctx.function(['Math', 'missing', 'f'])
+      end
+    end
+
+    def test_not_a_function
+      @ctx.exec_string('var a = 1')
+      err = assert_raises(Duktape::TypeError) do
+        @ctx.function('a')
+      end
+      assert_equal 'not a function', err.message
+    end
+
+    def test_error
+      @ctx.exec_string('function fail() { throw new RangeError("boom") }')
+      fail = @ctx.function('fail')
+
+      err = assert_raises(Duktape::RangeError) do
+        fail.call
+      end
+      assert_equal 'boom', err.message
+      assert_equal 'boom', assert_raises(Duktape::RangeError) { fail.call }.message
+    end
+
+    def test_cannot_be_instantiated
+      assert_raises(NoMethodError) do
+        Duktape::Function.new
+      end
+    end
+
+    def test_realm
+      realm = @ctx.new_realm
+      realm.exec_string('var a = 1; function get() { return a }')
+      get = realm.function('get')
+      realm = nil
+      GC.start
+
+      assert_equal 1.0, get.call
+    end
+
+    def test_many_functions
+      @ctx.exec_string('function f(x) { return x }')
+      100.times do |i|
+        assert_equal i.to_f, @ctx.function('f').call(i)
+      end
+      GC.start
+      assert_equal 1.0, @ctx.function('f').call(1)
+    end
+  end
+
+  describe "ObjectRef" do
+    def setup
+      super
+      @ctx.exec_string <<-JS
+        var cfg = {
+          port: 8080,
+          servers: [{ host: 'a.example' }, { host: 'b.example' }],
+          empty: null,
+          counter: { n: 1, inc: function() { return ++this.n } }
+        };
+      JS
+    end
+
+    def test_primitives_are_converted
+      assert_equal 8080, @ctx.get_prop(['cfg', 'port'], lazy: true)
+      assert_nil @ctx.get_prop(['cfg', 'empty'], lazy: true)
+      assert_equal({ 'host' => 'a.example' }, @ctx.get_prop(['cfg', 'servers', '0'], lazy: false))
+    end
+
+    def test_aref
+      cfg = @ctx.get_prop('cfg', lazy: true)
+      assert_kind_of Duktape::ObjectRef, cfg
+      assert_same @ctx, cfg.context
+
+      assert_equal 8080, cfg['port']
+      assert_equal 8080, cfg[:port]
+      assert_nil cfg['missing']
+
+      servers = cfg['servers']
+      assert_kind_of Duktape::ObjectRef, servers
+      assert servers.array?
+      assert_equal 'b.example', servers[1]['host']
+      assert_nil servers[2]
+    end
+
+    def test_aref_invalid_key
+      assert_raises(TypeError) do
+        @ctx.get_prop('cfg', lazy: true)[1.5]
+      end
+    end
+
+    def test_dig
+      cfg = @ctx.get_prop('cfg', lazy: true)
+      assert_equal 'a.example', cfg.dig('servers', 0, 'host')
+      assert_nil cfg.dig('empty', 'host')
+      assert_nil cfg.dig('missing', 'a', 'b')
+      assert_equal 9.0, cfg.dig('servers', 1, 'host', 'length')
+      assert_raises(ArgumentError) { cfg.dig }
+    end
+
+    def test_each_object
+      pairs = @ctx.get_prop('cfg', lazy: true).map { |k, v| [k, v.class] }
+      assert_equal [['port', Float], ['servers', Duktape::ObjectRef], ['empty', NilClass], ['counter', Duktape::ObjectRef]], pairs
+      assert_equal ['port', 'servers', 'empty', 'counter'], @ctx.get_prop('cfg', lazy: true).keys
+    end
+
+    def test_each_array
+      servers = @ctx.get_prop(['cfg', 'servers'], lazy: true)
+      assert_equal ['a.example', 'b.example'], servers.map { |s| s['host'] }
+      assert_kind_of Enumerator, servers.each
+    end
+
+    def test_each_can_use_context
+      hosts = []
+      @ctx.get_prop(['cfg', 'servers'], lazy: true).each do |server|
+        @ctx.eval_string('1 + 1')
+        hosts << server['host']
+      end
+      assert_equal ['a.example', 'b.example'], hosts
+    end
+
+    def test_to_h
+      counter = @ctx.get_prop(['cfg', 'counter'], lazy: true)
+      assert_equal({ 'n' => 1 }, counter.to_h)
+
+      assert_raises(TypeError) { @ctx.get_prop(['cfg', 'servers'], lazy: true).to_h }
+      assert_raises(TypeError) { counter['inc'].to_h }
+    end
+
+    def test_keeps_functions
+      counter = @ctx.get_prop(['cfg', 'counter'], lazy: true)
+      inc = counter['inc']
+
+      assert inc.function?
+      refute counter.function?
+      assert_equal 2.0, inc.call
+      assert_equal 3.0, counter.dig('inc').call
+      assert_equal 3.0, counter['n']
+    end
+
+    def test_keeps_class_instances
+      @ctx.exec_string <<-JS
+        function Point(x, y) { this.x = x; this.y = y }
+        Point.prototype.norm = function() { return Math.sqrt(this.x * this.x + this.y * this.y) }
+        var p = new Point(3, 4);
+      JS
+
+      point = @ctx.get_prop('p', lazy: true)
+      assert_equal 5.0, point['norm'].call
+      assert_equal ['x', 'y'], point.keys
+    end
+
+    def test_call_not_a_function
+      err = assert_raises(Duktape::TypeError) do
+        @ctx.get_prop('cfg', lazy: true).call
+      end
+      assert_equal 'not a function', err.message
+    end
+
+    def test_pass_back_to_javascript
+      @ctx.exec_string('function hosts(servers) { return servers.map(function(s) { return s.host }) }')
+      servers = @ctx.get_prop(['cfg', 'servers'], lazy: true)
+
+      assert_equal ['a.example', 'b.example'], @ctx.call_prop('hosts', servers)
+      assert_equal true, @ctx.call_prop(['Array', 'isArray'], servers)
+    end
+
+    def test_pass_function_back_to_javascript
+      @ctx.exec_string('function apply(f, x) { return f(x) }')
+      assert_equal 3.0, @ctx.call_prop('apply', @ctx.function(['Math', 'abs']), -3)
+    end
+
+    def test_pass_to_other_heap
+      ref = @ctx.get_prop('cfg', lazy: true)
+      other = Duktape::Context.new
+      other.exec_string('function id(x) { return x }')
+
+      assert_raises(TypeError) do
+        other.call_prop('id', ref)
+      end
+      assert_equal 1, other.call_prop('id', 1)
+    end
+
+    def test_realm_shares_heap
+      realm = @ctx.new_realm
+      realm.exec_string('function port(cfg) { return cfg.port }')
+      assert_equal 8080, realm.call_prop('port', @ctx.get_prop('cfg', lazy: true))
+    end
+
+    def test_outlives_property
+      servers = @ctx.get_prop(['cfg', 'servers'], lazy: true)
+      @ctx.exec_string('delete this.cfg')
+      GC.start
+
+      assert_equal 'b.example', servers.dig(1, 'host')
+    end
+
+    def test_cannot_be_instantiated
+      assert_raises(NoMethodError) do
+        Duktape::ObjectRef.new
+      end
+    end
+
+    def test_cbor
+      @ctx = Duktape::Context.new(marshal: :cbor)
+      @ctx.exec_string('var cfg = { servers: [{ host: "a" }] }; function first(s) { return s[0] }')
+      servers = @ctx.get_prop(['cfg', 'servers'], lazy: true)
+
+      assert_equal({ 'host' => 'a' }, @ctx.call_prop('first', servers))
+      assert_equal({ 'servers' => [{ 'host' => 'a' }] }, @ctx.get_prop('cfg', lazy: true).to_h)
+    end
+  end
+
+  describe "#pin" do
+    def setup
+      super
+      @ctx.exec_string <<-JS
+        function get(obj, key) { return obj[key] }
+        function same(a, b) { return a === b }
+        function bump(obj) { return ++obj.n }
+        function id(x) { return x }
+      JS
+    end
+
+    def test_pass_handle
+      options = @ctx.pin(a: 1, list: [1, 2])
+      assert_kind_of Duktape::Handle, options
+      assert_same @ctx, options.context
+
+      assert_equal 1, @ctx.call_prop('get', options, 'a')
+      assert_equal [1, 2], @ctx.call_prop('get', options, 'list')
+      assert_equal({ 'a' => 1, 'list' => [1, 2] }, @ctx.call_prop('id', options))
+    end
+
+    def test_same_object
+      options = @ctx.pin(n: 0)
+      assert_equal true, @ctx.call_prop('same', options, options)
+      assert_equal 1, @ctx.call_prop('bump', options)
+      assert_equal 2, @ctx.call_prop('bump', options)
+    end
+
+    def test_nested
+      options = @ctx.pin(n: 1)
+      assert_equal({ 'n' => 1 }, @ctx.call_prop('get', { opts: options }, 'opts'))
+      assert_equal [{ 'n' => 1 }], @ctx.call_prop('id', [options])
+    end
+
+    def test_primitives
+      assert_equal 'str', @ctx.call_prop('id', @ctx.pin('str'))
+      assert_equal 42, @ctx.call_prop('id', @ctx.pin(42))
+      assert_nil @ctx.call_prop('id', @ctx.pin(nil))
+    end
+
+    def test_release
+      options = @ctx.pin(a: 1)
+      refute options.released?
+      assert_nil options.release
+      assert options.released?
+      options.release
+
+      err = assert_raises(ArgumentError) do
+        @ctx.call_prop('id', options)
+      end
+      assert_equal 'Duktape::Handle has been released', err.message
+    end
+
+    def test_released_by_gc
+      100.times { @ctx.pin(a: 'x' * 100) }
+      GC.start
+      assert_equal 1, @ctx.call_prop('get', @ctx.pin(a: 1), 'a')
+    end
+
+    def test_outlives_context_reference
+      handle = Duktape::Context.new.pin([1, 2])
+      GC.start
+      ctx = handle.context
+      ctx.exec_string('function id(x) { return x }')
+      assert_equal [1, 2], ctx.call_prop('id', handle)
+    end
+
+    def test_other_heap
+      handle = Duktape::Context.new.pin([1])
+      assert_raises(TypeError) { @ctx.call_prop('id', handle) }
+    end
+
+    def test_realm
+      realm = @ctx.new_realm
+      realm.exec_string('function id(x) { return x }')
+      assert_equal [1], realm.call_prop('id', @ctx.pin([1]))
+    end
+
+    def test_cbor
+      @ctx = Duktape::Context.new(marshal: :cbor)
+      @ctx.exec_string('function get(obj, key) { return obj[key] }')
+      assert_equal [1], @ctx.call_prop('get', @ctx.pin(a: [1]), 'a')
+    end
+
+    def test_cannot_be_instantiated
+      assert_raises(NoMethodError) { Duktape::Handle.new }
+    end
+  end
+
+  describe "#define_function" do
+    def test_require_name
+      err = assert_raises(ArgumentError) do
+        @ctx.define_function
+      end
+    end
+
+    def test_require_block
+      err = assert_raises(ArgumentError) do
+        @ctx.define_function("hello")
+      end
+    end
+
+    def test_initial_definition
+      @ctx.define_function "hello" do |a, b|
+        a + b
+      end
+      assert_equal 3, @ctx.eval_string("hello(1, 2)", __FILE__)
+    end
+
+    def test_without_arguments
+      @ctx.define_function("hello") { 'hello' }
+      assert_equal "hello world", @ctx.eval_string("hello() + ' world'", __FILE__)
+    end
+
+    def test_with_arguments
+      @ctx.define_function("square") { |x| x * x }
+      assert_equal 4, @ctx.eval_string("square(2)", __FILE__)
+    end
+
+    def test_with_2_functions
+      @ctx.define_function("square") { |x| x * x }
+      @ctx.define_function("inc") { |x| x + 1 }
+      assert_equal 5, @ctx.eval_string("inc(square(2))", __FILE__)
+    end
+
+    def test_call_prop
+      @ctx.define_function("square") { |x| x * x }
+      @ctx.define_function("inc") { |x| x + 1 }
+      @ctx.eval_string('function math(a) { return square(inc(a)) }')
+      assert_equal 9, @ctx.call_prop('math', 2)
+    end
+
+    def test_respects_complex_object
+      val = :default
+      @ctx.define_function("t") { |v| val = v; nil }
+      @ctx.exec_string("t(function() { })", __FILE__)
+
+      assert_equal @ctx.complex_object, val
+    end
+
+    def test_respects_custom_complex_object
+      @ctx = Duktape::Context.new(complex_object: nil)
+
+      val = :default
+      @ctx.define_function("t") { |v| val = v; nil }
+      @ctx.exec_string("t(function() { })", __FILE__)
+
+      assert_nil val
+    end
+
+    def test_no_visible_properties
+      @ctx.define_function("hello") { 'hello' }
+      assert_equal [], @ctx.eval_string("Object.getOwnPropertyNames(hello).filter(function(k) { return k != 'length' && k != 'name' })")
+    end
+
+    def test_redefine
+      @ctx.define_function("hello") { 1 }
+      @ctx.define_function("hello") { 2 }
+      assert_equal 2, @ctx.eval_string("hello()")
+    end
+
+    def test_realm
+      realm = @ctx.new_realm
+      @ctx.define_function("hello") { 'ctx' }
+      realm.define_function("hello") { 'realm' }
+      assert_equal 'ctx', @ctx.eval_string("hello()")
+      assert_equal 'realm', realm.eval_string("hello()")
+    end
+
+    def test_called_from_realm
+      @ctx.define_function("half") { |x| x / 2 }
+      realm = @ctx.new_realm
+      realm.exec_string('function apply(f, x) { return [f(x), f(x + 2)] }')
+      assert_equal [21, 22], realm.call_prop('apply', @ctx.function('half'), 42)
+      assert @ctx._valid?
+      assert realm._valid?
+    end
+
+    def test_compaction
+      skip "GC.compact isn't available" unless GC.respond_to?(:compact)
+
+      @ctx.define_function("hello") { |name| "hello #{name}" }
+      if GC.respond_to?(:verify_compaction_references)
+        # Moves every movable object
+        GC.verify_compaction_references(expand_heap: true, toward: :empty)
+      else
+        GC.compact
+      end
+      assert_equal "hello world", @ctx.eval_string("hello('world')")
+    end
+
+    def test_many_functions
+      40_000.times { |i| @ctx.define_function("f#{i}") { i } }
+      assert_equal [0, 32_766, 32_767, 39_999], @ctx.eval_string("[f0(), f32766(), f32767(), f39999()]")
+    end
+
+    def test_realms_reuse_entries
+      1000.times do |i|
+        realm = @ctx.new_realm
+        realm.define_function('f') { i }
+        assert_equal i, realm.eval_string('f()')
+        GC.start if i % 100 == 99
+      end
+      assert_operator @ctx._callbacks_len, :<, 1000
+    end
+
+    def test_function_of_garbage_collected_realm
+      keeper = @ctx.new_realm
+      keeper.exec_string('var saved; function save(f) { saved = f }')
+      Thread.new do
+        realm = @ctx.new_realm
+        realm.define_function('f') { 'old' }
+        keeper.call_prop('save', realm.function('f'))
+      end.join
+      3.times { GC.start }
+
+      len = @ctx._callbacks_len
+      realm = @ctx.new_realm
+      realm.define_function('g') { 'new' }
+      skip "realm wasn't garbage collected" if @ctx._callbacks_len > len
+
+      err = assert_raises(Duktape::Error) { keeper.eval_string('saved()') }
+      assert_match(/garbage collected/, err.message)
+      assert_equal 'new', realm.eval_string('g()')
+    end
+
+    def test_is_safe
+      @ctx.define_function("id") { |x| x }
+
+      res = @ctx.eval_string <<-EOF, __FILE__
+        id.state = null
+        id.block = null
+        id("123")
+      EOF
+
+      assert_equal "123", res
+    end
+
+    def test_readme_example
+      @ctx.define_function("leftpad") do |str, n, ch=' '|
+        str.rjust(n, ch)
+      end
+
+      assert_equal "  foo", @ctx.eval_string("leftpad('foo', 5)")
+      assert_equal "foobar", @ctx.eval_string("leftpad('foobar', 6)")
+      assert_equal "01", @ctx.eval_string("leftpad('1', 2, '0')")
+    end
+  end
+
+  describe "#define_object" do
+    class Repository
+      attr_reader :saved
+
+      def find(id)
+        { 'id' => id }
+      end
+
+      def save(*records)
+        @saved = records
+        records.size
+      end
+
+      def admin?
+        true
+      end
+
+      private
+
+      def secret
+        'secret'
+      end
+    end
+
+    before do
+      @repo = Repository.new
+    end
+
+    def test_methods
+      @ctx.define_object('db', @repo, methods: [:find, 'save'])
+      assert_equal({ 'id' => 1 }, @ctx.eval_string('db.find(1)'))
+      assert_equal 2, @ctx.eval_string('db.save({a: 1}, [2])')
+      assert_equal [{ 'a' => 1 }, [2]], @repo.saved
+      assert_equal ['find', 'save'], @ctx.eval_string('Object.keys(db)')
+    end
+
+    def test_default_methods
+      @ctx.define_object('db', @repo)
+      assert_equal ['admin?', 'find', 'save', 'saved'], @ctx.eval_string('Object.keys(db).sort()')
+      assert_equal true, @ctx.eval_string('db["admin?"]()')
+    end
+
+    def test_private_methods
+      err = assert_raises(ArgumentError) { @ctx.define_object('db', @repo, methods: [:secret]) }
+      assert_match(/secret isn't a public method/, err.message)
+      assert_raises(ArgumentError) { @ctx.define_object('k', Object.new, methods: [:system]) }
+      assert_equal 'undefined', @ctx.eval_string('typeof db')
+    end
+
+    def test_method_made_private
+      repo = Repository.new
+      @ctx.define_object('db', repo, methods: [:find])
+      repo.singleton_class.send(:private, :find)
+      err = assert_raises(NoMethodError) { @ctx.eval_string('db.find(1)') }
+      assert_match(/private method/, err.message)
+    end
+
+    def test_call_prop
+      @ctx.define_object('db', @repo, methods: [:find])
+      assert_equal({ 'id' => 'a' }, @ctx.call_prop(['db', 'find'], 'a'))
+    end
+
+    def test_many_arguments
+      @ctx.define_object('db', @repo, methods: [:save])
+      assert_equal 20, @ctx.eval_string('db.save(' + (1..20).to_a.join(', ') + ')')
+      assert_equal (1..20).to_a, @repo.saved
+    end
+
+    def test_invalid_method
+      assert_raises(TypeError) { @ctx.define_object('db', @repo, methods: [1]) }
+    end
+
+    def test_keeps_object
+      @ctx.define_object('db', Repository.new, methods: [:find])
+      GC.start
+      assert_equal({ 'id' => 1 }, @ctx.eval_string('db.find(1)'))
+    end
+
+    def test_realms_reuse_entries
+      1000.times do |i|
+        realm = @ctx.new_realm
+        realm.define_object('db', @repo)
+        assert_equal({ 'id' => i }, realm.eval_string("db.find(#{i})"))
+        GC.start if i % 100 == 99
+      end
+      # Each realm takes 4 entries
+      assert_operator @ctx._callbacks_len, :<, 1000
+    end
+  end
+
+
+  describe "string encoding" do
+    before do
+      @ctx.eval_string('function id(str) { return str }')
+      @ctx.eval_string('function len(str) { return str.length }')
+    end
+
+    def test_string_utf8_encoding
+      str = @ctx.eval_string('"foo"')
+      assert_equal 'foo', str
+      assert_equal Encoding::UTF_8, str.encoding
+    end
+
+    def test_arguments_are_transcoded_to_utf8
+      # "foo" as UTF-16LE bytes
+      str = "\x66\x00\x6f\x00\x6f\00".force_encoding(Encoding::UTF_16LE)
+      str = @ctx.call_prop('id', str)
+      assert_equal 'foo', str
+      assert_equal Encoding::UTF_8, str.encoding
+    end
+
+    def test_surrogate_pairs
+      # Smiling emoji
+      str = "\u{1f604}".encode("UTF-8")
+      assert_equal str, @ctx.call_prop('id', str)
+      assert_equal 2, @ctx.call_prop('len', str)
+      assert_equal str, @ctx.eval_string("'#{str}'")
+      assert_equal 2, @ctx.eval_string("'#{str}'.length")
+
+      # US flag emoji
+      str = "\u{1f1fa}\u{1f1f8}".force_encoding("UTF-8")
+      assert_equal str, @ctx.call_prop('id', str)
+      assert_equal 4, @ctx.call_prop('len', str)
+      assert_equal str, @ctx.eval_string("'#{str}'")
+      assert_equal 4, @ctx.eval_string("'#{str}'.length")
+    end
+
+    def test_arguments_in_other_encodings
+      str = "caf\xe9".force_encoding(Encoding::ISO_8859_1)
+      assert_equal 'café', @ctx.call_prop('id', str)
+      assert_equal 4, @ctx.call_prop('len', str)
+
+      str = 'abc'.encode(Encoding::US_ASCII)
+      assert_equal 'abc', @ctx.call_prop('id', str)
+
+      str = 'abc'.b
+      assert_equal 'abc', @ctx.call_prop('id', str)
+    end
+
+    def test_surrogate_pairs_at_any_offset
+      emoji = "\u{1f604}"
+      20.times do |i|
+        str = ('a' * i) + emoji + ('é' * i) + emoji
+        assert_equal str, @ctx.call_prop('id', str)
+        assert_equal i * 2 + 4, @ctx.call_prop('len', str)
+      end
+    end
+
+    def test_invalid_input_data_at_any_offset
+      20.times do |i|
+        str = ('a' * i) + "\xff" + ('b' * i)
+        assert_raises(EncodingError) do
+          @ctx.call_prop('id', str)
+        end
+      end
+
+      assert_raises(EncodingError) do
+        @ctx.call_prop('id', "caf\xe9".b)
+      end
+    end
+
+    def test_invalid_input_data
+      str = "\xde\xad\xbe\xef".force_encoding('UTF-8')
+      assert_raises(EncodingError) do
+        assert_equal str, @ctx.call_prop('id', str)
+      end
+    end
+
+    def test_valid_output_data
+      ranges = [
+        (0x0000..0xD7FF),
+        (0xE000..0xFFFF),
+        (0x010000..0x10FFFF)
+      ]
+
+      # Pick some code points
+      challenge = []
+      n = 10000
+      n.times do
+        challenge << rand(ranges.sample)
+      end
+
+      str = @ctx.eval_string(<<-JS)
+        var res = [];
+        var codepoints = #{challenge.inspect};
+        for (var i = 0; i < codepoints.length; i++) {
+          var codepoint = codepoints[i];
+          if (codepoint > 0xFFFF) {
+            codepoint -= 0x10000;
+            var highSurrogate = (codepoint >> 10) + 0xD800;
+            var lowSurrogate = (codepoint % 0x400) + 0xDC00;
+            res.push(String.fromCharCode(highSurrogate, lowSurrogate));
+          } else {
+            res.push(String.fromCharCode(codepoints[i]));
+          }
+        }
+        res.join("")
+      JS
+
+      str.each_codepoint do |code|
+        assert_equal challenge.shift, code
+      end
+    end
+
+    def test_invalid_output_data
+      assert_raises(EncodingError) do
+        @ctx.eval_string(<<-JS)
+          ({data:String.fromCharCode(0xD800 + 10)})
+        JS
+      end
+    end
+
+    def test_output_surrogate_pairs_at_any_offset
+      20.times do |i|
+        str = @ctx.eval_string("Array(#{i + 1}).join('a') + '\\ud83d\\ude04' + Array(#{i + 1}).join('\\u00e9') + '\\ud83d\\ude04'")
+        assert_equal ('a' * i) + "\u{1f604}" + ('é' * i) + "\u{1f604}", str
+        assert_equal Encoding::UTF_8, str.encoding
+        assert str.valid_encoding?
+      end
+    end
+
+    def test_invalid_output_surrogates
+      ['"\\udc00"', '"a\\ud800b"', '"\\ud800\\ud800"', '"\\udc00\\ud800"', '"abc\\ud800"'].each do |js|
+        assert_raises(EncodingError) do
+          @ctx.eval_string(js)
+        end
+      end
+    end
+
+    def test_invalid_output_symbol
+      assert_raises(EncodingError) do
+        @ctx.eval_string('Symbol("foo")')
+      end
+    end
+  end
+
+  describe "binary data" do
+    def options
+      super.merge(binary: true)
+    end
+
+    before do
+      @ctx.exec_string('function id(x) { return x }')
+    end
+
+    def test_binary_strings_are_uint8_arrays
+      @ctx.exec_string('function info(arr) { return [arr instanceof Uint8Array, arr.length, arr[0], arr[1]] }')
+      assert_equal [true, 3.0, 0.0, 255.0], @ctx.call_prop('info', "\x00\xff\x41".b)
+    end
+
+    def test_text_without_option
+      ctx = Duktape::Context.new
+      ctx.exec_string('function type(x) { return typeof x }')
+      assert_equal 'string', ctx.call_prop('type', 'abc'.b)
+    end
+
+    def test_round_trip
+      data = Random.new(42).bytes(100_000)
+      res = @ctx.call_prop('id', data)
+      assert_equal data, res
+      assert_equal Encoding::BINARY, res.encoding
+    end
+
+    def test_empty
+      assert_equal ''.b, @ctx.call_prop('id', ''.b)
+    end
+
+    def test_typed_arrays_and_buffers
+      assert_equal "\x01\x02".b, @ctx.eval_string('new Uint8Array([1, 2])')
+      assert_equal "\x00\x00".b, @ctx.eval_string('new ArrayBuffer(2)')
+      assert_equal "\x03".b, @ctx.eval_string('new Uint8Array([1, 2, 3]).subarray(2)')
+      assert_equal [1].pack('s'), @ctx.eval_string('new Int16Array([1])')
+      assert_equal({ 'a' => "\x01".b }, @ctx.eval_string('({a: new Uint8Array([1])})'))
+    end
+
+    def test_kept_by_javascript
+      data = 'hello'.b
+      @ctx.exec_string('var kept; function keep(x) { kept = x }')
+      @ctx.call_prop('keep', data)
+      data << ' world'
+      data = nil
+      GC.start
+      100.times { Array.new(1000) { ' ' * 100 } }
+
+      assert_equal 'hello'.b, @ctx.get_prop('kept')
+    end
+
+    def test_released_by_javascript
+      @ctx.exec_string('var buf; function keep(x) { buf = x.buffer }')
+      @ctx.call_prop('keep', 'abc'.b)
+      @ctx.exec_string('Duktape.gc()')
+
+      assert_equal 'abc'.b, @ctx.get_prop('buf')
+    end
+
+    def test_written_by_javascript
+      data = ('z' * 5000).b.freeze
+      @ctx.exec_string('function write(a) { a[0] = 120; return a }')
+      assert_equal 'x'.b + ('z' * 4999).b, @ctx.call_prop('write', data)
+      assert_equal ('z' * 5000).b, data
+
+      data = 'abc'.b
+      assert_equal 'xbc'.b, @ctx.call_prop('write', data)
+      assert_equal 'abc'.b, data
+    end
+
+    def test_many_strings
+      1000.times do |i|
+        assert_equal 1.0, @ctx.call_prop(['Math', 'min'], 1, [i].pack('N').b.size)
+      end
+      GC.start
+      assert_equal "\x01".b, @ctx.call_prop('id', "\x01".b)
+    end
+
+    def test_binary_hash_keys
+      assert_equal({ 'a' => 1.0 }, @ctx.call_prop('id', 'a'.b => 1))
+    end
+
+    def test_source_is_text
+      assert_equal 2.0, @ctx.eval_string('1 + 1'.b)
+    end
+
+    def test_kept_when_context_is_collected
+      data = 'data'.b
+      ctx = Duktape::Context.new(binary: true)
+      ctx.exec_string('var kept; function keep(x) { kept = x }')
+      ctx.call_prop('keep', data)
+      ctx = nil
+      GC.start
+
+      data << '!'
+      assert_equal 'data!', data
+    end
+  end
+
+  describe "ComplexObject instance" do
+    def test_survives_bad_people
+      Duktape::ComplexObject.instance_variable_set(:@instance, nil)
+      # Generate some garbage
+      100.times { Array.new(1000) { " " * 100 } }
+      GC.start
+      assert Duktape::ComplexObject.instance
+    end
+  end
+
+  describe "CBOR marshalling" do
+    def options
+      super.merge(marshal: :cbor)
+    end
+
+    before do
+      @ctx.exec_string('function id(x) { return x }')
+      @ctx.exec_string('function len(x) { return x.length }')
+    end
+
+    def test_structures
+      obj = { 'a' => [1.0, 2.5, 'b', nil, true, false], 'c' => { 'd' => [] }, 'e' => {} }
+      assert_equal obj, @ctx.call_prop('id', obj)
+      assert_equal obj, @ctx.eval_string('({a: [1, 2.5, "b", null, true, false], c: {d: []}, e: {}})')
+    end
+
+    def test_numbers
+      [0, 1, -1, 23, 24, 255, 256, 65536, 2**32, -(2**40), 2**70, 0.5, 1.1, -0.0, Float::INFINITY, -Float::INFINITY].each do |n|
+        res = @ctx.call_prop('id', n)
+        assert_kind_of Float, res
+        assert_equal n.to_f, res
+      end
+      assert @ctx.call_prop('id', Float::NAN).nan?
+      assert_equal 1e300, @ctx.eval_string('1e300')
+      assert_equal 65504.0, @ctx.eval_string('65504')
+      assert_equal 5.960464477539063e-08, @ctx.eval_string('5.960464477539063e-08')
+    end
+
+    def test_arguments_are_numbers
+      @ctx.exec_string('function type(x) { return typeof x }')
+      assert_equal 'number', @ctx.call_prop('type', 1)
+      assert_equal 3.0, @ctx.call_prop(['Math', 'max'], 1, 3, 2)
+    end
+
+    def test_strings
+      str = "a\u00e9\u{1f604}"
+      assert_equal str, @ctx.call_prop('id', str)
+      assert_equal({ str => [str] }, @ctx.call_prop('id', str => [str]))
+      assert_equal 4.0, @ctx.call_prop('len', str)
+      assert_equal Encoding::UTF_8, @ctx.call_prop('id', 'abc').encoding
+    end
+
+    def test_symbols
+      assert_equal({ 'a' => 'b' }, @ctx.call_prop('id', a: :b))
+    end
+
+    def test_big_objects
+      @ctx.exec_string(<<-JS)
+        function big() {
+          var obj = {};
+          for (var i = 0; i < 100; i++) obj["k" + i] = [i];
+          return obj;
+        }
+      JS
+      expected = 100.times.map { |i| ["k#{i}", [i.to_f]] }.to_h
+      assert_equal expected, @ctx.call_prop('big')
+      assert_equal expected, @ctx.call_prop('id', expected)
+    end
+
+    def test_functions
+      assert_equal({}, @ctx.eval_string('(function() {})'))
+    end
+
+    def test_buffers
+      str = @ctx.eval_string('new Uint8Array([0, 255, 65])')
+      assert_equal "\x00\xffA".b, str
+      assert_equal Encoding::BINARY, str.encoding
+    end
+
+    def test_binary_strings
+      assert_equal ['abc'], @ctx.call_prop('id', ['abc'.b])
+
+      ctx = Duktape::Context.new(**options, binary: true)
+      ctx.exec_string('function id(x) { return x }')
+      data = "\x00\xff\xed\xa0\x80".b
+      assert_equal [data], ctx.call_prop('id', [data])
+      assert_equal({ 'a' => 1.0 }, ctx.call_prop('id', 'a'.b => 1))
+    end
+
+    def test_cyclic
+      assert_raises(Duktape::RangeError) do
+        @ctx.eval_string('var a = []; a[0] = a; a')
+      end
+    end
+
+    def test_function_handle
+      assert_equal [{ 'a' => 1.0 }], @ctx.function('id').call([{ a: 1 }])
     end
 
-    def test_nested_type_error
-      @ctx.eval_string 'a = {}'
+    def test_get_prop
+      @ctx.exec_string('var a = {b: [1]}')
+      assert_equal({ 'b' => [1.0] }, @ctx.get_prop('a'))
+    end
 
-      err = assert_raises(Duktape::TypeError) do
-        @ctx.call_prop(['a', 'missing'])
-      end
+    def test_realm
+      realm = @ctx.new_realm
+      assert_equal({}, realm.eval_string('(function() {})'))
+    end
 
-      assert_equal 'undefined not callable', err.message
+    def test_raw_json
+      assert_equal [1.0], @ctx.call_prop('id', Duktape::RawJSON.new('[1]'))
     end
 
-    def test_unknown_argument_type
-      err = assert_raises(TypeError) do
+    def test_invalid_arguments
+      assert_raises(TypeError) do
         @ctx.call_prop('id', Object.new)
       end
-      assert_match /Object/, err.message
 
       assert_raises(TypeError) do
-        @ctx.call_prop('id', [Object.new])
+        @ctx.call_prop('id', 1 => 2)
       end
 
-      assert_raises(TypeError) do
-        @ctx.call_prop('id', {123 => Object.new})
+      assert_raises(EncodingError) do
+        @ctx.call_prop('id', "\xff")
       end
+    end
 
-      assert_raises(TypeError) do
-        @ctx.call_prop('id', {'key' => Object.new})
+    def test_unknown_mode
+      assert_raises(ArgumentError) do
+        Duktape::Context.new(marshal: :yaml)
       end
     end
   end
 
-  describe "#define_function" do
-    def test_require_name
-      err = assert_raises(ArgumentError) do
-        @ctx.define_function
-      end
-    end
+  describe "object keys" do
+    def test_keys_are_frozen_and_shared
+      a, b = @ctx.eval_string('[{name: 1}, {name: 2}]')
+      assert a.keys.first.frozen?
+      assert_same a.keys.first, b.keys.first
+      assert_same a.keys.first, @ctx.eval_string('({name: 3})').keys.first
+      assert_equal Encoding::UTF_8, a.keys.first.encoding
+    end
+
+    def test_many_keys
+      @ctx.exec_string(<<-JS)
+        function keys(n, prefix) {
+          var obj = {};
+          for (var i = 0; i < n; i++) obj[prefix + i] = i;
+          return obj;
+        }
+      JS
 
-    def test_require_block
-      err = assert_raises(ArgumentError) do
-        @ctx.define_function("hello")
+      3.times do |round|
+        expected = 5000.times.map { |i| ["k#{round}_#{i}", i.to_f] }.to_h
+        assert_equal expected, @ctx.call_prop('keys', 5000, "k#{round}_")
+        GC.start
+        @ctx.exec_string('Duktape.gc()')
       end
+
+      assert_equal({ 'x0' => 0.0 }, @ctx.call_prop('keys', 1, 'x'))
     end
 
-    def test_initial_definition
-      @ctx.define_function "hello" do |a, b|
-        a + b
+    def test_freed_strings
+      100.times do |i|
+        key = "key#{i}"
+        assert_equal({ key => 1.0 }, @ctx.eval_string("var o = {}; o['key' + #{i}] = 1; o"))
+        @ctx.exec_string('o = null; Duktape.gc()')
       end
-      assert_equal 3, @ctx.eval_string("hello(1, 2)", __FILE__)
     end
 
-    def test_without_arguments
-      @ctx.define_function("hello") { 'hello' }
-      assert_equal "hello world", @ctx.eval_string("hello() + ' world'", __FILE__)
+    def test_symbolize_keys
+      ctx = Duktape::Context.new(symbolize_keys: true)
+      assert_equal({ a: 1.0, b: { :'é' => [] } }, ctx.eval_string('({a: 1, b: {"é": []}})'))
+      assert_equal({ a: 1.0 }, ctx.new_realm.eval_string('({a: 1})'))
     end
 
-    def test_with_arguments
-      @ctx.define_function("square") { |x| x * x }
-      assert_equal 4, @ctx.eval_string("square(2)", __FILE__)
+    def test_symbolize_keys_with_cbor
+      ctx = Duktape::Context.new(symbolize_keys: true, marshal: :cbor)
+      assert_equal({ a: [{ b: 1.0 }] }, ctx.eval_string('({a: [{b: 1}]})'))
     end
+  end
 
-    def test_with_2_functions
-      @ctx.define_function("square") { |x| x * x }
-      @ctx.define_function("inc") { |x| x + 1 }
-      assert_equal 5, @ctx.eval_string("inc(square(2))", __FILE__)
+  describe "shared objects" do
+    def test_shared_from_javascript
+      a, b = @ctx.eval_string('var s = {v: 1}; [s, s]')
+      assert_same a, b
     end
 
-    def test_call_prop
-      @ctx.define_function("square") { |x| x * x }
-      @ctx.define_function("inc") { |x| x + 1 }
-      @ctx.eval_string('function math(a) { return square(inc(a)) }')
-      assert_equal 9, @ctx.call_prop('math', 2)
+    def test_cycle_from_javascript
+      obj = @ctx.eval_string('var o = {n: 1, list: []}; o.self = o; o.list.push(o.list, o); o')
+      assert_same obj, obj['self']
+      assert_same obj['list'], obj['list'][0]
+      assert_same obj, obj['list'][1]
     end
 
-    def test_respects_complex_object
-      val = :default
-      @ctx.define_function("t") { |v| val = v; nil }
-      @ctx.exec_string("t(function() { })", __FILE__)
-
-      assert_equal @ctx.complex_object, val
+    def test_shared_from_ruby
+      @ctx.exec_string('function same(a, b) { return a === b }; function pair(x) { return [x[0] === x[1], x[1] === x[2]] }')
+      shared = { a: 1 }
+      assert_equal [true, false], @ctx.call_prop('pair', [shared, shared, { a: 1 }])
+      # Separate arguments are converted separately
+      assert_equal false, @ctx.call_prop('same', shared, shared)
     end
 
-    def test_respects_custom_complex_object
-      @ctx = Duktape::Context.new(complex_object: nil)
-
-      val = :default
-      @ctx.define_function("t") { |v| val = v; nil }
-      @ctx.exec_string("t(function() { })", __FILE__)
-
-      assert_nil val
+    def test_cycle_from_ruby
+      @ctx.exec_string('function check(h) { return h.self === h && h.list[0] === h.list }')
+      hash = { list: [] }
+      hash[:self] = hash
+      hash[:list] << hash[:list]
+      assert_equal true, @ctx.call_prop('check', hash)
     end
 
-    def test_is_safe
-      @ctx.define_function("id") { |x| x }
+    def test_round_trip
+      @ctx.exec_string('function id(x) { return x }')
+      ary = [1]
+      ary << ary
+      res = @ctx.call_prop('id', ary)
+      assert_same res, res[1]
+      assert_equal 1, res[0]
+    end
 
-      res = @ctx.eval_string <<-EOF, __FILE__
-        id.state = null
-        id.block = null
-        id("123")
-      EOF
+    def test_getters_are_not_shared
+      res = @ctx.eval_string('({ get a() { return {q: 1} }, get b() { return {q: 2} } })')
+      assert_equal({ 'a' => { 'q' => 1 }, 'b' => { 'q' => 2 } }, res)
+    end
 
-      assert_equal "123", res
+    def test_getter_calling_ruby
+      @ctx.define_function('count') { |x| x.size }
+      res = @ctx.eval_string <<-JS
+        var s = {v: 1};
+        var o = { a: s, get b() { return count([s, s, {}]) }, c: s };
+        o
+      JS
+      assert_equal 3, res['b']
+      assert_same res['a'], res['c']
     end
 
-    def test_readme_example
-      @ctx.define_function("leftpad") do |str, n, ch=' '|
-        str.rjust(n, ch)
-      end
+    def test_error_during_conversion
+      @ctx.exec_string('var s = {}; var bad = [s, s, {"\ud800": 1}]')
+      assert_raises(EncodingError) { @ctx.get_prop('bad') }
+      a, b = @ctx.eval_string('[s, s]')
+      assert_same a, b
+    end
 
-      assert_equal "  foo", @ctx.eval_string("leftpad('foo', 5)")
-      assert_equal "foobar", @ctx.eval_string("leftpad('foobar', 6)")
-      assert_equal "01", @ctx.eval_string("leftpad('1', 2, '0')")
+    def test_cbor
+      @ctx = Duktape::Context.new(marshal: :cbor)
+      a, b = @ctx.eval_string('var s = {v: 1}; [s, s]')
+      assert_equal a, b
     end
   end
 
+  describe "nesting" do
+    def setup
+      super
+      @ctx.exec_string <<-JS
+        function nested(n) {
+          var root = {}, obj = root;
+          for (var i = 0; i < n; i++) { obj.c = [{}]; obj = obj.c[0] }
+          return root;
+        }
+        function depth(obj) {
+          for (var n = 0; obj.c; n++) obj = obj.c[0];
+          return n;
+        }
+      JS
+    end
 
-  describe "string encoding" do
-    before do
-      @ctx.eval_string('function id(str) { return str }')
-      @ctx.eval_string('function len(str) { return str.length }')
+    def nested(n)
+      root = obj = {}
+      n.times { obj = (obj[:c] = [{}])[0] }
+      root
     end
 
-    def test_string_utf8_encoding
-      str = @ctx.eval_string('"foo"')
-      assert_equal 'foo', str
-      assert_equal Encoding::UTF_8, str.encoding
+    def depth(obj)
+      n = 0
+      n += 1 while (obj = obj['c'] && obj['c'][0])
+      n
     end
 
-    def test_arguments_are_transcoded_to_utf8
-      # "foo" as UTF-16LE bytes
-      str = "\x66\x00\x6f\x00\x6f\00".force_encoding(Encoding::UTF_16LE)
-      str = @ctx.call_prop('id', str)
-      assert_equal 'foo', str
-      assert_equal Encoding::UTF_8, str.encoding
+    def test_deep_values
+      assert_equal 400, depth(@ctx.call_prop('nested', 400))
+      assert_equal 400, @ctx.call_prop('depth', nested(400))
     end
 
-    def test_surrogate_pairs
-      # Smiling emoji
-      str = "\u{1f604}".encode("UTF-8")
-      assert_equal str, @ctx.call_prop('id', str)
-      assert_equal 2, @ctx.call_prop('len', str)
-      assert_equal str, @ctx.eval_string("'#{str}'")
-      assert_equal 2, @ctx.eval_string("'#{str}'.length")
+    def test_default_limit
+      err = assert_raises(Duktape::RangeError) do
+        @ctx.call_prop('nested', 1000)
+      end
+      assert_equal 'nesting of 1001 is too deep', err.message
 
-      # US flag emoji
-      str = "\u{1f1fa}\u{1f1f8}".force_encoding("UTF-8")
-      assert_equal str, @ctx.call_prop('id', str)
-      assert_equal 4, @ctx.call_prop('len', str)
-      assert_equal str, @ctx.eval_string("'#{str}'")
-      assert_equal 4, @ctx.eval_string("'#{str}'.length")
+      assert_raises(Duktape::RangeError) do
+        @ctx.call_prop('depth', nested(1000))
+      end
+
+      # The context is still usable
+      assert_equal 2, @ctx.call_prop('depth', nested(2))
     end
 
-    def test_invalid_input_data
-      str = "\xde\xad\xbe\xef".force_encoding('UTF-8')
-      assert_raises(EncodingError) do
-        assert_equal str, @ctx.call_prop('id', str)
-      end
+    def test_max_depth
+      @ctx = Duktape::Context.new(max_depth: 3)
+      assert_equal [[[1]]], @ctx.eval_string('[[[1]]]')
+      assert_raises(Duktape::RangeError) { @ctx.eval_string('[[[[1]]]]') }
+      assert_raises(Duktape::RangeError) { @ctx.eval_string('({a: {b: {c: {}}}})') }
+
+      @ctx.exec_string('function id(x) { return x }')
+      assert_equal [[[1]]], @ctx.call_prop('id', [[[1]]])
+      assert_raises(Duktape::RangeError) { @ctx.call_prop('id', [[[[1]]]]) }
+      assert_raises(Duktape::RangeError) { @ctx.call_prop('id', a: { b: { c: {} } }) }
     end
 
-    def test_valid_output_data
-      ranges = [
-        (0x0000..0xD7FF),
-        (0xE000..0xFFFF),
-        (0x010000..0x10FFFF)
-      ]
+    def test_very_deep_values
+      @ctx = Duktape::Context.new(max_depth: 100_000)
+      @ctx.exec_string('function id(x) { return x }')
+      deep = [[1]]
+      50_000.times { deep = [deep] }
 
-      # Pick some code points
-      challenge = []
-      n = 10000
-      n.times do
-        challenge << rand(ranges.sample)
-      end
+      res = @ctx.call_prop('id', deep)
+      n = 0
+      n += 1 while (res = res[0]).is_a?(Array)
+      assert_equal 50_001, n
+    end
 
-      str = @ctx.eval_string(<<-JS)
-        var res = [];
-        var codepoints = #{challenge.inspect};
-        for (var i = 0; i < codepoints.length; i++) {
-          var codepoint = codepoints[i];
-          if (codepoint > 0xFFFF) {
-            codepoint -= 0x10000;
-            var highSurrogate = (codepoint >> 10) + 0xD800;
-            var lowSurrogate = (codepoint % 0x400) + 0xDC00;
-            res.push(String.fromCharCode(highSurrogate, lowSurrogate));
-          } else {
-            res.push(String.fromCharCode(codepoints[i]));
-          }
-        }
-        res.join("")
-      JS
+    def test_invalid_max_depth
+      assert_raises(ArgumentError) { Duktape::Context.new(max_depth: 0) }
+      assert_raises(TypeError) { Duktape::Context.new(max_depth: 'a') }
+    end
 
-      str.each_codepoint do |code|
-        assert_equal challenge.shift, code
-      end
+    def test_realm
+      @ctx = Duktape::Context.new(max_depth: 2)
+      assert_raises(Duktape::RangeError) { @ctx.new_realm.eval_string('[[[1]]]') }
     end
 
-    def test_invalid_output_data
-      assert_raises(EncodingError) do
-        @ctx.eval_string(<<-JS)
-          ({data:String.fromCharCode(0xD800 + 10)})
-        JS
+    def test_cbor
+      @ctx = Duktape::Context.new(marshal: :cbor, max_depth: 3)
+      @ctx.exec_string('function id(x) { return x }')
+      assert_equal [[[1]]], @ctx.call_prop('id', [[[1]]])
+      assert_raises(Duktape::RangeError) { @ctx.call_prop('id', [[[[1]]]]) }
+      assert_raises(Duktape::RangeError) { @ctx.eval_string('[[[[1]]]]') }
+    end
+
+    def test_cbor_max_depth
+      assert Duktape::Context.new(marshal: :cbor, max_depth: 1000)
+      err = assert_raises(ArgumentError) do
+        Duktape::Context.new(marshal: :cbor, max_depth: 10_000_000)
       end
+      assert_equal "max_depth can't be more than 1000 with marshal: :cbor", err.message
     end
-  end
 
-  describe "ComplexObject instance" do
-    def test_survives_bad_people
-      Duktape::ComplexObject.instance_variable_set(:@instance, nil)
-      # Generate some garbage
-      100.times { Array.new(1000) { " " * 100 } }
-      GC.start
-      assert Duktape::ComplexObject.instance
+    def test_cbor_very_deep_values
+      @ctx = Duktape::Context.new(marshal: :cbor, max_depth: 1000)
+      @ctx.exec_string('function id(x) { return x }')
+      deep = [1]
+      300_000.times { deep = [deep] }
+      assert_raises(Duktape::RangeError) { @ctx.call_prop('id', deep) }
+
+      deep = {}
+      300_000.times { deep = { a: deep } }
+      assert_raises(Duktape::RangeError) { @ctx.call_prop('id', deep) }
+
+      deep = [1]
+      900.times { deep = [deep] }
+      res = @ctx.call_prop('id', deep)
+      n = 0
+      n += 1 while (res = res[0]).is_a?(Array)
+      assert_equal 900, n
     end
   end
 
@@ -640,6 +2404,347 @@ class TestDuktape < Minitest::Spec
     end
   end
 
+  describe "Pool" do
+    def test_reuses_contexts
+      setups = 0
+      pool = Duktape::Pool.new(size: 2, setup: ->(ctx) { setups += 1; ctx.exec_string('var n = 0') })
+      assert_equal [1, 2, 3], 3.times.map { pool.with { |ctx| ctx.eval_string('++n') } }
+      assert_equal 1, setups
+      assert_equal 1, pool.stats[:created]
+    end
+
+    def test_bounded
+      pool = Duktape::Pool.new(size: 2)
+      a = pool.checkout
+      b = pool.checkout
+      refute_same a, b
+      assert_raises(Duktape::Pool::TimeoutError) { pool.checkout(timeout: 0.01) }
+
+      waiter = Thread.new { pool.with { |ctx| ctx } }
+      Thread.pass until pool.stats[:waiting] == 1
+      pool.checkin(a)
+      assert_same a, waiter.value
+
+      stats = pool.stats
+      assert_equal 2, stats[:created]
+      assert_equal 1, stats[:in_use]
+      assert_equal 1, stats[:timeouts]
+      assert_equal 3, stats[:checkouts]
+      assert_operator stats[:max_wait_time], :>, 0
+      pool.checkin(b)
+    end
+
+    def test_parallel
+      pool = Duktape::Pool.new(size: 3, setup: ->(ctx) { ctx.exec_string('function sq(x) { return x * x }') })
+      results = 10.times.map { |i| Thread.new { pool.with { |ctx| ctx.call_prop('sq', i) } } }.map(&:value)
+      assert_equal (0...10).map { |i| i * i }, results
+      assert_operator pool.stats[:created], :<=, 3
+      assert_equal 0, pool.stats[:in_use]
+    end
+
+    def test_min
+      created = 0
+      pool = Duktape::Pool.new(size: 3, min: 2, setup: ->(ctx) { created += 1 })
+      assert_equal 2, created
+      assert_equal({ created: 2, idle: 2 }, pool.stats.slice(:created, :idle))
+    end
+
+    def test_template
+      template = Duktape::Template.new.exec_string('var a = 1')
+      pool = Duktape::Pool.new(size: 1, template: template)
+      assert_equal 1, pool.with { |ctx| ctx.get_prop('a') }
+      assert_raises(ArgumentError) { Duktape::Pool.new(size: 1, template: template, max_depth: 10) }
+    end
+
+    def test_options
+      pool = Duktape::Pool.new(size: 1, symbolize_keys: true)
+      assert_equal({ a: 1 }, pool.with { |ctx| ctx.eval_string('({a: 1})') })
+    end
+
+    def test_reset
+      pool = Duktape::Pool.new(size: 1, reset: true)
+      pool.with { |ctx| ctx.exec_string('var a = 1') }
+      assert_equal 'undefined', pool.with { |ctx| ctx.eval_string('typeof a') }
+    end
+
+    def test_reset_callable
+      pool = Duktape::Pool.new(size: 1, reset: ->(ctx) { ctx.exec_string('delete globalThis.a; if (globalThis.broken) throw 1') })
+      first = pool.with { |ctx| ctx.exec_string('a = 1'); ctx }
+      assert_same first, pool.with { |ctx| assert_equal 'undefined', ctx.eval_string('typeof a'); ctx }
+      pool.with { |ctx| ctx.exec_string('broken = true') }
+      refute_same first, pool.with { |ctx| ctx }
+    end
+
+    def test_discards_broken_contexts
+      pool = Duktape::Pool.new(size: 1)
+      broken = nil
+      assert_raises(Duktape::InternalError) do
+        pool.with do |ctx|
+          broken = ctx
+          ctx.define_function('fatal') { ctx._invoke_fatal }
+          ctx.exec_string('fatal()')
+        end
+      end
+      refute_same broken, pool.with { |ctx| ctx }
+      assert_equal 1, pool.stats[:created]
+    end
+
+    def test_failed_setup
+      pool = Duktape::Pool.new(size: 1, setup: ->(ctx) { raise 'nope' })
+      2.times { assert_raises(RuntimeError) { pool.checkout(timeout: 0) } }
+      assert_equal 0, pool.stats[:created]
+    end
+
+    def test_idle_eviction
+      pool = Duktape::Pool.new(size: 3, min: 1, idle_timeout: 0)
+      contexts = 3.times.map { pool.checkout }
+      contexts.each { |ctx| pool.checkin(ctx) }
+      assert_equal 1, pool.stats[:created]
+      assert_equal 2, pool.stats[:evicted]
+      assert_equal 0, pool.evict_idle
+    end
+
+    def test_foreign_context
+      pool = Duktape::Pool.new(size: 1)
+      assert_raises(ArgumentError) { pool.checkin(Duktape::Context.new) }
+    end
+
+    def test_utilization
+      pool = Duktape::Pool.new(size: 2)
+      ctx = pool.checkout
+      sleep 0.02
+      utilization = pool.stats[:utilization]
+      assert_operator utilization, :>, 0.3
+      assert_operator utilization, :<=, 0.5
+      pool.checkin(ctx)
+    end
+
+    def test_invalid_size
+      assert_raises(ArgumentError) { Duktape::Pool.new(size: 0) }
+      assert_raises(ArgumentError) { Duktape::Pool.new(size: 1, min: 2) }
+    end
+  end
+
+  describe "threads" do
+    # The GVL is only released while other threads exist
+    def with_other_thread
+      thread = Thread.new { sleep }
+      yield
+    ensure
+      thread.kill.join
+    end
+
+    def test_separate_contexts
+      results = 4.times.map do |i|
+        Thread.new do
+          ctx = Duktape::Context.new
+          ctx.define_function('id') { |x| x }
+          ctx.eval_string("var s = 0; for (var j = 0; j < 10000; j++) s += id(#{i}); s")
+        end
+      end.map(&:value)
+      assert_equal [0, 10000, 20000, 30000], results
+    end
+
+    def test_shared_context
+      @ctx.define_function('id') { |x| x }
+      @ctx.exec_string('var n = 0; function add(x) { var v = n; for (var i = 0; i < 100; i++) id(i); n = v + x; return n }')
+      8.times.map do
+        Thread.new { 50.times { @ctx.call_prop('add', 1) } }
+      end.each(&:join)
+      assert_equal 400, @ctx.get_prop('n')
+    end
+
+    def test_shared_heap
+      realms = Array.new(4) { @ctx.new_realm }
+      realms.each_with_index.map do |realm, i|
+        Thread.new do
+          realm.exec_string("var n = #{i}")
+          100.times { realm.exec_string('n += 1') }
+          realm.eval_string('n')
+        end
+      end.map(&:value).then { |values| assert_equal [100, 101, 102, 103], values }
+    end
+
+    def test_nested_call
+      with_other_thread do
+        @ctx.define_function('twice') { |x| @ctx.call_prop('double', x) * 2 }
+        @ctx.exec_string('function double(x) { return x * 2 }')
+        assert_equal 12, @ctx.eval_string('twice(3)')
+      end
+    end
+
+    def test_ruby_exception
+      with_other_thread do
+        @ctx.define_function('fail') { 1 / 0 }
+        assert_raises(ZeroDivisionError) { @ctx.eval_string('fail()') }
+        assert_equal 'Error: ZeroDivisionError: divided by 0',
+                     @ctx.eval_string('try { fail() } catch (e) { String(e) }')
+      end
+    end
+
+    def test_ruby_exception_replaced_in_javascript
+      @ctx.define_function('fail') { raise ArgumentError, 'bad' }
+      err = assert_raises(Duktape::TypeError) do
+        @ctx.eval_string('try { fail() } catch (e) { null.foo }')
+      end
+      assert_includes err.message, 'null'
+    end
+
+    def test_throw
+      @ctx.define_function('jump') { throw :done }
+      assert_raises(LocalJumpError) do
+        catch(:done) { @ctx.eval_string('jump()') }
+      end
+    end
+
+    def test_fatal
+      @require_valid = false
+      with_other_thread do
+        @ctx.define_function("fatal") { @ctx._invoke_fatal }
+        assert_raises(Duktape::InternalError) { @ctx.exec_string("fatal()") }
+        assert_raises(Duktape::InternalError) { @ctx.exec_string("1 + 1") }
+      end
+    end
+  end
+
+  describe "Executor" do
+    def setup
+      super
+      @executor = Duktape::Executor.new(threads: 3, setup: ->(ctx) {
+        ctx.exec_string('function sq(x) { return x * x }; var util = { join: function(a, s) { return a.join(s) } }')
+      })
+    end
+
+    def teardown
+      @executor.shutdown
+      super
+    end
+
+    def test_submit
+      futures = 20.times.map { |i| @executor.submit('sq', i) }
+      assert_equal (0...20).map { |i| i * i }, futures.map(&:value)
+      assert futures.all?(&:done?)
+
+      assert_equal "a-b", @executor.submit(['util', 'join'], ['a', 'b'], '-').value
+      assert_equal({ "a" => [1, nil] }, @executor.submit('JSON.parse'.split('.'), '{"a": [1, null]}').value)
+      assert_equal "\u{1F600}", @executor.submit(['String', 'fromCodePoint'], 0x1F600).value
+    end
+
+    def test_errors
+      assert_raises(Duktape::ReferenceError) { @executor.submit('missing').value }
+      err = assert_raises(Duktape::TypeError) { @executor.submit(['util', 'missing', 'x']).value }
+      assert_equal "invalid base value", err.message
+      assert_raises(Duktape::URIError) { @executor.submit('decodeURIComponent', '%').value }
+
+      # The same exception is raised again
+      future = @executor.submit('missing')
+      assert_same assert_raises(Duktape::ReferenceError) { future.value },
+        assert_raises(Duktape::ReferenceError) { future.value }
+
+      assert_raises(TypeError) { @executor.submit(42) }
+      assert_raises(TypeError) { @executor.submit('sq', Object.new) }
+    end
+
+    def test_timeout
+      ctx_setup = ->(ctx) { ctx.exec_string('function spin(ms) { var end = Date.now() + ms; while (Date.now() < end); return ms }') }
+      executor = Duktape::Executor.new(threads: 1, setup: ctx_setup)
+      future = executor.submit('spin', 200)
+      assert_raises(Duktape::Future::TimeoutError) { future.value(0.01) }
+      assert_nil future.wait(0)
+      assert_same future, future.wait
+      assert_equal 200, future.value(0)
+    ensure
+      executor.shutdown if executor
+    end
+
+    def test_shutdown
+      futures = 10.times.map { |i| @executor.submit('sq', i) }
+      @executor.shutdown
+      assert @executor.shutdown?
+      assert_equal({ threads: 0, queued: 0, running: 0, completed: 10 }, @executor.stats)
+      assert_equal (0...10).map { |i| i * i }, futures.map(&:value)
+      assert_raises(RuntimeError) { @executor.submit('sq', 1) }
+    end
+
+    def test_garbage_collected
+      ctx_setup = ->(ctx) { ctx.exec_string('function spin(ms) { var end = Date.now() + ms; while (Date.now() < end); return ms }') }
+      running, queued = nil
+      Thread.new do
+        executor = Duktape::Executor.new(threads: 1, setup: ctx_setup)
+        running = executor.submit('spin', 500)
+        queued = executor.submit('spin', 1)
+        running.wait(0.05)
+      end.join
+
+      # Freeing the executor doesn't wait for the running job
+      started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      10.times { GC.start unless queued.done? }
+      skip "executor wasn't garbage collected" unless queued.done?
+      assert_operator Process.clock_gettime(Process::CLOCK_MONOTONIC) - started, :<, 0.4
+
+      err = assert_raises(Duktape::InternalError) { queued.value }
+      assert_equal "executor was garbage collected", err.message
+      assert_equal 500, running.value
+    end
+
+    def test_contexts
+      ctx = nil
+      executor = Duktape::Executor.new(threads: 1, setup: ->(c) { ctx = c })
+      err = assert_raises(RuntimeError) { ctx.eval_string('1') }
+      assert_equal "context is used by an executor", err.message
+      assert_raises(RuntimeError) { ctx.define_function('f') { } }
+      executor.shutdown
+
+      contexts = []
+      err = assert_raises(ArgumentError) do
+        Duktape::Executor.new(threads: 2, setup: ->(c) {
+          contexts << c
+          c.define_function('f') { } if contexts.size == 2
+        })
+      end
+      assert_match(/functions defined in Ruby/, err.message)
+      # Contexts are given back when the executor can't start
+      assert_equal 2, contexts[0].eval_string('1 + 1')
+
+      template = Duktape::Template.new(symbolize_keys: true).exec_string('function obj() { return {a: 1} }')
+      executor = Duktape::Executor.new(threads: 2, template: template)
+      assert_equal({ a: 1 }, executor.submit('obj').value)
+      executor.shutdown
+
+      assert_raises(ArgumentError) { Duktape::Executor.new(threads: 0) }
+    end
+  end
+
+  describe "Ractor" do
+    def ractor_value(ractor)
+      ractor.respond_to?(:value) ? ractor.value : ractor.take
+    end
+
+    def test_contexts_in_ractors
+      skip "Ractor isn't available" unless defined?(Ractor)
+
+      experimental = Warning[:experimental]
+      Warning[:experimental] = false
+
+      script = Ractor.make_shareable(Duktape::Script.compile('function sq(x) { return x * x }'))
+
+      ractors = 3.times.map do |i|
+        Ractor.new(script, i) do |script, i|
+          ctx = Duktape::Context.new
+          ctx.exec_script(script)
+          ctx.define_function('inc') { |x| x + 1 }
+          [ctx.eval_string("inc(sq(#{i}))"), ctx.eval_string('({a: [function() {}]})')['a'][0]]
+        end
+      end
+
+      ractors.each_with_index do |ractor, i|
+        assert_equal [i * i + 1, Duktape::ComplexObject.instance], ractor_value(ractor)
+      end
+    ensure
+      Warning[:experimental] = experimental if defined?(Ractor)
+    end
+  end
+
   describe "fatal handler" do
     def test_invoke_fatal
       @require_valid = false
@@ -706,6 +2811,14 @@ class TestDuktape < Minitest::Spec
       assert_equal 64, @ctx.call_prop(["CoffeeScript", "eval"], "((x) -> x * x)(8)")
     end
 
+    def test_babel_script
+      assert source = File.read(File.expand_path("../fixtures/babel.js", __FILE__))
+
+      script = Duktape::Script.compile(source, "(execjs)")
+      @ctx.exec_script(script)
+      assert_equal 64, @ctx.call_prop(["babel", "eval"], "((x) => x * x)(8)")
+    end
+
     def test_uglify
       assert source = File.read(File.expand_path("../fixtures/uglify.js", __FILE__))
 